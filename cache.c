@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2012, Todd Hayton <thayton@neekanee.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Front cache for ptrie_get() on tries where a few keys take most
+ * of the lookups (PTRIEPARM_CACHESZ).
+ *
+ * The cache is set associative: a set is one cache line of 
+ * PCACHE_WAYS entries, each holding the hash of a key and the 
+ * leaf it was found in. A lookup hashes the key, reads its set
+ * and compares the key against the leaf of an entry with the 
+ * same hash, so a hot key costs the set, the leaf and its key
+ * instead of a walk down the trie.
+ *
+ * Keys found by a walk go in the last way of their set, and an
+ * entry that hits trades places with the one before it, so keys
+ * that keep hitting work their way to the front while keys seen
+ * once only push each other out.
+ *
+ * Entries are dropped when their leaf is released. That is only
+ * right if deleting a key releases its leaf at once, so there is
+ * no cache on concurrent and persistent tries, whose leaves are
+ * retired, nor on Sedgewick tries, where keys move between nodes.
+ * Lookups change the cache, so it is for single threaded use.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "patricia.h"
+#include "patriciaP.h"
+
+#define PCACHE_LINESZ 64
+#define PCACHE_WAYS   (PCACHE_LINESZ / sizeof(pcent_t))
+
+typedef struct pcent {
+    uint32_t ce_hash;
+    pidx_t   ce_leaf;   /* PN_NIL if the entry is empty */
+} pcent_t;
+
+struct pcache {
+    pcent_t  *pc_ent;   /* sets, aligned on a cache line */
+    void     *pc_mem;   /* what was allocated for them */
+    uint32_t  pc_mask;  /* number of sets - 1 */
+    uint64_t  pc_hits;
+    uint64_t  pc_misses;
+};
+
+static uint32_t pcache_hash(void *key, size_t keysz);
+
+/***********************************************************###**
+ * Set up a cache of at least n entries, or drop the cache if n 
+ * is 0. Returns -1 with errno set to EINVAL if the trie can't 
+ * have one.
+ ***********************************************************###*/
+int
+pcache_init(ptrie_t *pt, size_t n)
+{
+    pcache_t *pc;
+    size_t    nsets = 1;
+    size_t    size;
+
+    if (pt->pt_flags & (PTRIE_F_SEDGEWICK | PTRIE_F_CONCURRENT | PTRIE_F_PERSISTENT)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pcache_destroy(pt);
+    if (n == 0)
+        return 0;
+
+    while (nsets * PCACHE_WAYS < n)
+        nsets *= 2;
+
+    size = nsets * PCACHE_LINESZ;
+
+    pc = pt->pt_malloc_func(sizeof(*pc));
+    pc->pc_mem = pt->pt_malloc_func(size + PCACHE_LINESZ - 1);
+    pc->pc_ent = (pcent_t *)(((uintptr_t)pc->pc_mem + PCACHE_LINESZ - 1) & 
+                             ~(uintptr_t)(PCACHE_LINESZ - 1));
+    pc->pc_mask = nsets - 1;
+    pc->pc_hits = 0;
+    pc->pc_misses = 0;
+    memset(pc->pc_ent, 0, size);
+
+    pt->pt_cache = pc;
+    return 0;
+}
+
+void
+pcache_destroy(ptrie_t *pt)
+{
+    pcache_t *pc = pt->pt_cache;
+
+    if (NOT pc)
+        return;
+
+    pt->pt_free_func(pc->pc_mem);
+    pt->pt_free_func(pc);
+    pt->pt_cache = NULL;
+}
+
+/***********************************************************###**
+ * Forget every entry, for ptrie_reset()
+ ***********************************************************###*/
+void
+pcache_reset(ptrie_t *pt)
+{
+    pcache_t *pc = pt->pt_cache;
+
+    memset(pc->pc_ent, 0, (pc->pc_mask + 1) * PCACHE_LINESZ);
+}
+
+/***********************************************************###**
+ * Leaf holding key, or PN_NIL if the key isn't in the cache. The
+ * key's hash is left in *hash for pcache_put().
+ ***********************************************************###*/
+pidx_t
+pcache_get(ptrie_t *pt, void *key, size_t keysz, uint32_t *hash)
+{
+    pcache_t *pc = pt->pt_cache;
+    pcent_t  *set;
+    pcent_t   ce;
+    pleaf_t  *pl;
+    uint32_t  h;
+    size_t    w;
+
+    h = pcache_hash(key, keysz);
+    set = &pc->pc_ent[(h & pc->pc_mask) * PCACHE_WAYS];
+    *hash = h;
+
+    for (w = 0; w < PCACHE_WAYS; w++) {
+        if (set[w].ce_hash != h || set[w].ce_leaf == PN_NIL)
+            continue;
+
+        pl = pn_leaf(pt, set[w].ce_leaf);
+        if (NOT keyseq(key, keysz, pl->pl_key, pl->pl_keysz))
+            continue;
+
+        ce = set[w];
+        if (w > 0) {
+            set[w] = set[w - 1];
+            set[w - 1] = ce;
+        }
+
+        pc->pc_hits++;
+        return ce.ce_leaf;
+    }
+
+    pc->pc_misses++;
+    return PN_NIL;
+}
+
+/***********************************************************###**
+ * Remember that the key with this hash is in leaf x
+ ***********************************************************###*/
+void
+pcache_put(ptrie_t *pt, uint32_t hash, pidx_t x)
+{
+    pcache_t *pc = pt->pt_cache;
+    pcent_t  *set;
+
+    set = &pc->pc_ent[(hash & pc->pc_mask) * PCACHE_WAYS];
+    set[PCACHE_WAYS - 1].ce_hash = hash;
+    set[PCACHE_WAYS - 1].ce_leaf = x;
+}
+
+/***********************************************************###**
+ * Drop the entry for leaf x, which is about to be released
+ ***********************************************************###*/
+void
+pcache_del(ptrie_t *pt, pidx_t x)
+{
+    pcache_t *pc = pt->pt_cache;
+    pleaf_t  *pl = pn_leaf(pt, x);
+    pcent_t  *set;
+    uint32_t  h;
+    size_t    w;
+
+    h = pcache_hash(pl->pl_key, pl->pl_keysz);
+    set = &pc->pc_ent[(h & pc->pc_mask) * PCACHE_WAYS];
+
+    for (w = 0; w < PCACHE_WAYS; w++) {
+        if (set[w].ce_leaf == x) {
+            set[w].ce_hash = 0;
+            set[w].ce_leaf = PN_NIL;
+        }
+    }
+}
+
+size_t
+pcache_size(ptrie_t *pt)
+{
+    pcache_t *pc = pt->pt_cache;
+
+    return pc ? (pc->pc_mask + 1) * PCACHE_WAYS : 0;
+}
+
+void
+pcache_stats(ptrie_t *pt, ptrie_stats_t *st)
+{
+    pcache_t *pc = pt->pt_cache;
+
+    st->cachesz = pcache_size(pt);
+    st->cache_hits = pc->pc_hits;
+    st->cache_misses = pc->pc_misses;
+    st->bytes += (pc->pc_mask + 1) * PCACHE_LINESZ + PCACHE_LINESZ - 1;
+}
+
+/*
+ * 64 bits of the key at a time, multiplied and folded down
+ */
+static uint32_t
+pcache_hash(void *key, size_t keysz)
+{
+    uint8_t *p = key;
+    uint64_t h = keysz * 0x9e3779b97f4a7c15ULL;
+    uint64_t w;
+
+    for (; keysz >= 8; keysz -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+
+    if (keysz) {
+        w = 0;
+        memcpy(&w, p, keysz);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    }
+
+    h ^= h >> 29;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return (uint32_t)(h >> 32);
+}
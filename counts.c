@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2012, Todd Hayton <thayton@neekanee.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * PTRIE_F_COUNTS mode: each internal node keeps the number of 
+ * keys below it, in the chunk trailer of the node pool (see 
+ * pnpool_count()) so that tries without counts don't pay for 
+ * them. A leaf counts as 1.
+ *
+ * An add or delete changes the counts of the nodes on the path
+ * from the root to the key, which it already visited, so keeping
+ * them costs O(depth). ptrie_build_sorted() builds the trie 
+ * without them and recounts it once at the end; the set 
+ * operations and ptrie_build_parallel() set the count of each 
+ * node they make from its children with pn_count_set().
+ *
+ * With the counts, the keys with a prefix are counted by finding
+ * the subtree that holds them, the position of a key is the sum 
+ * of the counts of the left subtrees hanging off its path, and
+ * the i-th key is found by going down the side whose count 
+ * covers i. Each takes one or two trips down or up the trie.
+ *
+ * In concurrent mode readers may see counts that are off while
+ * a writer is updating the path.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "patricia.h"
+#include "patriciaP.h"
+
+uint32_t
+pn_count(ptrie_t *pt, pidx_t x)
+{
+    return PN_ISLEAF(x) ? 1 : PN_LOAD(pnpool_count(&pt->pt_nodes, x));
+}
+
+/***********************************************************###**
+ * Add delta to the counts of x and every node above it
+ ***********************************************************###*/
+void
+pn_count_add(ptrie_t *pt, pidx_t x, int delta)
+{
+    uint32_t *cnt;
+
+    for (; x != PN_NIL; x = pn_node(pt, x)->pn_up) {
+        cnt = pnpool_count(&pt->pt_nodes, x);
+        PN_STORE(cnt, *cnt + delta);
+    }
+}
+
+/***********************************************************###**
+ * Set the count of x from the counts of its children
+ ***********************************************************###*/
+void
+pn_count_set(ptrie_t *pt, pidx_t x)
+{
+    pnode_t *pn = pn_node(pt, x);
+
+    *pnpool_count(&pt->pt_nodes, x) = 
+        pn_count(pt, pn->pn_cld[0]) + pn_count(pt, pn->pn_cld[1]);
+}
+
+/***********************************************************###**
+ * Set the counts of every node below x from scratch. Returns the 
+ * number of keys below x.
+ ***********************************************************###*/
+uint32_t
+pn_recount(ptrie_t *pt, pidx_t x)
+{
+    pnode_t *pn;
+    uint32_t n;
+
+    if (x == PN_NIL)
+        return 0;
+    if (PN_ISLEAF(x))
+        return 1;
+
+    pn = pn_node(pt, x);
+    n = pn_recount(pt, pn->pn_cld[0]) + pn_recount(pt, pn->pn_cld[1]);
+    PN_STORE(pnpool_count(&pt->pt_nodes, x), n);
+
+    return n;
+}
+
+/***********************************************************###**
+ * Number of keys whose first nbits bits are those of prefix, or
+ * -1 with errno set to EINVAL if the trie has no counts.
+ ***********************************************************###*/
+int
+ptrie_count_prefix(ptrie_t *pt, void *prefix, size_t nbits)
+{
+    return ptrie_count_prefix_len(pt, prefix, keysize(pt, prefix), nbits);
+}
+
+int
+ptrie_count_prefix_len(ptrie_t *pt, void *prefix, size_t pfxsz, size_t nbits)
+{
+    pidx_t   root;
+    pidx_t   x;
+    pidx_t   in;
+    pleaf_t *pl;
+    int      diffbit;
+
+    if (NOT (pt->pt_flags & PTRIE_F_COUNTS)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((root = PN_LOAD(&pt->pt_root)) == PN_NIL)
+        return 0;
+
+    /* 
+     * The search only tests the bits of prefix up to nbits until 
+     * it's in a subtree whose keys all share their first nbits,
+     * so it ends at a matching key if there is one
+     */
+    x = pn_search(pt, root, prefix, pfxsz);
+    pl = pn_leaf(pt, x);
+
+    diffbit = ABSVAL(keycmp(prefix, pfxsz, pl->pl_key, pl->pl_keysz));
+    if (diffbit != 0 && (size_t)diffbit <= nbits)
+        return 0;
+
+    for (in = pn_parent(pt, x); in != PN_NIL && nbits < pn_node(pt, in)->pn_bit; in = pn_parent(pt, in))
+        x = in;
+
+    return pn_count(pt, x);
+}
+
+/***********************************************************###**
+ * Number of keys less than key, which is the position of key in
+ * key order (from 0) if it is in the trie. Returns -1 with errno
+ * set to EINVAL if the trie has no counts.
+ ***********************************************************###*/
+int
+ptrie_rank(ptrie_t *pt, void *key)
+{
+    return ptrie_rank_len(pt, key, keysize(pt, key));
+}
+
+int
+ptrie_rank_len(ptrie_t *pt, void *key, size_t keysz)
+{
+    pidx_t   root;
+    pidx_t   x;
+    pidx_t   up;
+    pnode_t *pn;
+    int      rank = 0;
+
+    if (NOT (pt->pt_flags & PTRIE_F_COUNTS)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((root = PN_LOAD(&pt->pt_root)) == PN_NIL)
+        return 0;
+
+    if ((x = pn_bound(pt, root, key, keysz, 0)) == PN_NIL)
+        return pt->pt_size;
+
+    /* add up the left subtrees on the way from x to the root */
+    for (up = pn_parent(pt, x); up != PN_NIL; x = up, up = pn_parent(pt, up)) {
+        pn = pn_node(pt, up);
+        if (PN_LOAD(&pn->pn_cld[1]) == x)
+            rank += pn_count(pt, PN_LOAD(&pn->pn_cld[0]));
+    }
+
+    return rank;
+}
+
+/***********************************************************###**
+ * The i-th key in key order, counting from 0. Returns 0 if i is 
+ * out of range (or, with errno set to EINVAL, if the trie has no
+ * counts), else sets *rkey and *rval if they aren't NULL and 
+ * returns 1.
+ ***********************************************************###*/
+int
+ptrie_select(ptrie_t *pt, int i, void **rkey, void **rval)
+{
+    pidx_t   x;
+    pidx_t   lc;
+    uint32_t n;
+    pleaf_t *pl;
+
+    if (NOT (pt->pt_flags & PTRIE_F_COUNTS)) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if (i < 0 || (size_t)i >= pt->pt_size || (x = PN_LOAD(&pt->pt_root)) == PN_NIL)
+        return 0;
+
+    while (NOT PN_ISLEAF(x)) {
+        lc = PN_LOAD(&pn_node(pt, x)->pn_cld[0]);
+        n = pn_count(pt, lc);
+
+        if ((uint32_t)i < n) {
+            x = lc;
+        } else {
+            i -= n;
+            x = PN_LOAD(&pn_node(pt, x)->pn_cld[1]);
+        }
+    }
+
+    pl = pn_leaf(pt, x);
+    if (rkey)
+        *rkey = pl->pl_key;
+    if (rval)
+        *rval = pl->pl_val;
+
+    return 1;
+}
@@ -0,0 +1,613 @@
+/*
+ * Copyright (c) 2012, Todd Hayton <thayton@neekanee.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Frozen tries: a read-only copy of a ptrie compiled into one 
+ * contiguous image that holds no pointers.
+ *
+ * The shape of a PATRICIA trie is fixed by its keys: listed in
+ * order, the internal node between keys i-1 and i tests the 
+ * first bit at which they differ, and a node's parent is the
+ * nearer of its neighbours with a smaller bit. ptrie_freeze() 
+ * rebuilds the trie from the sorted keys this way, whatever the
+ * node representation of the source trie, and lays it out as:
+ *
+ *  - leaves in key order, so iterating over a subtree is a scan
+ *    over a run of leaves
+ *  - internal nodes in breadth first order, so the top levels 
+ *    of the trie, which every lookup visits, share a handful of
+ *    cache lines
+ *  - the keys themselves, packed back to back
+ *
+ *  - values, if PTRIEPARM_VALSZ_FUNC says how big they are
+ *
+ * Nodes are 12 bytes and leaves 24 bytes, against 16 and 24 
+ * bytes plus the caller's key for a mutable trie.
+ *
+ * ptrie_save() writes the image to a file and ptrie_map() maps
+ * it back in read-only, so a trie loads in the time it takes to
+ * check the header, and processes that map the same file share
+ * one copy of it in the page cache.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "patricia.h"
+#include "patriciaP.h"
+
+#define PF_ROUNDUP(x) (((x) + 7) & ~(size_t)7)
+
+static int     pf_setup(ptrie_frozen_t *pf, void *img, size_t imgsz);
+static size_t  pf_keysize(ptrie_frozen_t *pf, void *key);
+static pidx_t  pf_search(ptrie_frozen_t *pf, void *key, size_t keysz);
+static void   *pf_val(ptrie_frozen_t *pf, pfleaf_t *fl);
+static int     pf_write(int fd, void *buf, size_t len);
+
+/***********************************************************###**
+ * Compile ptrie into a frozen trie. Keys are copied into the 
+ * image. Values are copied too if PTRIEPARM_VALSZ_FUNC is set, 
+ * otherwise they're stored as is. The frozen trie doesn't refer
+ * to ptrie once built. Returns NULL for tries that hold route 
+ * prefixes.
+ ***********************************************************###*/
+ptrie_frozen_t *
+ptrie_freeze(ptrie_t *pt)
+{
+    ptrie_frozen_t *pf;
+    ptrie_iter_t    ptit;
+    pfhdr_t        *hdr;
+    pfleaf_t       *fl;
+    pfnode_t       *fn;
+    void          **keys;
+    void           *img;
+    void           *key;
+    void           *val;
+    size_t          keysz;
+    uint32_t       *bits;   /* bits[i] separates keys i-1 and i */
+    pidx_t         *cld;    /* children of internal node i */
+    pidx_t         *stack;
+    pidx_t         *bfs;    /* breadth first index of internal node i */
+    pidx_t          top;
+    pidx_t          last;
+    pidx_t          x;
+    size_t          keybytes = 0;
+    size_t          valbytes = 0;
+    size_t          imgsz;
+    size_t          pad;
+    size_t          off;
+    size_t          voff;
+    uint32_t        n;
+    uint32_t        i;
+    uint32_t        j;
+    uint32_t        sp;
+
+    if (pt->pt_flags & PTF_PREFIX)
+        return NULL;
+
+    n = pt->pt_size;
+
+    keys = pt->pt_malloc_func((n + 1) * sizeof(*keys));
+    pf = pt->pt_malloc_func(sizeof(*pf));
+    memset(pf, 0, sizeof(*pf));
+
+    pf->pf_free_func = pt->pt_free_func;
+    pf->pf_keysz = pt->pt_keysz;
+    pf->pf_keysz_func = pt->pt_keysz_func;
+    pf->pf_iter.pn = NULL;
+
+    /* 
+     * First pass: size the image. Variable length keys are
+     * usually strings, so they get a terminating nul.
+     */
+    pad = pt->pt_keysz ? 0 : 1;
+
+    i = 0;
+    ptrie_iter_init(pt, NULL, &ptit);
+    while (ptrie_iter_next_len(pt, &ptit, &key, &keysz, &val)) {
+        keys[i++] = key;
+        keybytes += keysz + pad;
+        if (pt->pt_valsz_func)
+            valbytes += PF_ROUNDUP((*pt->pt_valsz_func)(val));
+    }
+
+    /* values are 8 byte aligned */
+    keybytes = PF_ROUNDUP(keybytes);
+
+    imgsz = sizeof(pfhdr_t) + 
+            n * sizeof(pfleaf_t) + 
+            (n ? n - 1 : 0) * sizeof(pfnode_t) + 
+            keybytes + valbytes;
+
+    img = pt->pt_malloc_func(imgsz);
+    memset(img, 0, imgsz);
+
+    hdr = img;
+    hdr->ph_magic = PF_MAGIC;
+    hdr->ph_version = PF_VERSION;
+    hdr->ph_nleaves = n;
+    hdr->ph_nnodes = n ? n - 1 : 0;
+    hdr->ph_root = n > 1 ? 0 : PN_LEAFBIT; /* breadth first puts the root first */
+    hdr->ph_flags = pt->pt_valsz_func ? PF_F_VALCOPY : 0;
+    hdr->ph_keysz = pt->pt_keysz;
+    hdr->ph_keybytes = keybytes;
+    hdr->ph_valbytes = valbytes;
+
+    pf_setup(pf, img, imgsz);
+
+    /* 
+     * Second pass: leaves, keys and values
+     */
+    i = 0;
+    off = 0;
+    voff = 0;
+    ptrie_iter_init(pt, NULL, &ptit);
+    while (ptrie_iter_next_len(pt, &ptit, &key, &keysz, &val)) {
+        fl = &pf->pf_leaves[i++];
+        fl->fl_keyoff = off;
+        fl->fl_keysz = keysz;
+
+        memcpy(pf->pf_keys + off, key, fl->fl_keysz);
+        off += fl->fl_keysz + pad;
+
+        if (pt->pt_valsz_func) {
+            fl->fl_val = voff;
+            fl->fl_valsz = (*pt->pt_valsz_func)(val);
+            memcpy(pf->pf_vals + voff, val, fl->fl_valsz);
+            voff += PF_ROUNDUP(fl->fl_valsz);
+        } else {
+            fl->fl_val = (uintptr_t)val;
+        }
+    }
+
+    if (n <= 1) {
+        pt->pt_free_func(keys);
+        return pf;
+    }
+
+    /*
+     * Internal nodes. Node i (1 <= i < n) sits between keys i-1
+     * and i. The stack holds the right spine of the trie built 
+     * so far, bits increasing towards the top.
+     */
+    bits = pt->pt_malloc_func(n * sizeof(*bits));
+    cld = pt->pt_malloc_func(2 * n * sizeof(*cld));
+    stack = pt->pt_malloc_func(n * sizeof(*stack));
+    bfs = pt->pt_malloc_func(n * sizeof(*bfs));
+
+    sp = 0;
+    for (i = 1; i < n; i++) {
+        fl = &pf->pf_leaves[i];
+        bits[i] = ABSVAL(keycmp(keys[i], fl->fl_keysz, keys[i-1], fl[-1].fl_keysz));
+
+        last = PN_LEAFBIT | (i - 1);
+        while (sp > 0 && bits[stack[sp-1]] > bits[i])
+            last = stack[--sp];
+
+        cld[2*i] = last;
+        cld[2*i+1] = PN_LEAFBIT | i;
+
+        if (sp > 0)
+            cld[2*stack[sp-1]+1] = i;
+
+        stack[sp++] = i;
+    }
+
+    /* 
+     * Number the internal nodes breadth first, using the output 
+     * array as the queue
+     */
+    top = stack[0];
+    bfs[top] = 0;
+    pf->pf_nodes[0].fn_bit = top; /* node i, until it's copied below */
+
+    for (i = 0, j = 1; i < n - 1; i++) {
+        fn = &pf->pf_nodes[i];
+        x = fn->fn_bit;
+        fn->fn_bit = bits[x];
+
+        for (sp = 0; sp < 2; sp++) {
+            top = cld[2*x+sp];
+            if (PN_ISLEAF(top)) {
+                fn->fn_cld[sp] = top;
+            } else {
+                bfs[top] = j;
+                pf->pf_nodes[j++].fn_bit = top;
+                fn->fn_cld[sp] = bfs[top];
+            }
+        }
+    }
+
+    pt->pt_free_func(bits);
+    pt->pt_free_func(cld);
+    pt->pt_free_func(stack);
+    pt->pt_free_func(bfs);
+    pt->pt_free_func(keys);
+
+    return pf;
+}
+
+void
+ptrie_frozen_free(ptrie_frozen_t *pf)
+{
+    if (NOT pf)
+        return;
+
+    if (pf->pf_mapped)
+        munmap(pf->pf_hdr, pf->pf_imgsz);
+    else
+        pf->pf_free_func(pf->pf_hdr);
+
+    pf->pf_free_func(pf);
+}
+
+int
+ptrie_frozen_size(ptrie_frozen_t *pf)
+{
+    return pf ? pf->pf_hdr->ph_nleaves : 0;
+}
+
+void *
+ptrie_frozen_get(ptrie_frozen_t *pf, void *key)
+{
+    return ptrie_frozen_get_len(pf, key, pf_keysize(pf, key));
+}
+
+void *
+ptrie_frozen_get_len(ptrie_frozen_t *pf, void *key, size_t keysz)
+{
+    pfleaf_t *fl;
+
+    if (pf->pf_hdr->ph_nleaves == 0)
+        return NULL;
+
+    fl = &pf->pf_leaves[PN_NUM(pf_search(pf, key, keysz))];
+
+    if (keyseq(key, keysz, pf->pf_keys + fl->fl_keyoff, fl->fl_keysz))
+        return pf_val(pf, fl);
+
+    return NULL;
+}
+
+/***********************************************************###**
+ * Same as ptrie_get_prefix(). Rather than climbing back up from
+ * the leaf we reach, we search again and stop at the first node
+ * that tests a bit past the prefix.
+ *
+ * The handle returned points into the image.
+ ***********************************************************###*/
+void *
+ptrie_frozen_get_prefix(ptrie_frozen_t *pf, void *prefix, size_t nbits)
+{
+    pfleaf_t *fl;
+    pfnode_t *fn;
+    pidx_t    x;
+    size_t    pfxsz;
+    int       diffbit;
+
+    if (pf->pf_hdr->ph_nleaves == 0)
+        return NULL;
+
+    pfxsz = pf_keysize(pf, prefix);
+
+    x  = pf_search(pf, prefix, pfxsz);
+    fl = &pf->pf_leaves[PN_NUM(x)];
+
+    diffbit = keycmp(prefix, pfxsz, pf->pf_keys + fl->fl_keyoff, fl->fl_keysz);
+
+    if (diffbit == 0 || nbits < diffbit) {
+        x = pf->pf_hdr->ph_root;
+        while (NOT PN_ISLEAF(x)) {
+            fn = &pf->pf_nodes[x];
+            if (nbits < fn->fn_bit)
+                return fn;
+            x = fn->fn_cld[getbit(prefix, pfxsz, fn->fn_bit)];
+        }
+    }
+
+    return fl;
+}
+
+void
+ptrie_frozen_iter_init(ptrie_frozen_t *pf, void *root, ptrie_iter_t *ptit)
+{
+    pidx_t lo;
+    pidx_t hi;
+
+    if (NOT ptit)
+        ptit = &pf->pf_iter;
+
+    if (pf->pf_hdr->ph_nleaves == 0) {
+        ptit->pn = NULL;
+        return;
+    }
+
+    if (NOT root) {
+        lo = hi = pf->pf_hdr->ph_root;
+    } else if ((pfleaf_t *)root >= pf->pf_leaves && 
+               (pfleaf_t *)root < pf->pf_leaves + pf->pf_hdr->ph_nleaves) {
+        lo = hi = PN_LEAFBIT | ((pfleaf_t *)root - pf->pf_leaves);
+    } else {
+        lo = hi = (pfnode_t *)root - pf->pf_nodes;
+    }
+
+    /* a subtree covers the leaves from its left-most to its right-most */
+    while (NOT PN_ISLEAF(lo))
+        lo = pf->pf_nodes[lo].fn_cld[0];
+    while (NOT PN_ISLEAF(hi))
+        hi = pf->pf_nodes[hi].fn_cld[1];
+
+    ptit->pn = &pf->pf_leaves[PN_NUM(lo)];
+    ptit->root = &pf->pf_leaves[PN_NUM(hi)];
+}
+
+int
+ptrie_frozen_iter_next(ptrie_frozen_t *pf, ptrie_iter_t *ptit, void **key, void **val)
+{
+    pfleaf_t *fl;
+
+    if (NOT ptit)
+        ptit = &pf->pf_iter;
+
+    if (NOT ptit->pn)
+        return 0; /* finished traversal */
+
+    fl = ptit->pn;
+
+    if (key) *key = pf->pf_keys + fl->fl_keyoff;
+    if (val) *val = pf_val(pf, fl);
+
+    ptit->pn = (fl == ptit->root) ? NULL : fl + 1;
+    return 1;
+}
+
+/***********************************************************###**
+ * Save ptrie to path in frozen form, for ptrie_map(). Values 
+ * are only meaningful to another process if PTRIEPARM_VALSZ_FUNC
+ * is set, so that they're copied into the file, or if they're 
+ * integers rather than pointers.
+ *
+ * The file is written under a temporary name and renamed into
+ * place, so processes that have the old file mapped keep seeing
+ * the old trie. Returns 0, or -1 with errno set.
+ ***********************************************************###*/
+int
+ptrie_save(ptrie_t *pt, const char *path)
+{
+    ptrie_frozen_t *pf;
+    char           *tmp;
+    int             fd;
+    int             err = 0;
+
+    pf = ptrie_freeze(pt);
+    if (NOT pf) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    tmp = pt->pt_malloc_func(strlen(path) + sizeof(".XXXXXX"));
+    sprintf(tmp, "%s.XXXXXX", path);
+
+    if ((fd = mkstemp(tmp)) < 0) {
+        err = errno;
+    } else {
+        if (fchmod(fd, 0644) < 0 ||
+            pf_write(fd, pf->pf_hdr, pf->pf_imgsz) < 0 ||
+            fsync(fd) < 0) {
+            err = errno;
+        }
+
+        if (close(fd) < 0 && NOT err)
+            err = errno;
+        if (NOT err && rename(tmp, path) < 0)
+            err = errno;
+        if (err)
+            unlink(tmp);
+    }
+
+    pt->pt_free_func(tmp);
+    ptrie_frozen_free(pf);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/***********************************************************###**
+ * Map a trie saved with ptrie_save(). Nothing is read beyond the
+ * header until it's looked up, and the image is shared with 
+ * every other process that maps the same file. 
+ *
+ * Keys are fixed size if they were when the trie was saved, 
+ * otherwise they're taken to be strings. Returns NULL with errno
+ * set if the file can't be mapped or isn't a saved trie.
+ ***********************************************************###*/
+ptrie_frozen_t *
+ptrie_map(const char *path)
+{
+    ptrie_frozen_t *pf;
+    struct stat     st;
+    void           *img;
+    int             fd;
+    int             err;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+
+    if ((size_t)st.st_size < sizeof(pfhdr_t)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    img = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    err = errno;
+    close(fd);
+
+    if (img == MAP_FAILED) {
+        errno = err;
+        return NULL;
+    }
+
+    if ((pf = malloc(sizeof(*pf))) == NULL) {
+        munmap(img, st.st_size);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memset(pf, 0, sizeof(*pf));
+
+    if (pf_setup(pf, img, st.st_size) < 0) {
+        munmap(img, st.st_size);
+        free(pf);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pf->pf_mapped = 1;
+    pf->pf_free_func = free;
+    pf->pf_keysz = pf->pf_hdr->ph_keysz;
+    pf->pf_keysz_func = (size_t (*)(void *))strlen;
+
+    return pf;
+}
+
+/*
+ * Check that the header describes an image of imgsz bytes and 
+ * find the parts of the image
+ */
+static int
+pf_setup(ptrie_frozen_t *pf, void *img, size_t imgsz)
+{
+    pfhdr_t *hdr = img;
+    uint64_t nodesz;
+
+    if (imgsz < sizeof(*hdr) ||
+        hdr->ph_magic != PF_MAGIC ||
+        hdr->ph_version != PF_VERSION) {
+        return -1;
+    }
+
+    if (hdr->ph_nnodes != (hdr->ph_nleaves ? hdr->ph_nleaves - 1 : 0))
+        return -1;
+
+    if (hdr->ph_nleaves > 1 ? hdr->ph_root >= hdr->ph_nnodes : hdr->ph_root != PN_LEAFBIT)
+        return -1;
+
+    nodesz = (uint64_t)hdr->ph_nleaves * sizeof(pfleaf_t) +
+             (uint64_t)hdr->ph_nnodes * sizeof(pfnode_t);
+
+    if (hdr->ph_keybytes > imgsz ||
+        hdr->ph_valbytes > imgsz ||
+        sizeof(*hdr) + nodesz + hdr->ph_keybytes + hdr->ph_valbytes != imgsz) {
+        return -1;
+    }
+
+    pf->pf_hdr = hdr;
+    pf->pf_imgsz = imgsz;
+    pf->pf_leaves = (pfleaf_t *)(hdr + 1);
+    pf->pf_nodes = (pfnode_t *)(pf->pf_leaves + hdr->ph_nleaves);
+    pf->pf_keys = (uint8_t *)(pf->pf_nodes + hdr->ph_nnodes);
+    pf->pf_vals = pf->pf_keys + hdr->ph_keybytes;
+
+    return 0;
+}
+
+static int
+pf_write(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (uint8_t *)buf + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static void *
+pf_val(ptrie_frozen_t *pf, pfleaf_t *fl)
+{
+    if (pf->pf_hdr->ph_flags & PF_F_VALCOPY)
+        return pf->pf_vals + fl->fl_val;
+
+    return (void *)(uintptr_t)fl->fl_val;
+}
+
+static size_t
+pf_keysize(ptrie_frozen_t *pf, void *key)
+{
+    if (pf->pf_keysz)
+        return pf->pf_keysz;
+    else if (pf->pf_keysz_func)
+        return (*pf->pf_keysz_func)(key);
+    else {
+        fprintf(stderr, "Error: unable to determine key size\n");
+        exit(1);
+    }
+}
+
+/*
+ * Search down to the leaf key would be found at
+ */
+static pidx_t
+pf_search(ptrie_frozen_t *pf, void *key, size_t keysz)
+{
+    pfnode_t *fn;
+    pidx_t    x = pf->pf_hdr->ph_root;
+
+    while (NOT PN_ISLEAF(x)) {
+        fn = &pf->pf_nodes[x];
+        x = fn->fn_cld[getbit(key, keysz, fn->fn_bit)];
+    }
+
+    return x;
+}
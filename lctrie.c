@@ -0,0 +1,562 @@
+/*
+ * Copyright (c) 2012, Todd Hayton <thayton@neekanee.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Level-compressed tries (Nilsson and Karlsson, "IP-address lookup 
+ * using LC-tries"): a read-only copy of a ptrie in which the top 
+ * levels of each dense subtree are replaced by a single node with
+ * 2^k children, indexed by the k bits of the key that follow the
+ * bits all keys under the node share. A PATRICIA trie tests one
+ * bit per node; an LC-trie of a routing table tests 8 to 16 at a
+ * time near the root, so a lookup visits a handful of nodes.
+ *
+ * A node is given the largest k for which at least a 'fill' 
+ * fraction of its 2^k children would be non-empty. An empty child
+ * is made a leaf pointing at the key of the nearest non-empty 
+ * child, which shares as many bits with any key that lands there
+ * as any key in the trie does, so a lookup never needs to back up.
+ *
+ * Route prefixes are kept Nilsson's way: each leaf points at the
+ * longest prefix stored under its key, and each prefix at the next
+ * longer prefix that covers it, so the best match for an address is
+ * the first prefix on that chain no longer than the number of bits
+ * the address shares with the leaf.
+ *
+ * Nodes are 8 bytes: the index of the first child (or leaf), the
+ * first bit to test and k, with k == 0 for a leaf.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "patricia.h"
+#include "patriciaP.h"
+
+#define LC_NONE       0xffffffff
+#define LC_MAXBRANCH  16   /* at most 2^16 children per node */
+#define LC_FILL       0.5  /* default fill factor */
+
+#define LC_BRANCHBITS 5
+#define LC_BRANCH(n)  ((n)->ln_bits & ((1 << LC_BRANCHBITS) - 1))
+#define LC_BIT(n)     ((n)->ln_bits >> LC_BRANCHBITS)
+
+typedef struct plcnode {
+    uint32_t ln_adr;  /* first child, or leaf if LC_BRANCH() is 0 */
+    uint32_t ln_bits; /* first bit tested << LC_BRANCHBITS | branch */
+} plcnode_t;
+
+typedef struct plcleaf {
+    void    *lf_key;
+    void    *lf_val;
+    uint32_t lf_keysz;
+    uint32_t lf_pfx;   /* longest prefix under this key, or LC_NONE */
+} plcleaf_t;
+
+typedef struct plcpfx {
+    void    *lp_val;
+    uint32_t lp_nbits;
+    uint32_t lp_next;  /* next longest prefix covering this one */
+} plcpfx_t;
+
+struct ptrie_lc {
+    plcnode_t *lc_nodes;
+    plcleaf_t *lc_leaves;
+    plcpfx_t  *lc_pfx;
+    uint8_t   *lc_keys;
+    uint32_t   lc_nnodes;
+    uint32_t   lc_maxnodes;
+    uint32_t   lc_nleaves;
+    uint32_t   lc_npfx;
+    int        lc_prefix;  /* built from a trie of route prefixes */
+    double     lc_fill;
+
+    void    *(*lc_malloc_func)(size_t);
+    void     (*lc_free_func)(void *);
+    size_t     lc_keysz;
+    size_t   (*lc_keysz_func)(void *key);
+};
+
+static size_t    lc_keysize(ptrie_lc_t *lc, void *key);
+static uint32_t  lc_newnodes(ptrie_lc_t *lc, uint32_t n);
+static int       lc_build(ptrie_lc_t *lc, uint32_t x, uint32_t first, uint32_t n);
+static uint32_t  lc_branch(ptrie_lc_t *lc, uint32_t first, uint32_t n, uint32_t bit);
+static void      lc_link_prefixes(ptrie_lc_t *lc);
+static int       lc_covers(ptrie_lc_t *lc, uint32_t lf, uint32_t nbits, uint32_t key);
+static uint32_t  lc_search(ptrie_lc_t *lc, void *key, size_t keysz, int *depth);
+
+/***********************************************************###**
+ * Build a level-compressed copy of ptrie. A node gets 2^k 
+ * children if at least 'fill' of them are non-empty; 0 picks
+ * the default of 0.5. Lower fill factors give shallower tries
+ * with more empty slots. Keys are copied, values aren't.
+ *
+ * Nodes can't test bits past the first 16MB of a key, nor tell
+ * apart keys that only differ by trailing nul bytes, so for such
+ * keys this returns NULL with errno set to EINVAL.
+ ***********************************************************###*/
+ptrie_lc_t *
+ptrie_lc_build(ptrie_t *pt, double fill)
+{
+    ptrie_lc_t  *lc;
+    ptrie_iter_t ptit;
+    pfx_t       *px;
+    void        *key;
+    void        *val;
+    size_t       keysz;
+    size_t       keybytes = 0;
+    size_t       off = 0;
+    uint32_t     i;
+    uint32_t     j;
+
+    lc = pt->pt_malloc_func(sizeof(*lc));
+    memset(lc, 0, sizeof(*lc));
+
+    lc->lc_malloc_func = pt->pt_malloc_func;
+    lc->lc_free_func = pt->pt_free_func;
+    lc->lc_keysz = pt->pt_keysz;
+    lc->lc_keysz_func = pt->pt_keysz_func;
+    lc->lc_prefix = (pt->pt_flags & PTF_PREFIX) ? 1 : 0;
+    lc->lc_fill = (fill > 0 && fill <= 1) ? fill : LC_FILL;
+    lc->lc_nleaves = pt->pt_size;
+
+    lc->lc_leaves = lc->lc_malloc_func((lc->lc_nleaves + 1) * sizeof(plcleaf_t));
+
+    i = 0;
+    ptrie_iter_init(pt, NULL, &ptit);
+    while (ptrie_iter_next_len(pt, &ptit, &key, &keysz, &val)) {
+        lc->lc_leaves[i].lf_key = key;
+        lc->lc_leaves[i].lf_val = val;
+        lc->lc_leaves[i].lf_keysz = keysz;
+        lc->lc_leaves[i].lf_pfx = LC_NONE;
+        keybytes += lc->lc_leaves[i].lf_keysz;
+        if (lc->lc_prefix) {
+            for (px = val; px; px = px->px_next)
+                lc->lc_npfx++;
+        }
+        i++;
+    }
+
+    /* 
+     * Copy the keys. Variable length keys are usually strings, 
+     * so they keep a terminating nul.
+     */
+    if (NOT lc->lc_keysz)
+        keybytes += lc->lc_nleaves;
+
+    lc->lc_keys = lc->lc_malloc_func(keybytes + 1);
+
+    for (i = 0; i < lc->lc_nleaves; i++) {
+        memcpy(lc->lc_keys + off, lc->lc_leaves[i].lf_key, lc->lc_leaves[i].lf_keysz);
+        lc->lc_leaves[i].lf_key = lc->lc_keys + off;
+        off += lc->lc_leaves[i].lf_keysz;
+        if (NOT lc->lc_keysz)
+            lc->lc_keys[off++] = '\0';
+    }
+
+    /* flatten the prefix chains, longest first as in the trie */
+    if (lc->lc_prefix) {
+        lc->lc_pfx = lc->lc_malloc_func((lc->lc_npfx + 1) * sizeof(plcpfx_t));
+
+        for (i = j = 0; i < lc->lc_nleaves; i++) {
+            px = lc->lc_leaves[i].lf_val;
+            lc->lc_leaves[i].lf_pfx = px ? j : LC_NONE;
+            lc->lc_leaves[i].lf_val = NULL;
+            for (; px; px = px->px_next, j++) {
+                lc->lc_pfx[j].lp_val = px->px_val;
+                lc->lc_pfx[j].lp_nbits = px->px_nbits;
+                lc->lc_pfx[j].lp_next = px->px_next ? j + 1 : LC_NONE;
+            }
+        }
+
+        lc_link_prefixes(lc);
+    }
+
+    if (lc->lc_nleaves) {
+        lc_newnodes(lc, 1);
+        if (lc_build(lc, 0, 0, lc->lc_nleaves) < 0) {
+            ptrie_lc_free(lc);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    return lc;
+}
+
+void
+ptrie_lc_free(ptrie_lc_t *lc)
+{
+    if (NOT lc)
+        return;
+
+    lc->lc_free_func(lc->lc_nodes);
+    lc->lc_free_func(lc->lc_leaves);
+    lc->lc_free_func(lc->lc_keys);
+    if (lc->lc_pfx)
+        lc->lc_free_func(lc->lc_pfx);
+    lc->lc_free_func(lc);
+}
+
+int
+ptrie_lc_size(ptrie_lc_t *lc)
+{
+    return lc ? lc->lc_nleaves : 0;
+}
+
+/***********************************************************###**
+ * Exact match. In a trie of route prefixes this returns the value
+ * of the prefix that covers the whole key, if there is one.
+ ***********************************************************###*/
+void *
+ptrie_lc_get(ptrie_lc_t *lc, void *key)
+{
+    return ptrie_lc_get_len(lc, key, lc_keysize(lc, key));
+}
+
+void *
+ptrie_lc_get_len(ptrie_lc_t *lc, void *key, size_t keysz)
+{
+    plcleaf_t *lf;
+    plcpfx_t  *lp;
+
+    if (lc->lc_nleaves == 0)
+        return NULL;
+
+    lf = &lc->lc_leaves[lc_search(lc, key, keysz, NULL)];
+
+    if (keycmp(key, keysz, lf->lf_key, lf->lf_keysz))
+        return NULL;
+
+    if (NOT lc->lc_prefix)
+        return lf->lf_val;
+
+    if (lf->lf_pfx == LC_NONE)
+        return NULL;
+
+    lp = &lc->lc_pfx[lf->lf_pfx];
+    return lp->lp_nbits == keysz * BITS_PER_BYTE ? lp->lp_val : NULL;
+}
+
+/***********************************************************###**
+ * Longest-prefix match, as ptrie_lpm()
+ ***********************************************************###*/
+void *
+ptrie_lc_lpm(ptrie_lc_t *lc, void *addr)
+{
+    plcleaf_t *lf;
+    size_t     keysz;
+    size_t     maxbits;
+    uint32_t   p;
+    int        diffbit;
+
+    if (lc->lc_nleaves == 0 || NOT lc->lc_prefix)
+        return NULL;
+
+    keysz = lc_keysize(lc, addr);
+    lf = &lc->lc_leaves[lc_search(lc, addr, keysz, NULL)];
+
+    diffbit = ABSVAL(keycmp(addr, keysz, lf->lf_key, lf->lf_keysz));
+    maxbits = diffbit ? diffbit - 1 : keysz * BITS_PER_BYTE;
+
+    for (p = lf->lf_pfx; p != LC_NONE; p = lc->lc_pfx[p].lp_next) {
+        if (lc->lc_pfx[p].lp_nbits <= maxbits)
+            return lc->lc_pfx[p].lp_val;
+    }
+
+    return NULL;
+}
+
+/***********************************************************###**
+ * Depth of the deepest leaf, and the average depth of the leaves
+ * weighted by the number of keys under them, the root being at
+ * depth 1.
+ ***********************************************************###*/
+void
+ptrie_lc_depth(ptrie_lc_t *lc, int *maxdepth, double *avgdepth)
+{
+    plcleaf_t *lf;
+    uint64_t   total = 0;
+    uint32_t   i;
+    int        max = 0;
+    int        d;
+
+    for (i = 0; i < lc->lc_nleaves; i++) {
+        lf = &lc->lc_leaves[i];
+        lc_search(lc, lf->lf_key, lf->lf_keysz, &d);
+        total += d;
+        if (d > max)
+            max = d;
+    }
+
+    if (maxdepth)
+        *maxdepth = max;
+    if (avgdepth)
+        *avgdepth = lc->lc_nleaves ? (double)total / lc->lc_nleaves : 0;
+}
+
+static size_t
+lc_keysize(ptrie_lc_t *lc, void *key)
+{
+    if (lc->lc_keysz)
+        return lc->lc_keysz;
+    return (*lc->lc_keysz_func)(key);
+}
+
+/*
+ * Leaf that a search for key ends at. There's always one: empty
+ * slots are leaves too.
+ */
+static uint32_t
+lc_search(ptrie_lc_t *lc, void *key, size_t keysz, int *depth)
+{
+    plcnode_t *n = lc->lc_nodes;
+    uint32_t   k;
+    int        d = 1;
+
+    while ((k = LC_BRANCH(n)) != 0) {
+        n = &lc->lc_nodes[n->ln_adr + keybits(key, keysz, LC_BIT(n), k)];
+        d++;
+    }
+
+    if (depth)
+        *depth = d;
+
+    return n->ln_adr;
+}
+
+/*
+ * Append n nodes to the node array and return the index of the
+ * first. The array may move.
+ */
+static uint32_t
+lc_newnodes(ptrie_lc_t *lc, uint32_t n)
+{
+    plcnode_t *nodes;
+    uint32_t   max;
+    uint32_t   x;
+
+    if (lc->lc_nnodes + n > lc->lc_maxnodes) {
+        max = 2 * lc->lc_maxnodes + n;
+        nodes = lc->lc_malloc_func(max * sizeof(*nodes));
+        if (lc->lc_nodes) {
+            memcpy(nodes, lc->lc_nodes, lc->lc_nnodes * sizeof(*nodes));
+            lc->lc_free_func(lc->lc_nodes);
+        }
+        lc->lc_nodes = nodes;
+        lc->lc_maxnodes = max;
+    }
+
+    x = lc->lc_nnodes;
+    lc->lc_nnodes += n;
+    return x;
+}
+
+/***********************************************************###**
+ * Fill in node x for the n sorted leaves starting at 'first'.
+ *
+ * The node tests the first bit at which the leaves differ, which
+ * is where the first and last of them differ, and the k bits
+ * after it. The leaves with the same k bits are consecutive and
+ * become child p. An empty child becomes a leaf pointing at the
+ * first leaf of whichever neighbouring child shares more leading
+ * bits with p.
+ ***********************************************************###*/
+static int
+lc_build(ptrie_lc_t *lc, uint32_t x, uint32_t first, uint32_t n)
+{
+    plcleaf_t *lf = lc->lc_leaves;
+    uint32_t  *start; /* first leaf of each child */
+    uint32_t  *len;   /* number of leaves, 0 for an empty slot */
+    uint32_t   bit;
+    uint32_t   k;
+    uint32_t   c;
+    uint32_t   p;
+    uint32_t   prev;
+    uint32_t   next;
+    uint32_t   i;
+    int        err = 0;
+
+    bit = n > 1 ? ABSVAL(keycmp(lf[first].lf_key, lf[first].lf_keysz, 
+                                lf[first + n - 1].lf_key, lf[first + n - 1].lf_keysz)) : 0;
+
+    if (bit == 0) {
+        lc->lc_nodes[x].ln_adr = first;
+        lc->lc_nodes[x].ln_bits = 0;
+        return 0;
+    }
+
+    /* too far into the key, or a length bit, to fit in ln_bits */
+    if (bit >= (1U << (32 - LC_BRANCHBITS)))
+        return -1;
+
+    k = lc_branch(lc, first, n, bit);
+    c = lc_newnodes(lc, 1 << k);
+
+    lc->lc_nodes[x].ln_adr = c;
+    lc->lc_nodes[x].ln_bits = (bit << LC_BRANCHBITS) | k;
+
+    start = lc->lc_malloc_func((1 << k) * sizeof(*start));
+    len = lc->lc_malloc_func((1 << k) * sizeof(*len));
+    memset(len, 0, (1 << k) * sizeof(*len));
+
+    for (i = first; i < first + n; i++) {
+        p = keybits(lf[i].lf_key, lf[i].lf_keysz, bit, k);
+        if (len[p]++ == 0)
+            start[p] = i;
+    }
+
+    /* an empty slot takes the first leaf of its left neighbour... */
+    for (p = 0, prev = LC_NONE; p < (1U << k); p++) {
+        if (len[p])
+            prev = p;
+        else
+            start[p] = prev;
+    }
+
+    /* ...or its right neighbour, if that shares more bits with it */
+    for (p = 1U << k, next = LC_NONE; p-- > 0; ) {
+        if (len[p]) {
+            next = p;
+            continue;
+        }
+
+        prev = start[p];
+        if (prev == LC_NONE || (next != LC_NONE && (p ^ next) < (p ^ prev)))
+            prev = next;
+
+        lc->lc_nodes[c + p].ln_adr = start[prev];
+        lc->lc_nodes[c + p].ln_bits = 0;
+    }
+
+    for (p = 0; p < (1U << k) && err == 0; p++) {
+        if (len[p])
+            err = lc_build(lc, c + p, start[p], len[p]);
+    }
+
+    lc->lc_free_func(len);
+    lc->lc_free_func(start);
+    return err;
+}
+
+/*
+ * Largest k for which the n leaves starting at 'first' fill at
+ * least lc_fill of the 2^k slots that bits bit to bit+k-1 pick 
+ * between. The leaves are sorted, so equal k bit values are 
+ * consecutive. k is at least 1 since the leaves differ at 'bit'.
+ */
+static uint32_t
+lc_branch(ptrie_lc_t *lc, uint32_t first, uint32_t n, uint32_t bit)
+{
+    plcleaf_t *lf = lc->lc_leaves;
+    uint32_t   k;
+    uint32_t   p;
+    uint32_t   last;
+    uint32_t   used;
+    uint32_t   i;
+
+    for (k = 1; k < LC_MAXBRANCH; k++) {
+        if (n < lc->lc_fill * (1 << (k + 1)))
+            break;
+
+        used = 0;
+        last = LC_NONE;
+        for (i = first; i < first + n; i++) {
+            p = keybits(lf[i].lf_key, lf[i].lf_keysz, bit, k + 1);
+            if (p != last)
+                used++;
+            last = p;
+        }
+
+        if (used < lc->lc_fill * (1 << (k + 1)))
+            break;
+    }
+
+    return k;
+}
+
+/***********************************************************###**
+ * Point the shortest prefix of each leaf at the longest prefix 
+ * of an earlier leaf that covers it. Those are the prefixes on a
+ * stack of nested prefixes, each covering the ones above it, once
+ * the ones that don't cover the leaf have been popped.
+ ***********************************************************###*/
+static void
+lc_link_prefixes(ptrie_lc_t *lc)
+{
+    uint32_t *stack;  /* prefix index */
+    uint32_t *owner;  /* leaf it belongs to */
+    uint32_t  sp = 0;
+    uint32_t  i;
+    uint32_t  p;
+    uint32_t  q;
+
+    stack = lc->lc_malloc_func((lc->lc_npfx + 1) * sizeof(*stack));
+    owner = lc->lc_malloc_func((lc->lc_npfx + 1) * sizeof(*owner));
+
+    for (i = 0; i < lc->lc_nleaves; i++) {
+        if ((p = lc->lc_leaves[i].lf_pfx) == LC_NONE)
+            continue;
+
+        while (sp && NOT lc_covers(lc, owner[sp-1], lc->lc_pfx[stack[sp-1]].lp_nbits, i))
+            sp--;
+
+        for (q = p; lc->lc_pfx[q].lp_next != LC_NONE; q++)
+            ;
+
+        lc->lc_pfx[q].lp_next = sp ? stack[sp-1] : LC_NONE;
+
+        /* push shortest first, so the longest is on top */
+        for (;; q--) {
+            stack[sp] = q;
+            owner[sp] = i;
+            sp++;
+            if (q == p)
+                break;
+        }
+    }
+
+    lc->lc_free_func(owner);
+    lc->lc_free_func(stack);
+}
+
+/*
+ * Does the prefix of leaf lf that is nbits long cover leaf key?
+ */
+static int
+lc_covers(ptrie_lc_t *lc, uint32_t lf, uint32_t nbits, uint32_t key)
+{
+    plcleaf_t *a = &lc->lc_leaves[lf];
+    plcleaf_t *b = &lc->lc_leaves[key];
+    int        diffbit;
+
+    diffbit = ABSVAL(keycmp(a->lf_key, a->lf_keysz, b->lf_key, b->lf_keysz));
+    return diffbit == 0 || (uint32_t)diffbit > nbits;
+}
@@ -0,0 +1,575 @@
+/*
+ * Copyright (c) 2012, Todd Hayton <thayton@neekanee.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Parallel scans: the trie below a node is split into subtrees 
+ * that partition its keys into consecutive ranges, and each 
+ * subtree is iterated on its own.
+ *
+ * Without subtree sizes we can't cut the keys into equal parts,
+ * so we split the subtree nearest the top of the trie (the one
+ * with the smallest difference bit) until there are enough parts.
+ * On keys with well spread bits that gives parts of about the 
+ * same size; ptrie_parallel_foreach() also hands out several 
+ * parts per thread so that threads that get small ones aren't 
+ * left idle.
+ *
+ * Parallel builds go the other way: the keys are split into 
+ * buckets on the bits just past those that all keys share, each
+ * thread builds the subtrees for the buckets it takes in a trie 
+ * of its own, and the subtrees are grafted under a few internal
+ * nodes that branch on the bucket bits. Since the shape of a 
+ * PATRICIA trie depends only on the set of keys, the result is 
+ * the trie that adding the keys one at a time would have built.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "patricia.h"
+#include "patriciaP.h"
+
+/* parts per thread in ptrie_parallel_foreach() */
+#define PPAR_PARTS_PER_THREAD 4
+
+/* 
+ * ptrie_build_parallel() makes about this many buckets per 
+ * thread, with at most 2^PPAR_MAXBITS buckets, and builds tries
+ * of fewer than PPAR_MINKEYS keys on one thread
+ */
+#define PPAR_BUCKETS_PER_THREAD 16
+#define PPAR_MAXBITS            16
+#define PPAR_MINKEYS            4096
+
+typedef struct ppar {
+    ptrie_t      *pp_ptrie;
+    ptrie_iter_t *pp_iters;
+    int           pp_nparts;
+    int           pp_next;    /* next part to hand out */
+    void        (*pp_func)(void *key, void *val, void *arg);
+    void         *pp_arg;
+} ppar_t;
+
+typedef struct pbuild {
+    ptrie_t  *pb_ptrie;
+    void    **pb_keys;
+    void    **pb_vals;
+    int      *pb_order;  /* key indices, grouped by bucket */
+    int      *pb_start;  /* first of each bucket in pb_order */
+    int       pb_nbuckets;
+    int       pb_next;   /* next bucket to hand out */
+    uint32_t  pb_bit;    /* first bucket bit */
+    uint32_t  pb_nbits;
+    pidx_t   *pb_root;   /* subtree built for each bucket */
+    size_t   *pb_size;
+    int      *pb_owner;  /* worker that built it */
+} pbuild_t;
+
+typedef struct pbworker {
+    pthread_t  bw_tid;
+    pbuild_t  *bw_pb;
+    int        bw_id;
+    ptrie_t   *bw_ptrie;  /* builds subtrees from its own pools */
+    uint32_t   bw_nbase;  /* where its chunks went in the trie */
+    uint32_t   bw_nchunks;
+    uint32_t   bw_nnext;  /* nodes used in the last chunk */
+    uint32_t   bw_lbase;
+    uint32_t   bw_lchunks;
+    uint32_t   bw_lnext;
+} pbworker_t;
+
+static int      par_split(ptrie_t *pt, pidx_t x, pidx_t *cld, uint32_t *bit);
+static void    *par_worker(void *arg);
+static uint32_t par_firstbit(ptrie_t *pt, void **keys, int n);
+static uint32_t par_bucket(pbuild_t *pb, void *key);
+static void    *par_build(void *arg);
+static void    *par_relink(void *arg);
+static pidx_t   par_reindex(pbworker_t *bw, pidx_t x);
+static pidx_t   par_graft(pbuild_t *pb, pbworker_t *bw, int *bk, int lo, int hi);
+static void     par_run(pbworker_t *bw, int nthreads, void *(*func)(void *));
+
+/***********************************************************###**
+ * Split the subtree under root (or the whole trie if root is 
+ * NULL) into at most nparts disjoint subtrees, in key order, and
+ * set up iters[i] to iterate over the i'th. Returns the number 
+ * of iterators set up, which is fewer than nparts if the trie 
+ * has fewer keys.
+ *
+ * Iterating over all of them in turn visits the same keys in the
+ * same order as iterating over root.
+ ***********************************************************###*/
+int
+ptrie_iter_split(ptrie_t *pt, void *root, int nparts, ptrie_iter_t *iters)
+{
+    pidx_t   *part;
+    pidx_t    cld[2];
+    uint32_t  bit;
+    uint32_t  minbit;
+    int       n;
+    int       i;
+    int       s;
+
+    if (nparts <= 0 || pt->pt_size == 0 || pt->pt_root == PN_NIL)
+        return 0;
+
+    part = pt->pt_malloc_func(nparts * sizeof(*part));
+
+    if (root) {
+        part[0] = PTR2PIDX(root);
+    } else if (pt->pt_flags & PTRIE_F_SEDGEWICK) {
+        /* the root of the iteration, see sg_iter_init() */
+        ptrie_iter_init(pt, NULL, &iters[0]);
+        part[0] = PTR2PIDX(iters[0].root);
+    } else {
+        part[0] = PN_LOAD(&pt->pt_root);
+    }
+
+    for (n = 1; n < nparts; n++) {
+        s = -1;
+        minbit = UINT32_MAX;
+
+        for (i = 0; i < n; i++) {
+            if (par_split(pt, part[i], NULL, &bit) && bit < minbit) {
+                minbit = bit;
+                s = i;
+            }
+        }
+
+        if (s < 0)
+            break; /* every part is a single key */
+
+        par_split(pt, part[s], cld, &bit);
+        memmove(&part[s + 2], &part[s + 1], (n - s - 1) * sizeof(*part));
+        part[s] = cld[0];
+        part[s + 1] = cld[1];
+    }
+
+    for (i = 0; i < n; i++)
+        ptrie_iter_init(pt, PIDX2PTR(part[i]), &iters[i]);
+
+    pt->pt_free_func(part);
+    return n;
+}
+
+/***********************************************************###**
+ * Can part x be split? If so, its difference bit goes in *bit and
+ * (if cld isn't NULL) the parts for its children in cld.
+ *
+ * With PTRIE_F_SEDGEWICK a child reached by an upward link holds
+ * a single key, and stands for it with PN_LEAFBIT set, as in 
+ * sg_get_prefix().
+ ***********************************************************###*/
+static int
+par_split(ptrie_t *pt, pidx_t x, pidx_t *cld, uint32_t *bit)
+{
+    snode_t *sn;
+    pidx_t   c;
+    int      i;
+
+    if (PN_ISLEAF(x))
+        return 0;
+
+    if (pt->pt_flags & PTRIE_F_SEDGEWICK) {
+        sn = sn_node(pt, x);
+        *bit = sn->sn_bit;
+        for (i = 0; cld && i < 2; i++) {
+            c = sn->sn_cld[i];
+            cld[i] = sn_node(pt, c)->sn_bit <= sn->sn_bit ? c | PN_LEAFBIT : c;
+        }
+        return 1;
+    }
+
+    *bit = pn_node(pt, x)->pn_bit;
+    for (i = 0; cld && i < 2; i++)
+        cld[i] = PN_LOAD(&pn_node(pt, x)->pn_cld[i]);
+    return 1;
+}
+
+/***********************************************************###**
+ * Call func(key, val, arg) for every key under root (or in the 
+ * whole trie if root is NULL) from nthreads threads. Keys are 
+ * visited in order within each part, but parts run concurrently,
+ * so func has to be thread safe. The trie mustn't change until 
+ * ptrie_parallel_foreach() returns.
+ ***********************************************************###*/
+void
+ptrie_parallel_foreach(ptrie_t *pt, void *root, int nthreads,
+                       void (*func)(void *key, void *val, void *arg), void *arg)
+{
+    ppar_t     pp;
+    pthread_t *tids;
+    int        i;
+
+    if (nthreads < 1)
+        nthreads = 1;
+
+    pp.pp_ptrie = pt;
+    pp.pp_iters = pt->pt_malloc_func(nthreads * PPAR_PARTS_PER_THREAD * sizeof(ptrie_iter_t));
+    pp.pp_nparts = ptrie_iter_split(pt, root, nthreads * PPAR_PARTS_PER_THREAD, pp.pp_iters);
+    pp.pp_next = 0;
+    pp.pp_func = func;
+    pp.pp_arg = arg;
+
+    if (nthreads > pp.pp_nparts)
+        nthreads = pp.pp_nparts;
+
+    tids = pt->pt_malloc_func((nthreads + 1) * sizeof(*tids));
+
+    /* the calling thread is one of the workers */
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&tids[i], NULL, par_worker, &pp) != 0) {
+            fprintf(stderr, "ptrie_parallel_foreach - can't create thread\n");
+            exit(1);
+        }
+    }
+
+    par_worker(&pp);
+
+    for (i = 1; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+
+    pt->pt_free_func(tids);
+    pt->pt_free_func(pp.pp_iters);
+}
+
+static void *
+par_worker(void *arg)
+{
+    ppar_t *pp = arg;
+    void   *key;
+    void   *val;
+    int     i;
+
+    while ((i = __atomic_fetch_add(&pp->pp_next, 1, __ATOMIC_RELAXED)) < pp->pp_nparts) {
+        while (ptrie_iter_next(pp->pp_ptrie, &pp->pp_iters[i], &key, &val))
+            pp->pp_func(key, val, pp->pp_arg);
+    }
+
+    return NULL;
+}
+
+/***********************************************************###**
+ * Add n keys to an empty trie from nthreads threads. The trie is 
+ * the same as one built by adding the keys in order with 
+ * ptrie_add(): where a key appears more than once, the first 
+ * value is kept.
+ *
+ * Tries with PTRIE_F_SEDGEWICK, PTRIE_F_PERSISTENT or route 
+ * prefixes, tries that aren't empty, small inputs and inputs 
+ * whose keys only differ by trailing nul bytes are built on the
+ * calling thread with ptrie_add(). The malloc function has to 
+ * be thread safe.
+ ***********************************************************###*/
+void
+ptrie_build_parallel(ptrie_t *pt, void **keys, void **vals, int n, int nthreads)
+{
+    pbuild_t    pb;
+    pbworker_t *bw;
+    int        *bk;      /* buckets that aren't empty */
+    int         nbk;
+    pidx_t      top;
+    uint32_t    b;
+    int         i;
+
+    if (nthreads <= 1 || n < PPAR_MINKEYS ||
+        pt->pt_size != 0 || pt->pt_root != PN_NIL ||
+        (pt->pt_flags & (PTRIE_F_SEDGEWICK | PTRIE_F_PERSISTENT | PTF_PREFIX)) ||
+        (pb.pb_bit = par_firstbit(pt, keys, n)) == 0 || pb.pb_bit > PN_LENBIT) {
+        for (i = 0; i < n; i++)
+            ptrie_add(pt, keys[i], vals[i]);
+        return;
+    }
+
+    for (pb.pb_nbits = 0; 
+         (1 << pb.pb_nbits) < PPAR_BUCKETS_PER_THREAD * nthreads && pb.pb_nbits < PPAR_MAXBITS; 
+         pb.pb_nbits++)
+        ;
+
+    pb.pb_ptrie = pt;
+    pb.pb_keys = keys;
+    pb.pb_vals = vals;
+    pb.pb_nbuckets = 1 << pb.pb_nbits;
+    pb.pb_next = 0;
+
+    pb.pb_order = pt->pt_malloc_func(n * sizeof(*pb.pb_order));
+    pb.pb_start = pt->pt_malloc_func((pb.pb_nbuckets + 1) * sizeof(*pb.pb_start));
+    pb.pb_root = pt->pt_malloc_func(pb.pb_nbuckets * sizeof(*pb.pb_root));
+    pb.pb_size = pt->pt_malloc_func(pb.pb_nbuckets * sizeof(*pb.pb_size));
+    pb.pb_owner = pt->pt_malloc_func(pb.pb_nbuckets * sizeof(*pb.pb_owner));
+    bk = pt->pt_malloc_func(pb.pb_nbuckets * sizeof(*bk));
+    bw = pt->pt_malloc_func(nthreads * sizeof(*bw));
+
+    /* 
+     * Group the keys by bucket, keeping them in input order within
+     * a bucket so that the first of a duplicate key wins
+     */
+    memset(pb.pb_start, 0, (pb.pb_nbuckets + 1) * sizeof(*pb.pb_start));
+    for (i = 0; i < n; i++)
+        pb.pb_start[par_bucket(&pb, keys[i]) + 1]++;
+    for (b = 0; b < pb.pb_nbuckets; b++)
+        pb.pb_start[b + 1] += pb.pb_start[b];
+    for (i = 0; i < n; i++)
+        pb.pb_order[pb.pb_start[par_bucket(&pb, keys[i])]++] = i;
+    for (b = pb.pb_nbuckets; b > 0; b--)
+        pb.pb_start[b] = pb.pb_start[b - 1];
+    pb.pb_start[0] = 0;
+
+    for (i = 0; i < nthreads; i++) {
+        bw[i].bw_pb = &pb;
+        bw[i].bw_id = i;
+        bw[i].bw_ptrie = ptrie_new2(pt->pt_flags & (PTRIE_F_OWNKEYS | PTRIE_F_COUNTS));
+        bw[i].bw_ptrie->pt_keysz = pt->pt_keysz;
+        bw[i].bw_ptrie->pt_keysz_func = pt->pt_keysz_func;
+        bw[i].bw_ptrie->pt_malloc_func = pt->pt_malloc_func;
+        bw[i].bw_ptrie->pt_free_func = pt->pt_free_func;
+    }
+
+    par_run(bw, nthreads, par_build);
+
+    /* 
+     * Move each worker's chunks into the trie, then fix up the 
+     * links between the nodes in them to match their new indices
+     */
+    for (i = 0; i < nthreads; i++) {
+        bw[i].bw_nchunks = bw[i].bw_ptrie->pt_nodes.pp_nchunks;
+        bw[i].bw_nnext = bw[i].bw_ptrie->pt_nodes.pp_next;
+        bw[i].bw_lchunks = bw[i].bw_ptrie->pt_leaves.pp_nchunks;
+        bw[i].bw_lnext = bw[i].bw_ptrie->pt_leaves.pp_next;
+
+        bw[i].bw_nbase = pnpool_take(pt, &pt->pt_nodes, bw[i].bw_ptrie, &bw[i].bw_ptrie->pt_nodes);
+        bw[i].bw_lbase = pnpool_take(pt, &pt->pt_leaves, bw[i].bw_ptrie, &bw[i].bw_ptrie->pt_leaves);
+        pkey_take(pt, bw[i].bw_ptrie);
+    }
+
+    par_run(bw, nthreads, par_relink);
+
+    for (nbk = 0, b = 0; b < pb.pb_nbuckets; b++) {
+        if (pb.pb_root[b] != PN_NIL) {
+            bk[nbk++] = b;
+            pt->pt_size += pb.pb_size[b];
+        }
+    }
+
+    top = par_graft(&pb, bw, bk, 0, nbk);
+    pn_setparent(pt, top, PN_NIL);
+    PN_STORE(&pt->pt_root, top);
+
+    for (i = 0; i < nthreads; i++)
+        ptrie_free(bw[i].bw_ptrie);
+
+    pt->pt_free_func(bw);
+    pt->pt_free_func(bk);
+    pt->pt_free_func(pb.pb_owner);
+    pt->pt_free_func(pb.pb_size);
+    pt->pt_free_func(pb.pb_root);
+    pt->pt_free_func(pb.pb_start);
+    pt->pt_free_func(pb.pb_order);
+}
+
+/*
+ * Run func on nthreads threads, one of them the calling thread
+ */
+static void
+par_run(pbworker_t *bw, int nthreads, void *(*func)(void *))
+{
+    int i;
+
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&bw[i].bw_tid, NULL, func, &bw[i]) != 0) {
+            fprintf(stderr, "ptrie_build_parallel - can't create thread\n");
+            exit(1);
+        }
+    }
+
+    func(&bw[0]);
+
+    for (i = 1; i < nthreads; i++)
+        pthread_join(bw[i].bw_tid, NULL);
+}
+
+/*
+ * Build the subtrees of the buckets we take, one after the other,
+ * in our own trie
+ */
+static void *
+par_build(void *arg)
+{
+    pbworker_t *bw = arg;
+    pbuild_t   *pb = bw->bw_pb;
+    ptrie_t    *pt = bw->bw_ptrie;
+    int         b;
+    int         i;
+
+    while ((b = __atomic_fetch_add(&pb->pb_next, 1, __ATOMIC_RELAXED)) < pb->pb_nbuckets) {
+        pt->pt_root = PN_NIL;
+        pt->pt_size = 0;
+
+        for (i = pb->pb_start[b]; i < pb->pb_start[b + 1]; i++)
+            ptrie_add(pt, pb->pb_keys[pb->pb_order[i]], pb->pb_vals[pb->pb_order[i]]);
+
+        pb->pb_root[b] = pt->pt_root;
+        pb->pb_size[b] = pt->pt_size;
+        pb->pb_owner[b] = bw->bw_id;
+    }
+
+    pt->pt_root = PN_NIL;
+    pt->pt_size = 0;
+    return NULL;
+}
+
+/*
+ * Index in the trie of node or leaf x from our own pools. Nothing
+ * has been freed from our pools, so their chunks are full, bar 
+ * the last, and went into the trie in order.
+ */
+static pidx_t
+par_reindex(pbworker_t *bw, pidx_t x)
+{
+    if (x == PN_NIL)
+        return PN_NIL;
+
+    return x + ((PN_ISLEAF(x) ? bw->bw_lbase : bw->bw_nbase) << PN_CHUNKSHIFT);
+}
+
+/*
+ * Fix up the links in the nodes and leaves that came from our 
+ * pools, going through the chunks in order rather than down the
+ * subtrees
+ */
+static void *
+par_relink(void *arg)
+{
+    pbworker_t *bw = arg;
+    ptrie_t    *pt = bw->bw_pb->pb_ptrie;
+    pnode_t    *pn;
+    pleaf_t    *pl;
+    uint32_t    c;
+    uint32_t    i;
+    uint32_t    end;
+
+    for (c = 0; c < bw->bw_nchunks; c++) {
+        end = c == bw->bw_nchunks - 1 ? bw->bw_nnext : PN_CHUNKSZ;
+        for (i = c == 0 ? 1 : 0; i < end; i++) {
+            pn = pn_node(pt, ((bw->bw_nbase + c) << PN_CHUNKSHIFT) | i);
+            pn->pn_cld[0] = par_reindex(bw, pn->pn_cld[0]);
+            pn->pn_cld[1] = par_reindex(bw, pn->pn_cld[1]);
+            pn->pn_up = par_reindex(bw, pn->pn_up);
+        }
+    }
+
+    for (c = 0; c < bw->bw_lchunks; c++) {
+        end = c == bw->bw_lchunks - 1 ? bw->bw_lnext : PN_CHUNKSZ;
+        for (i = 0; i < end; i++) {
+            pl = pn_leaf(pt, ((bw->bw_lbase + c) << PN_CHUNKSHIFT) | i | PN_LEAFBIT);
+            pl->pl_up = par_reindex(bw, pl->pl_up);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Join the subtrees of buckets bk[lo..hi-1] under new internal
+ * nodes. The first bucket bit on which the first and last of them
+ * differ splits them in two, and so on down.
+ */
+static pidx_t
+par_graft(pbuild_t *pb, pbworker_t *bw, int *bk, int lo, int hi)
+{
+    ptrie_t *pt = pb->pb_ptrie;
+    pnode_t *pn;
+    pidx_t   x;
+    pidx_t   cld[2];
+    uint32_t diff;
+    uint32_t bit;
+    int      mid;
+
+    if (hi - lo == 1)
+        return par_reindex(&bw[pb->pb_owner[bk[lo]]], pb->pb_root[bk[lo]]);
+
+    diff = bk[lo] ^ bk[hi - 1];
+    bit = pb->pb_nbits - (32 - __builtin_clz(diff)); /* from the left, 0 based */
+
+    for (mid = lo; mid < hi && NOT (bk[mid] & (1 << (pb->pb_nbits - 1 - bit))); mid++)
+        ;
+
+    cld[0] = par_graft(pb, bw, bk, lo, mid);
+    cld[1] = par_graft(pb, bw, bk, mid, hi);
+
+    x = pnpool_alloc(pt, &pt->pt_nodes);
+    pn = pn_node(pt, x);
+    pn->pn_bit = pb->pb_bit + bit;
+    pn->pn_cld[0] = cld[0];
+    pn->pn_cld[1] = cld[1];
+    pn_setparent(pt, cld[0], x);
+    pn_setparent(pt, cld[1], x);
+
+    if (pt->pt_flags & PTRIE_F_COUNTS)
+        pn_count_set(pt, x);
+
+    return x;
+}
+
+/*
+ * First bit at which the keys don't all agree, or 0 if they're 
+ * all the same
+ */
+static uint32_t
+par_firstbit(ptrie_t *pt, void **keys, int n)
+{
+    uint32_t bit = 0;
+    uint32_t d;
+    size_t   keysz;
+    int      i;
+
+    keysz = keysize(pt, keys[0]);
+
+    for (i = 1; i < n; i++) {
+        d = ABSVAL(keycmp(keys[0], keysz, keys[i], keysize(pt, keys[i])));
+        if (d && (bit == 0 || d < bit))
+            bit = d;
+    }
+
+    return bit;
+}
+
+static uint32_t
+par_bucket(pbuild_t *pb, void *key)
+{
+    size_t   keysz = keysize(pb->pb_ptrie, key);
+    uint32_t b = 0;
+    uint32_t i;
+
+    for (i = 0; i < pb->pb_nbits; i++)
+        b = b << 1 | getbit(key, keysz, pb->pb_bit + i);
+
+    return b;
+}
@@ -33,56 +33,185 @@
 #include <stdint.h>
 #include <errno.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
 #include "patricia.h"
 #include "patriciaP.h"
 
-static pnode_t *newpar(ptrie_t *pt, int diffbit, pnode_t *cld1, pnode_t *cld2);
-static pnode_t *newcld(ptrie_t *pt, void *key, size_t keysz, void *val);
+static pidx_t   newpar(ptrie_t *pt, int diffbit, pidx_t cld1, pidx_t cld2);
+
+#define pnode_new(pt)     pnpool_alloc(pt, &(pt)->pt_nodes)
+#define pleaf_new(pt)     pnpool_alloc(pt, &(pt)->pt_leaves)
+#define pnode_free(pt, x) pn_dispose(pt, &(pt)->pt_nodes, x)
+#define pleaf_free(pt, x) pn_dispose(pt, &(pt)->pt_leaves, x)
 
-static pnode_t *pnode_new(ptrie_t *pt, pn_type_t type);
-static void     pnode_free(ptrie_t *pt, pnode_t *pn);
+static void     pn_dispose(ptrie_t *pt, pnpool_t *pp, pidx_t x);
+static void     pt_dispose(ptrie_t *pt, void *ptr);
+static pidx_t   pn_prev(ptrie_t *pt, pidx_t x, void *key, size_t keysz);
+static int      pt_bound(ptrie_t *pt, void *key, size_t keysz, int upper, 
+                         void **rkey, size_t *rkeysz, void **rval);
+static int      pt_end(ptrie_t *pt, int last, void **rkey, void **rval);
 
-static pnode_t *ptrie_del0(ptrie_t *pt, void *key, size_t keysz, pnode_t *pn);
+static void     ptrie_add0(ptrie_t *pt, void *key, size_t keysz, void *val, void **pnode);
+static pidx_t   ptrie_del0(ptrie_t *pt, void *key, size_t keysz, pidx_t x);
 static void    *fmalloc(size_t size);
-static size_t keysize(ptrie_t *pt, void *key);
+static void    *keycopy(ptrie_t *pt, pleaf_t *pl, void *key, size_t keysz);
+static pidx_t   pfx_leaf(ptrie_t *pt, void *key, size_t keysz);
+static void     pfx_mask(void *key, size_t keysz, size_t nbits);
+static void     pfx_free_all(ptrie_t *pt, pidx_t root);
+static void    *lpm_leaf(ptrie_t *pt, void *addr, size_t keysz, pidx_t x);
+static void     search_batch(ptrie_t *pt, pidx_t root, void **keys, 
+                             size_t *keysz, pidx_t *lf, int n);
+
+static size_t   keydiff_init(const uint8_t *ptr1, const uint8_t *ptr2, size_t n);
+
+size_t (*ptrie_keydiff)(const uint8_t *ptr1, const uint8_t *ptr2, size_t n) = keydiff_init;
 
 /***********************************************************###**
- * Alloc/initialize a new ptrie along with a freelist for
- * the pnodes.
+ * Alloc/initialize a new ptrie. Node pools are allocated on the
+ * first insert.
  ***********************************************************###*/
 ptrie_t *
 ptrie_new(void)
 {
-    int      i;
+    return ptrie_new2(0);
+}
+
+/***********************************************************###**
+ * Alloc/initialize a new ptrie using the node representation 
+ * selected by flags:
+ *
+ *    0                   separate internal and leaf nodes
+ *    PTRIE_F_SEDGEWICK   Sedgewick's single node type
+ *
+ * and by the PTRIE_F_* options:
+ *
+ *    PTRIE_F_CONCURRENT  lock-free readers, see rcu.c
+ *    PTRIE_F_OWNKEYS     the trie copies keys
+ *    PTRIE_F_PERSISTENT  snapshots, see persist.c
+ *    PTRIE_F_COUNTS      rank and select, see counts.c
+ *
+ * In PTRIE_F_SEDGEWICK mode keys move between nodes when a key
+ * is deleted, so a pnode returned by ptrie_add2() is only valid 
+ * until the next delete. For that reason it can't be combined 
+ * with PTRIE_F_CONCURRENT or PTRIE_F_PERSISTENT. Persistent 
+ * tries have readers of their own (snapshots) and can't be 
+ * PTRIE_F_CONCURRENT either. Counts are kept in internal nodes,
+ * which Sedgewick tries don't have and snapshots share, so 
+ * PTRIE_F_COUNTS goes with neither.
+ *
+ * Returns NULL with errno set to EINVAL for unsupported flags.
+ ***********************************************************###*/
+ptrie_t *
+ptrie_new2(uint32_t flags)
+{
     ptrie_t *pt;
-    pnode_t *pn;
+
+    if ((flags & ~PTRIE_F_ALL) ||
+        ((flags & PTRIE_F_SEDGEWICK) && (flags & (PTRIE_F_CONCURRENT | PTRIE_F_OWNKEYS))) ||
+        ((flags & PTRIE_F_PERSISTENT) && (flags & (PTRIE_F_SEDGEWICK | PTRIE_F_CONCURRENT))) ||
+        ((flags & PTRIE_F_COUNTS) && (flags & (PTRIE_F_SEDGEWICK | PTRIE_F_PERSISTENT)))) {
+        errno = EINVAL;
+        return NULL;
+    }
 
     pt = fmalloc(sizeof(*pt));
-    pt->pt_root = NULL;
-    pt->pt_list = NULL;
+    memset(pt, 0, sizeof(*pt));
+
+    pt->pt_root = PN_NIL;
     pt->pt_size = 0;
+    pt->pt_flags = flags;
     pt->pt_keysz = 0;
     pt->pt_keysz_func = (size_t (*)(void *))strlen; /* default assumes string keys */
     pt->pt_malloc_func = fmalloc;
     pt->pt_free_func = free;
 
-    for (i = 0; i < PN_FREELIST_BLKSZ; i++) {
-        pn = pt->pt_malloc_func(sizeof(*pn));
-        pn->pn_cld[0] = pt->pt_list;
-        pt->pt_list = pn;
+    if (flags & PTRIE_F_SEDGEWICK) {
+        pnpool_init(&pt->pt_nodes, sizeof(snode_t), 0);
+    } else {
+        pnpool_init(&pt->pt_nodes, sizeof(pnode_t), 0);
+        pnpool_init(&pt->pt_leaves, sizeof(pleaf_t) + 
+                    (flags & PTRIE_F_OWNKEYS ? PL_INLINESZ : 0), PN_LEAFBIT);
+        pt->pt_nodes.pp_counts = (flags & PTRIE_F_COUNTS) != 0;
     }
 
+    if (flags & PTRIE_F_CONCURRENT)
+        prcu_init(pt);
+    if (flags & PTRIE_F_PERSISTENT)
+        pvers_init(pt);
+
     return pt;
 }
 
 /***********************************************************###**
- * ptrie destructor
+ * ptrie destructor. Nodes are freed a chunk at a time. Keys and
+ * values passed in by the caller aren't freed, copies of keys 
+ * made with PTRIE_F_OWNKEYS are. In concurrent mode there must 
+ * be no readers left.
  ***********************************************************###*/
 void
-ptrie_free(ptrie_t *ptrie)
+ptrie_free(ptrie_t *pt)
 {
-    /* XXX TODO */
-    return;
+    if (NOT pt)
+        return;
+
+    prcu_destroy(pt);
+    pvers_destroy(pt);
+    pcache_destroy(pt);
+    pfx_free_all(pt, pt->pt_root);
+
+    pnpool_destroy(pt, &pt->pt_nodes);
+    pnpool_destroy(pt, &pt->pt_leaves);
+    pkey_destroy(pt);
+
+    free(pt);
+}
+
+/***********************************************************###**
+ * Remove every key from the trie but hold on to the node chunks 
+ * so the trie can be refilled without going back to malloc.
+ *
+ * In concurrent mode this waits for readers that can still see 
+ * the old keys to finish. With snapshots of a persistent trie 
+ * left, the nodes are unlinked one by one instead.
+ ***********************************************************###*/
+void
+ptrie_reset(ptrie_t *pt)
+{
+    pidx_t root = pt->pt_root;
+
+    if (pt->pt_vers && pvers_reset(pt))
+        return;
+
+    PN_STORE(&pt->pt_root, PN_NIL);
+    ptrie_synchronize(pt);
+
+    pfx_free_all(pt, root);
+
+    pnpool_reset(&pt->pt_nodes);
+    pnpool_reset(&pt->pt_leaves);
+    pkey_destroy(pt);
+
+    if (pt->pt_cache)
+        pcache_reset(pt);
+
+    pt->pt_size = 0;
+}
+
+/***********************************************************###**
+ * Give node chunks that are no longer in use back to the system
+ * (through the free function set with PTRIEPARM_FREE_FUNC). 
+ * Returns the number of bytes released.
+ ***********************************************************###*/
+size_t
+ptrie_shrink(ptrie_t *pt)
+{
+    return pnpool_shrink(pt, &pt->pt_nodes) +
+           pnpool_shrink(pt, &pt->pt_leaves) +
+           pkey_shrink(pt);
 }
 
 void 
@@ -91,6 +220,38 @@ ptrie_add(ptrie_t *pt, void *key, void *val)
     ptrie_add2(pt, key, val, NULL);
 }
 
+void 
+ptrie_add2(ptrie_t *pt, void *key, void *val, void **pnode)
+{
+    ptrie_add2_len(pt, key, keysize(pt, key), val, pnode);
+}
+
+/***********************************************************###**
+ * The _len functions take the size of the key from the caller 
+ * instead of from PTRIEPARM_KEYSZ or PTRIEPARM_KEYSZ_FUNC, so 
+ * keys may be binary and contain nul bytes. Keys that only differ
+ * by trailing nul bytes, such as "a" and "a\0", are different 
+ * keys; the shorter one sorts first.
+ ***********************************************************###*/
+void 
+ptrie_add_len(ptrie_t *pt, void *key, size_t keysz, void *val)
+{
+    ptrie_add2_len(pt, key, keysz, val, NULL);
+}
+
+void 
+ptrie_add2_len(ptrie_t *pt, void *key, size_t keysz, void *val, void **pnode)
+{
+    /* the leaves of a prefix trie hold pfx_t chains, not values */
+    if (pt->pt_flags & PTF_PREFIX) {
+        if (pt->pt_size != 0)
+            return;
+        pt->pt_flags &= ~PTF_PREFIX;
+    }
+
+    ptrie_add0(pt, key, keysz, val, pnode);
+}
+
 /*
  *
  * (1) Insert 0001 into an empty trie.
@@ -161,35 +322,42 @@ ptrie_add(ptrie_t *pt, void *key, void *val)
  *           /   \
  *     (0001)     (0010)
  */
-void 
-ptrie_add2(ptrie_t *pt, void *key, void *val, void **pnode)
+static void 
+ptrie_add0(ptrie_t *pt, void *key, size_t keysz, void *val, void **pnode)
 {
+    pidx_t    x;
+    pidx_t    up;     /* parent of x */
+    pidx_t   *lk;     /* orig parent to child link */
+    pidx_t    nnode;  /* new internal node */
+    pidx_t    nleaf;  /* new child node */
     pnode_t  *pn;
-    pnode_t **lk;     /* orig parent to child link */
-    pnode_t  *nnode;  /* new internal node */
-    pnode_t  *nleaf;  /* new child node */
-    size_t    keysz;
+    pleaf_t  *pl;
     int       diffbit;
 
-    keysz = keysize(pt, key);
+    if (pt->pt_flags & PTRIE_F_SEDGEWICK) {
+        sg_add(pt, key, keysz, val, pnode);
+        return;
+    }
 
     if (pt->pt_size == 0 ||
-        pt->pt_root == NULL) {
-        pt->pt_root = newcld(pt, key, keysz, val);
-        pt->pt_root->pn_up = NULL;
+        pt->pt_root == PN_NIL) {
+        nleaf = newcld(pt, key, keysz, val);
+        pn_leaf(pt, nleaf)->pl_up = PN_NIL;
+        PN_STORE(&pt->pt_root, nleaf);
         pt->pt_size++;
+        PT_COUNT(pt, adds);
 
         if (pnode)
-            *pnode = pt->pt_root;
+            *pnode = PIDX2PTR(nleaf);
 
         return;
     }
 
-    for (pn = pt->pt_root; pn->pn_type == PN_NODE; /**/) 
-        pn = pn->pn_cld[getbit(key, keysz, pn->pn_bit)];
+    pl = pn_leaf(pt, pn_search(pt, pt->pt_root, key, keysz));
 
-    diffbit = keycmp(key, keysz, pn->pn_key, pn->pn_keysz);
+    diffbit = keycmp(key, keysz, pl->pl_key, pl->pl_keysz);
     if (diffbit == 0) {
+        PT_COUNT(pt, dups);
         return;     /* duplicate! */
     }
 
@@ -199,9 +367,9 @@ ptrie_add2(ptrie_t *pt, void *key, void *val, void **pnode)
      * the difference bit that will be used for this 
      * key. 
      * 
-     * As we traverse, "pn" points to the node we are 
-     * currently visiting and "lk" points to the link 
-     * we used to get to "pn".
+     * As we traverse, "pn" is the node we are currently
+     * visiting and "lk" points to the link we used to 
+     * get to "pn".
      *
      *
      *       pt->pt_root            pt->pt_root
@@ -215,18 +383,21 @@ ptrie_add2(ptrie_t *pt, void *key, void *val, void **pnode)
      *      
      */
     lk = &pt->pt_root;
-    pn =  pt->pt_root; 
+    x  =  pt->pt_root; 
+    up =  PN_NIL;
 
-    while (pn->pn_type == PN_NODE) {
+    while (NOT PN_ISLEAF(x)) {
         /* 
          * Traverse tree until we either reach a leaf node or an
          * internal node whose difference bit is larger than diffbit
          */
+        pn = pn_node(pt, x);
         if (pn->pn_bit > ABSVAL(diffbit)) {
             break;
         } else {
+            up = x;
             lk = &pn->pn_cld[getbit(key, keysz, pn->pn_bit)];
-            pn = *lk;
+            x  = *lk;
         }
     }
 
@@ -249,53 +420,249 @@ ptrie_add2(ptrie_t *pt, void *key, void *val, void **pnode)
      *  nleaf       pn                 pn      nleaf
      *             /  \               /  \
      *
+     * Allocating the new nodes may grow the pools, but 
+     * chunks don't move so lk remains valid.
+     *
+     * The new nodes are filled in before the store to *lk
+     * makes them visible to concurrent readers. In persistent
+     * mode up may be shared with a snapshot, in which case it 
+     * is copied rather than changed.
      */
     nleaf = newcld(pt, key, keysz, val);
-    nnode = newpar(pt, diffbit, nleaf, pn);
+    nnode = newpar(pt, diffbit, nleaf, x);
+
+    pn_leaf(pt, nleaf)->pl_up = nnode;
+    pn_node(pt, nnode)->pn_up = up;
+    pn_setparent(pt, x, nnode);
 
-    nleaf->pn_up = nnode;
-    nnode->pn_up = pn->pn_up;
-    pn->pn_up = nnode;
+    if (pt->pt_vers)
+        pvers_link(pt, up, key, keysz, nnode);
+    else
+        PN_STORE(lk, nnode);
 
-    *lk = nnode;
+    if (pt->pt_flags & PTRIE_F_COUNTS)
+        pn_count_add(pt, up, 1);
 
     pt->pt_size++;
+    PT_COUNT(pt, adds);
     
     if (pnode)
-        *pnode = nleaf;
+        *pnode = PIDX2PTR(nleaf);
 
     return;
 }
 
+/***********************************************************###**
+ * Add n keys that are sorted in ascending order (the order in
+ * which ptrie_iter_next() returns them). 
+ *
+ * In a sorted list, the trie shape is fixed by the difference 
+ * bits of neighbouring keys. Each new key becomes the right-most
+ * leaf, so we only need to look at the right spine of the trie:
+ * starting at the previous key's leaf we climb while the nodes 
+ * we pass test a bit larger than the new difference bit, then 
+ * splice in a new internal node with the subtree we climbed out 
+ * of as its left child and the new leaf as its right child:
+ *
+ *  keys 0001, 0010, 1001
+ *
+ *     (0001)  ->       [3]         ->           [1]
+ *                     /   \  new leaf          /   \  new leaf
+ *               (0001)     (0010)           [3]     (1001)
+ *                                          /   \  subtree we climbed out of
+ *                                    (0001)     (0010)
+ *
+ * A node we climb past never comes back onto the spine, so the 
+ * build takes O(n) time, with one key compare per key and no 
+ * searches. Leaves are allocated in key order.
+ *
+ * Duplicate keys are skipped, as in ptrie_add(). If the trie 
+ * isn't empty, or the keys turn out not to be sorted, the rest
+ * of the keys are added with ptrie_add().
+ ***********************************************************###*/
+void
+ptrie_build_sorted(ptrie_t *pt, void **keys, void **vals, int n)
+{
+    pidx_t   x;
+    pidx_t   up;
+    pidx_t   nnode;
+    pidx_t   nleaf;
+    pleaf_t *pl;
+    size_t   keysz;
+    int      diffbit;
+    int      i;
+
+    if ((pt->pt_flags & PTRIE_F_SEDGEWICK) ||
+        pt->pt_size != 0) {
+        for (i = 0; i < n; i++)
+            ptrie_add(pt, keys[i], vals[i]);
+        return;
+    }
+
+    if (n <= 0)
+        return;
+
+    keysz = keysize(pt, keys[0]);
+    x = newcld(pt, keys[0], keysz, vals[0]); /* right-most leaf */
+    pn_leaf(pt, x)->pl_up = PN_NIL;
+    PN_STORE(&pt->pt_root, x);
+    pt->pt_size = 1;
+
+    for (i = 1; i < n; i++) {
+        pl = pn_leaf(pt, x);
+        keysz = keysize(pt, keys[i]);
+
+        diffbit = keycmp(keys[i], keysz, pl->pl_key, pl->pl_keysz);
+        if (diffbit == 0)
+            continue;   /* duplicate! */
+        if (diffbit < 0)
+            break;      /* not sorted */
+
+        for (up = pl->pl_up; up != PN_NIL; up = pn_node(pt, up)->pn_up) {
+            if (pn_node(pt, up)->pn_bit < diffbit)
+                break;
+            x = up;
+        }
+
+        nleaf = newcld(pt, keys[i], keysz, vals[i]);
+        nnode = newpar(pt, diffbit, nleaf, x);
+
+        pn_leaf(pt, nleaf)->pl_up = nnode;
+        pn_node(pt, nnode)->pn_up = up;
+        pn_setparent(pt, x, nnode);
+
+        if (up == PN_NIL)
+            PN_STORE(&pt->pt_root, nnode);
+        else
+            PN_STORE(&pn_node(pt, up)->pn_cld[1], nnode);
+
+        pt->pt_size++;
+        x = nleaf;
+    }
+
+    if (pt->pt_flags & PTRIE_F_COUNTS)
+        pn_recount(pt, pt->pt_root);
+
+    for (; i < n; i++)
+        ptrie_add(pt, keys[i], vals[i]);
+}
+
 int 
 ptrie_haskey(ptrie_t *pt, void *key)
 {
     return ptrie_get(pt, key) != NULL;
 }
 
+int 
+ptrie_haskey_len(ptrie_t *pt, void *key, size_t keysz)
+{
+    return ptrie_get_len(pt, key, keysz) != NULL;
+}
+
 void *
 ptrie_get(ptrie_t *pt, void *key)
 {
-    pnode_t *pn;
-    size_t   keysz;
+    /* the trie is empty iff it has no root */
+    if (PN_LOAD(&pt->pt_root) == PN_NIL) {
+        PT_COUNT(pt, misses);
+        return NULL;
+    }
 
-    if (pt->pt_size == 0 ||
-        pt->pt_root == NULL) {
+    return ptrie_get_len(pt, key, keysize(pt, key));
+}
+
+void *
+ptrie_get_len(ptrie_t *pt, void *key, size_t keysz)
+{
+    pidx_t   root;
+    pidx_t   x;
+    pleaf_t *pl;
+    uint32_t hash = 0;
+
+    if ((root = PN_LOAD(&pt->pt_root)) == PN_NIL) {
+        PT_COUNT(pt, misses);
         return NULL;
     }
 
-    keysz = keysize(pt, key);
+    if (pt->pt_flags & PTRIE_F_SEDGEWICK)
+        return sg_get(pt, key, keysz);
+
+    if (pt->pt_cache && (x = pcache_get(pt, key, keysz, &hash)) != PN_NIL) {
+        PT_COUNT(pt, hits);
+        return pn_leaf(pt, x)->pl_val;
+    }
 
-    for (pn = pt->pt_root; pn->pn_type == PN_NODE; /**/) 
-        pn = pn->pn_cld[getbit(key, keysz, pn->pn_bit)];
+    x = pn_search(pt, root, key, keysz);
+    pl = pn_leaf(pt, x);
 
-    if (keyseq(key, keysz, pn->pn_key, pn->pn_keysz)) {
-        return pn->pn_val;
+    if (keyseq(key, keysz, pl->pl_key, pl->pl_keysz)) {
+        if (pt->pt_cache)
+            pcache_put(pt, hash, x);
+        PT_COUNT(pt, hits);
+        return pl->pl_val;
     }
 
+    PT_COUNT(pt, misses);
     return NULL;
 }
 
+/***********************************************************###**
+ * Look up n keys at once, storing the value of keys[i] (or NULL)
+ * in vals[i]. Returns the number of keys found.
+ *
+ * Rather than searching for each key in turn, the searches are 
+ * advanced one level at a time in groups of PTRIE_BATCHSZ so 
+ * that the cache misses of the group overlap.
+ ***********************************************************###*/
+int
+ptrie_get_batch(ptrie_t *pt, void **keys, int n, void **vals)
+{
+    pidx_t   lf[PTRIE_BATCHSZ];
+    size_t   keysz[PTRIE_BATCHSZ];
+    pidx_t   root;
+    pleaf_t *pl;
+    int      i;
+    int      j;
+    int      m;
+    int      found = 0;
+
+    if ((root = PN_LOAD(&pt->pt_root)) == PN_NIL) {
+        memset(vals, 0, n * sizeof(*vals));
+        return 0;
+    }
+
+    if (pt->pt_flags & PTRIE_F_SEDGEWICK) {
+        for (i = 0; i < n; i++) {
+            if ((vals[i] = ptrie_get(pt, keys[i])))
+                found++;
+        }
+        return found;
+    }
+
+    for (i = 0; i < n; i += m) {
+        m = n - i < PTRIE_BATCHSZ ? n - i : PTRIE_BATCHSZ;
+
+        search_batch(pt, root, keys + i, keysz, lf, m);
+
+        for (j = 0; j < m; j++)
+            PREFETCH(pn_leaf(pt, lf[j])->pl_key);
+
+        for (j = 0; j < m; j++) {
+            pl = pn_leaf(pt, lf[j]);
+            if (keyseq(keys[i+j], keysz[j], pl->pl_key, pl->pl_keysz)) {
+                vals[i+j] = pl->pl_val;
+                PT_COUNT(pt, hits);
+                found++;
+            } else {
+                vals[i+j] = NULL;
+                PT_COUNT(pt, misses);
+            }
+        }
+    }
+
+    return found;
+}
+
 /***********************************************************###**
  * Find node in ptrie for which all children nodes match prefix 
  * up to the first nbits
@@ -303,29 +670,39 @@ ptrie_get(ptrie_t *pt, void *key)
 void *
 ptrie_get_prefix(ptrie_t *pt, void *prefix, size_t nbits)
 {
-    pnode_t *pn;
-    pnode_t *in;
-    size_t   pfxsz;
-    int      diffbit;
+    return ptrie_get_prefix_len(pt, prefix, keysize(pt, prefix), nbits);
+}
 
-    pfxsz = keysize(pt, prefix);
+/***********************************************************###**
+ * As ptrie_get_prefix(), with prefix pfxsz bytes long. Bits past
+ * the end of the prefix count as 0.
+ ***********************************************************###*/
+void *
+ptrie_get_prefix_len(ptrie_t *pt, void *prefix, size_t pfxsz, size_t nbits)
+{
+    pidx_t   x;
+    pidx_t   in;
+    pidx_t   root;
+    pleaf_t *pl;
+    int      diffbit;
 
-    if (pt->pt_size == 0 ||
-        pt->pt_root == NULL) {
+    if ((root = PN_LOAD(&pt->pt_root)) == PN_NIL)
         return NULL;
-    }
 
-    for (pn = pt->pt_root; pn->pn_type == PN_NODE; /**/) 
-        pn = pn->pn_cld[getbit(prefix, pfxsz, pn->pn_bit)];
+    if (pt->pt_flags & PTRIE_F_SEDGEWICK)
+        return sg_get_prefix(pt, prefix, pfxsz, nbits);
+
+    x  = pn_search(pt, root, prefix, pfxsz);
+    pl = pn_leaf(pt, x);
 
-    diffbit = keycmp(prefix, pfxsz, pn->pn_key, pn->pn_keysz);
+    diffbit = keycmp(prefix, pfxsz, pl->pl_key, pl->pl_keysz);
     
     if (diffbit == 0 || nbits < diffbit) {
-        for (in = pn->pn_up; in && nbits < in->pn_bit; in = pn->pn_up) 
-            pn = in;
+        for (in = pn_parent(pt, x); in && nbits < pn_node(pt, in)->pn_bit; in = pn_parent(pt, x)) 
+            x = in;
     }
 
-    return pn;
+    return PIDX2PTR(x);
 }
 
 /***********************************************************###**
@@ -342,31 +719,67 @@ ptrie_get_prefix(ptrie_t *pt, void *prefix, size_t nbits)
 void 
 ptrie_del(ptrie_t *pt, void *key)
 {
-    size_t keysz;
+    if (pt->pt_size == 0 ||
+        pt->pt_root == PN_NIL) {
+        return;
+    }
+
+    ptrie_del_len(pt, key, keysize(pt, key));
+}
+
+void 
+ptrie_del_len(ptrie_t *pt, void *key, size_t keysz)
+{
+    pidx_t   x;
+    pleaf_t *pl;
 
     if (pt->pt_size == 0 ||
-        pt->pt_root == NULL) {
+        pt->pt_root == PN_NIL) {
+        return;
+    }
+
+    if (pt->pt_flags & PTRIE_F_SEDGEWICK) {
+        sg_del(pt, key, keysz);
+        return;
+    }
+
+    if (pt->pt_flags & PTF_PREFIX)
+        return;
+
+    /* 
+     * ptrie_del0() relinks every node on the path, which readers
+     * and snapshots mustn't see, so find the leaf and unlink it 
+     * in one go. That also leaves the path for the counts to be 
+     * taken down along.
+     */
+    if (pt->pt_rcu || pt->pt_vers || (pt->pt_flags & PTRIE_F_COUNTS)) {
+        x = pn_search(pt, pt->pt_root, key, keysz);
+        pl = pn_leaf(pt, x);
+        if (keyseq(key, keysz, pl->pl_key, pl->pl_keysz))
+            ptrie_del_pnode(pt, PIDX2PTR(x));
         return;
     }
 
-    keysz = keysize(pt, key);
     pt->pt_root = ptrie_del0(pt, key, keysz, pt->pt_root);
 }
 
 /***********************************************************###**
  * Ptrie delete helper function
  ***********************************************************###*/
-static pnode_t * 
-ptrie_del0(ptrie_t *pt, void *key, size_t keysz, pnode_t *pn)
+static pidx_t 
+ptrie_del0(ptrie_t *pt, void *key, size_t keysz, pidx_t x)
 {
-    int i; /* child index */
+    int      i; /* child index */
+    pnode_t *pn;
+    pleaf_t *pl;
 
-    if (pn->pn_type == PN_NODE) {
+    if (NOT PN_ISLEAF(x)) {
+        pn = pn_node(pt, x);
         i = getbit(key, keysz, pn->pn_bit);
         pn->pn_cld[i] = ptrie_del0(pt, key, keysz, pn->pn_cld[i]);
     
-        if (pn->pn_cld[i] == NULL) {
-            pnode_t *fn; /* internal node we'll free */
+        if (pn->pn_cld[i] == PN_NIL) {
+            pidx_t fn; /* internal node we'll free */
 
             /*                                     
              *                                    +--------->[1] pn->pn_up
@@ -375,25 +788,29 @@ ptrie_del0(ptrie_t *pt, void *key, size_t keysz, pnode_t *pn)
              *                                    |     /   \
              *                                    (0001)     NULL
              */
-            pn->pn_cld[OTHER_CLDIDX(i)]->pn_up = pn->pn_up;
+            pn_setparent(pt, pn->pn_cld[OTHER_CLDIDX(i)], pn->pn_up);
 
             /*                                    +--------->[1]
              *                                    |         /   \
              * pn->pn_cld[OTHER_CLDIDX(i)]->pn_up |   fn [3]     (1001)
              *                                    |     /   \
-             *                                 pn (0001)     NULL
+             *                                  x (0001)     NULL
              */
-            fn = pn;
-            pn = pn->pn_cld[OTHER_CLDIDX(i)];
+            fn = x;
+            x = pn->pn_cld[OTHER_CLDIDX(i)];
             pnode_free(pt, fn);
         }
-    } else if (keyseq(key, keysz, pn->pn_key, pn->pn_keysz)) {
-        pnode_free(pt, pn);
-        pn = NULL;
-        pt->pt_size--;
+    } else {
+        pl = pn_leaf(pt, x);
+        if (keyseq(key, keysz, pl->pl_key, pl->pl_keysz)) {
+            pleaf_free(pt, x);
+            x = PN_NIL;
+            pt->pt_size--;
+            PT_COUNT(pt, dels);
+        }
     }
 
-    return pn;
+    return x;
 }
 
 
@@ -410,154 +827,774 @@ void
 ptrie_del_pnode(ptrie_t *pt, void *pnode)
 {
     int      i;  /* child index */
-    pnode_t *in; /* internal node parent */
-    pnode_t *gp; /* grand parent node */
-    pnode_t *oc; /* other child */
-    pnode_t *pn; /* node being deleted */
+    pidx_t   x;  /* node being deleted */
+    pidx_t   in; /* internal node parent */
+    pidx_t   gp; /* grand parent node */
+    pidx_t   oc; /* other child */
+    pleaf_t *pl;
+
+    if (pt->pt_flags & PTRIE_F_SEDGEWICK) {
+        sg_del_pnode(pt, pnode);
+        return;
+    }
 
-    pn = (pnode_t *)pnode;
+    x = PTR2PIDX(pnode);
 
-    if (NOT pn->pn_type == PN_LEAF)
+    if (NOT PN_ISLEAF(x))
         return;
 
-    if (NOT pn->pn_up) {
+    pl = pn_leaf(pt, x);
+
+    if (NOT pl->pl_up) {
         /* tree is made up of single leaf node */
-        pnode_free(pt, pn);
+        PN_STORE(&pt->pt_root, PN_NIL);
+        pleaf_free(pt, x);
         pt->pt_size--;
+        PT_COUNT(pt, dels);
         return; 
     }
 
-    in = pn->pn_up;
-    gp = in->pn_up;
+    in = pl->pl_up;
+    gp = pn_node(pt, in)->pn_up;
 
-    i = getbit(pn->pn_key, pn->pn_keysz, in->pn_bit);
+    i = getbit(pl->pl_key, pl->pl_keysz, pn_node(pt, in)->pn_bit);
 
-    oc = in->pn_cld[OTHER_CLDIDX(i)];
-    oc->pn_up = in->pn_up;
+    oc = pn_node(pt, in)->pn_cld[OTHER_CLDIDX(i)];
+    pn_setparent(pt, oc, gp);
 
-    if (gp) {
-        i = getbit(pn->pn_key, pn->pn_keysz, gp->pn_bit);
-        gp->pn_cld[i] = oc;
+    /* a single store unlinks both in and x */
+    if (pt->pt_vers) {
+        pvers_link(pt, gp, pl->pl_key, pl->pl_keysz, oc);
+    } else if (gp) {
+        i = getbit(pl->pl_key, pl->pl_keysz, pn_node(pt, gp)->pn_bit);
+        PN_STORE(&pn_node(pt, gp)->pn_cld[i], oc);
     } else {
-        pt->pt_root = oc;
+        PN_STORE(&pt->pt_root, oc);
     }
 
+    if (pt->pt_flags & PTRIE_F_COUNTS)
+        pn_count_add(pt, gp, -1);
+
     pnode_free(pt, in);
-    pnode_free(pt, pn);
+    pleaf_free(pt, x);
     pt->pt_size--;
+    PT_COUNT(pt, dels);
 
     return;
 }
 
-void 
-ptrie_set_parm(ptrie_t *pt, uint32_t parm, void *value)
+/***********************************************************###**
+ * Add route prefix key/nbits to the trie.
+ *
+ * The key is copied and every bit past nbits is cleared, so 
+ * 10.1.2.3/16 is stored as 10.1.0.0/16. A prefix trie is 
+ * populated with ptrie_add_prefix() and queried with ptrie_lpm();
+ * ptrie_size() counts distinct masked keys.
+ *
+ * As with ptrie_add(), adding a prefix that is already present 
+ * leaves the existing value in place.
+ *
+ * Returns 0, or -1 with errno set to EINVAL for PTRIE_F_SEDGEWICK
+ * and PTRIE_F_PERSISTENT tries and for tries that already hold 
+ * keys added with ptrie_add(). The other way round, ptrie_add() 
+ * and ptrie_del() do nothing on a trie that holds prefixes.
+ ***********************************************************###*/
+int
+ptrie_add_prefix(ptrie_t *pt, void *key, size_t nbits, void *val)
 {
-    switch (parm) {
-    case PTRIEPARM_KEYSZ:
-        pt->pt_keysz = (size_t) value;
-        break;
+    pidx_t    lf;
+    pfx_t    *px;
+    pfx_t   **pp;
+    void     *mkey;
+    size_t    keysz;
 
-    case PTRIEPARM_KEYSZ_FUNC:
-        pt->pt_keysz_func = (size_t (*)(void *)) value;
-        break;
+    if ((pt->pt_flags & (PTRIE_F_SEDGEWICK | PTRIE_F_PERSISTENT)) ||
+        (pt->pt_size != 0 && NOT (pt->pt_flags & PTF_PREFIX))) {
+        errno = EINVAL;
+        return -1;
+    }
 
-    case PTRIEPARM_MALLOC_FUNC:
-        pt->pt_malloc_func = (void *(*)(size_t)) value;
-        break;
+    keysz = keysize(pt, key);
+    if (nbits > keysz * BITS_PER_BYTE)
+        nbits = keysz * BITS_PER_BYTE;
 
-    case PTRIEPARM_FREE_FUNC:
-        pt->pt_free_func = (void (*)(void *)) value;
-        break;
+    mkey = pt->pt_malloc_func(keysz);
+    memcpy(mkey, key, keysz);
+    pfx_mask(mkey, keysz, nbits);
 
-    default:
-        break;
+    if (NOT (pt->pt_flags & PTF_PREFIX))
+        pt->pt_flags |= PTF_PREFIX;
+
+    lf = pfx_leaf(pt, mkey, keysz);
+    if (lf) {
+        pt->pt_free_func(mkey);
+
+        /* keep chain sorted from longest to shortest prefix */
+        for (pp = (pfx_t **)&pn_leaf(pt, lf)->pl_val; *pp; pp = &(*pp)->px_next) {
+            if ((*pp)->px_nbits == nbits)
+                return 0; /* duplicate! */
+            if ((*pp)->px_nbits < nbits)
+                break;
+        }
+    } else {
+        pp = NULL;
     }
-}
 
+    px = pt->pt_malloc_func(sizeof(*px));
+    px->px_nbits = nbits;
+    px->px_val = val;
 
-int 
-ptrie_size(ptrie_t *pt)
-{
-    return pt ? pt->pt_size : 0;
+    if (pp) {
+        px->px_next = *pp;
+        PN_STORE(pp, px);
+    } else {
+        px->px_next = NULL;
+        ptrie_add0(pt, mkey, keysz, px, NULL);
+        if (pt->pt_flags & PTRIE_F_OWNKEYS)
+            pt->pt_free_func(mkey); /* the leaf has its own copy */
+    }
+
+    return 0;
 }
 
-void 
-ptrie_iter_init(ptrie_t *pt, void *root, ptrie_iter_t *ptit) 
+/***********************************************************###**
+ * Remove route prefix key/nbits. The leaf holding the masked key 
+ * is deleted once its last prefix is removed.
+ ***********************************************************###*/
+void
+ptrie_del_prefix(ptrie_t *pt, void *key, size_t nbits)
 {
-    pnode_t *pn;
-    
-    if (ptit == NULL)
-        ptit = &pt->pt_iter;
-
-    if (NOT root)
-        root = pt->pt_root;
-
-    ptit->root = root;
+    pidx_t    lf;
+    pleaf_t  *pl;
+    pfx_t    *px;
+    pfx_t   **pp;
+    void     *mkey;
+    size_t    keysz;
 
     if (pt->pt_size == 0 ||
-        pt->pt_root == NULL) {
-        ptit->pn = NULL;
-        return;
-    }
-
-    if (pt->pt_root->pn_type == PN_LEAF) {
-        ptit->pn = pt->pt_root;
+        pt->pt_root == PN_NIL ||
+        NOT (pt->pt_flags & PTF_PREFIX)) {
         return;
     }
 
-    /* find left-most child of root*/
-    for (pn = ptit->root; pn->pn_type == PN_NODE; pn = pn->pn_cld[0])
-        /**/;
-
-    ptit->pn = pn;
-    return;
-}
+    keysz = keysize(pt, key);
+    if (nbits > keysz * BITS_PER_BYTE)
+        nbits = keysz * BITS_PER_BYTE;
 
-int 
-ptrie_iter_next(ptrie_t *pt, ptrie_iter_t *ptit, void **key, void **val)
-{
-    pnode_t *pn;
+    mkey = pt->pt_malloc_func(keysz);
+    memcpy(mkey, key, keysz);
+    pfx_mask(mkey, keysz, nbits);
 
-    if (NOT ptit)
-        ptit = &pt->pt_iter;
+    lf = pfx_leaf(pt, mkey, keysz);
+    pt->pt_free_func(mkey);
 
-    if (NOT ptit->pn)  
-        return 0; /* finished traversal */
+    if (NOT lf)
+        return;
 
-    pn = ptit->pn;
+    pl = pn_leaf(pt, lf);
 
-    if (key) *key = pn->pn_key;
-    if (val) *val = pn->pn_val;
-    
-    if (pn != ptit->root && NODE_IS_RCLD(pn)) {
-        for (pn = pn->pn_up; pn != ptit->root; pn = pn->pn_up) 
-            if (NODE_IS_LCLD(pn))
-                break;
+    for (pp = (pfx_t **)&pl->pl_val; (px = *pp); pp = &px->px_next) {
+        if (px->px_nbits == nbits) {
+            PN_STORE(pp, px->px_next);
+            pt_dispose(pt, px);
+            break;
+        }
     }
 
-    if (pn == ptit->root) {
-        ptit->pn = NULL;
-        return 1;
+    if (pl->pl_val == NULL) {
+        mkey = pl->pl_key;
+        ptrie_del_pnode(pt, PIDX2PTR(lf));
+        if (NOT (pt->pt_flags & PTRIE_F_OWNKEYS))
+            pt_dispose(pt, mkey);
+    }
+}
+
+/***********************************************************###**
+ * Return the value of the longest prefix matching addr, or NULL
+ * if no prefix matches.
+ *
+ * Search down the trie with addr until we reach leaf L and let d 
+ * be the first bit at which addr and key(L) differ. No key in the
+ * trie agrees with addr on its first d bits, so a matching prefix 
+ * P/n must have n < d, which means that it is also a prefix of 
+ * key(L).
+ *
+ * Since the bits of P past n are all 0, P is the left-most leaf 
+ * of the subtree rooted at the highest node on the path to L 
+ * whose difference bit is larger than n. So we back up from L 
+ * towards the root, checking the left-most leaf of each subtree 
+ * for prefixes that fall between the bit of the subtree and the 
+ * bit of its parent:
+ *
+ *                [1]
+ *               /   \        n < 1      : check left-most leaf of [1]
+ *            [3]     (1001)
+ *           /   \            1 <= n < 3 : check left-most leaf of [3]
+ *     (0000)     (0010) L
+ *                            3 <= n < d : check L
+ ***********************************************************###*/
+void *
+ptrie_lpm(ptrie_t *pt, void *addr)
+{
+    size_t keysz;
+    pidx_t root;
+
+    if ((root = PN_LOAD(&pt->pt_root)) == PN_NIL ||
+        NOT (pt->pt_flags & PTF_PREFIX)) {
+        return NULL;
+    }
+
+    keysz = keysize(pt, addr);
+
+    return lpm_leaf(pt, addr, keysz, pn_search(pt, root, addr, keysz));
+}
+
+/***********************************************************###**
+ * Batched version of ptrie_lpm(). The searches down the trie are
+ * interleaved as in ptrie_get_batch(); backing up from each leaf 
+ * is then done one address at a time. Returns the number of 
+ * addresses that matched a prefix.
+ ***********************************************************###*/
+int
+ptrie_lpm_batch(ptrie_t *pt, void **addrs, int n, void **vals)
+{
+    pidx_t   lf[PTRIE_BATCHSZ];
+    size_t   keysz[PTRIE_BATCHSZ];
+    int      i;
+    int      j;
+    int      m;
+    int      found = 0;
+    pidx_t   root;
+
+    if ((root = PN_LOAD(&pt->pt_root)) == PN_NIL ||
+        NOT (pt->pt_flags & PTF_PREFIX)) {
+        memset(vals, 0, n * sizeof(*vals));
+        return 0;
+    }
+
+    for (i = 0; i < n; i += m) {
+        m = n - i < PTRIE_BATCHSZ ? n - i : PTRIE_BATCHSZ;
+
+        search_batch(pt, root, addrs + i, keysz, lf, m);
+
+        for (j = 0; j < m; j++) {
+            vals[i+j] = lpm_leaf(pt, addrs[i+j], keysz[j], lf[j]);
+            if (vals[i+j])
+                found++;
+        }
+    }
+
+    return found;
+}
+
+void 
+ptrie_set_parm(ptrie_t *pt, uint32_t parm, void *value)
+{
+    switch (parm) {
+    case PTRIEPARM_KEYSZ:
+        pt->pt_keysz = (size_t) value;
+        break;
+
+    case PTRIEPARM_KEYSZ_FUNC:
+        pt->pt_keysz_func = (size_t (*)(void *)) value;
+        break;
+
+    case PTRIEPARM_MALLOC_FUNC:
+        pt->pt_malloc_func = (void *(*)(size_t)) value;
+        break;
+
+    case PTRIEPARM_FREE_FUNC:
+        pt->pt_free_func = (void (*)(void *)) value;
+        break;
+
+    case PTRIEPARM_VALSZ_FUNC:
+        pt->pt_valsz_func = (size_t (*)(void *)) value;
+        break;
+
+    case PTRIEPARM_CACHESZ:
+        pcache_init(pt, (size_t) value);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/***********************************************************###**
+ * Value of parm. For PTRIEPARM_CACHESZ this is the number of
+ * entries in the cache in effect: the size asked for rounded up
+ * to whole sets, or 0 if there is no cache, as on the Sedgewick,
+ * concurrent and persistent tries that refuse one.
+ ***********************************************************###*/
+void *
+ptrie_get_parm(ptrie_t *pt, uint32_t parm)
+{
+    switch (parm) {
+    case PTRIEPARM_KEYSZ:
+        return (void *) pt->pt_keysz;
+
+    case PTRIEPARM_KEYSZ_FUNC:
+        return (void *) pt->pt_keysz_func;
+
+    case PTRIEPARM_MALLOC_FUNC:
+        return (void *) pt->pt_malloc_func;
+
+    case PTRIEPARM_FREE_FUNC:
+        return (void *) pt->pt_free_func;
+
+    case PTRIEPARM_VALSZ_FUNC:
+        return (void *) pt->pt_valsz_func;
+
+    case PTRIEPARM_CACHESZ:
+        return (void *) pcache_size(pt);
+
+    default:
+        return NULL;
+    }
+}
+
+
+int 
+ptrie_size(ptrie_t *pt)
+{
+    return pt ? pt->pt_size : 0;
+}
+
+void 
+ptrie_iter_init(ptrie_t *pt, void *root, ptrie_iter_t *ptit) 
+{
+    pidx_t x;
+
+    if (ptit == NULL)
+        ptit = &pt->pt_iter;
+
+    ptit->hi = NULL;
+
+    if (pt->pt_flags & PTRIE_F_SEDGEWICK) {
+        sg_iter_init(pt, root, ptit);
+        return;
+    }
+
+    if (NOT root && pt->pt_rcu) {
+        /* follow the root as it changes, see ptrie_iter_next() */
+        ptit->root = NULL;
+        x = PN_LOAD(&pt->pt_root);
+    } else {
+        if (NOT root)
+            root = PIDX2PTR(pt->pt_root);
+        ptit->root = root;
+        x = PTR2PIDX(root);
+    }
+
+    if (x == PN_NIL) {
+        ptit->pn = NULL;
+        return;
+    }
+
+    /* find left-most child of root*/
+    ptit->pn = PIDX2PTR(pn_leftmost(pt, x));
+    return;
+}
+
+int 
+ptrie_iter_next(ptrie_t *pt, ptrie_iter_t *ptit, void **key, void **val)
+{
+    return ptrie_iter_next_len(pt, ptit, key, NULL, val);
+}
+
+/***********************************************************###**
+ * As ptrie_iter_next(), also returning the size of the key.
+ ***********************************************************###*/
+int 
+ptrie_iter_next_len(ptrie_t *pt, ptrie_iter_t *ptit, void **key, size_t *keysz, void **val)
+{
+    pidx_t   x;
+    pidx_t   root;
+    pleaf_t *pl;
+    snode_t *sn;
+    int      diffbit;
+
+    if (NOT ptit)
+        ptit = &pt->pt_iter;
+
+    if (NOT ptit->pn)  
+        return 0; /* finished traversal */
+
+    if (ptit->hi) {
+        /* stop at the end of a range, see ptrie_iter_range() */
+        if (pt->pt_flags & PTRIE_F_SEDGEWICK) {
+            sn = sn_node(pt, PTR2PIDX(ptit->pn));
+            diffbit = keycmp(sn->sn_key, sn->sn_keysz, ptit->hi, ptit->hisz);
+        } else {
+            pl = pn_leaf(pt, PTR2PIDX(ptit->pn));
+            diffbit = keycmp(pl->pl_key, pl->pl_keysz, ptit->hi, ptit->hisz);
+        }
+        if (diffbit >= 0) {
+            ptit->pn = NULL;
+            return 0;
+        }
+    }
+
+    if (pt->pt_flags & PTRIE_F_SEDGEWICK)
+        return sg_iter_next(pt, ptit, key, keysz, val);
+
+    x = PTR2PIDX(ptit->pn);
+    root = PTR2PIDX(ptit->root);
+    pl = pn_leaf(pt, x);
+
+    if (key) *key = pl->pl_key;
+    if (keysz) *keysz = pl->pl_keysz;
+    if (val) *val = pl->pl_val;
+
+    /*
+     * The writer may be relinking the nodes above us, so rather
+     * than walking back up, look for the next key from the top.
+     */
+    if (pt->pt_rcu) {
+        root = ptit->root ? PTR2PIDX(ptit->root) : PN_LOAD(&pt->pt_root);
+        x = root ? pn_bound(pt, root, pl->pl_key, pl->pl_keysz, 1) : PN_NIL;
+        ptit->pn = PIDX2PTR(x);
+        return 1;
+    }
+    
+    if (x != root && NODE_IS_RCLD(pt, x)) {
+        for (x = pl->pl_up; x != root; x = pn_node(pt, x)->pn_up) 
+            if (NODE_IS_LCLD(pt, x))
+                break;
+    }
+
+    if (x == root) {
+        ptit->pn = NULL;
+        return 1;
     }
 
     /* 
-     * If we make it here, pn is a left child. 
-     * In that case, we set pn to the right 
+     * If we make it here, x is a left child. 
+     * In that case, we set x to the right 
      * child. Then we find traverse down until 
      * we find the left-most leaf node.
      */
-    pn = pn->pn_up->pn_cld[1];
-    while (pn->pn_type == PN_NODE)
-        pn = pn->pn_cld[0];
+    x = pn_node(pt, pn_parent(pt, x))->pn_cld[1];
+
+    ptit->pn = PIDX2PTR(pn_leftmost(pt, x));
+    return 1;
+}
+
+/***********************************************************###**
+ * Iterate backwards, from the largest key under root down to the
+ * smallest, with ptrie_iter_prev().
+ ***********************************************************###*/
+void 
+ptrie_iter_init_reverse(ptrie_t *pt, void *root, ptrie_iter_t *ptit) 
+{
+    pidx_t x;
+
+    if (ptit == NULL)
+        ptit = &pt->pt_iter;
+
+    ptit->hi = NULL;
+
+    if (pt->pt_flags & PTRIE_F_SEDGEWICK) {
+        sg_iter_init_reverse(pt, root, ptit);
+        return;
+    }
+
+    if (NOT root && pt->pt_rcu) {
+        ptit->root = NULL;
+        x = PN_LOAD(&pt->pt_root);
+    } else {
+        if (NOT root)
+            root = PIDX2PTR(pt->pt_root);
+        ptit->root = root;
+        x = PTR2PIDX(root);
+    }
+
+    ptit->pn = x == PN_NIL ? NULL : PIDX2PTR(pn_rightmost(pt, x));
+}
+
+/***********************************************************###**
+ * The mirror image of ptrie_iter_next(): climb while we're a left
+ * child, cross over to the left child of the parent and go down 
+ * to its right-most leaf.
+ ***********************************************************###*/
+int 
+ptrie_iter_prev(ptrie_t *pt, ptrie_iter_t *ptit, void **key, void **val)
+{
+    return ptrie_iter_prev_len(pt, ptit, key, NULL, val);
+}
+
+/***********************************************************###**
+ * As ptrie_iter_prev(), also returning the size of the key.
+ ***********************************************************###*/
+int 
+ptrie_iter_prev_len(ptrie_t *pt, ptrie_iter_t *ptit, void **key, size_t *keysz, void **val)
+{
+    pidx_t   x;
+    pidx_t   root;
+    pleaf_t *pl;
+
+    if (NOT ptit)
+        ptit = &pt->pt_iter;
+
+    if (NOT ptit->pn)  
+        return 0;
+
+    if (pt->pt_flags & PTRIE_F_SEDGEWICK)
+        return sg_iter_prev(pt, ptit, key, keysz, val);
+
+    x = PTR2PIDX(ptit->pn);
+    root = PTR2PIDX(ptit->root);
+    pl = pn_leaf(pt, x);
+
+    if (key) *key = pl->pl_key;
+    if (keysz) *keysz = pl->pl_keysz;
+    if (val) *val = pl->pl_val;
+
+    if (pt->pt_rcu) {
+        root = ptit->root ? PTR2PIDX(ptit->root) : PN_LOAD(&pt->pt_root);
+        x = root ? pn_prev(pt, root, pl->pl_key, pl->pl_keysz) : PN_NIL;
+        ptit->pn = PIDX2PTR(x);
+        return 1;
+    }
+
+    if (x != root && NODE_IS_LCLD(pt, x)) {
+        for (x = pl->pl_up; x != root; x = pn_node(pt, x)->pn_up) 
+            if (NODE_IS_RCLD(pt, x))
+                break;
+    }
+
+    if (x == root) {
+        ptit->pn = NULL;
+        return 1;
+    }
+
+    x = pn_node(pt, pn_parent(pt, x))->pn_cld[0];
+
+    ptit->pn = PIDX2PTR(pn_rightmost(pt, x));
+    return 1;
+}
+
+/***********************************************************###**
+ * Move iter to the smallest key in the subtree it covers that
+ * isn't less than key, so that ptrie_iter_next() returns that 
+ * key next. Finding it takes one search down the trie, so a scan
+ * can resume where it left off without starting over.
+ ***********************************************************###*/
+void
+ptrie_iter_seek(ptrie_t *pt, ptrie_iter_t *ptit, void *key)
+{
+    ptrie_iter_seek_len(pt, ptit, key, keysize(pt, key));
+}
+
+void
+ptrie_iter_seek_len(ptrie_t *pt, ptrie_iter_t *ptit, void *key, size_t keysz)
+{
+    pidx_t root;
+
+    if (ptit == NULL)
+        ptit = &pt->pt_iter;
+
+    if (pt->pt_flags & PTRIE_F_SEDGEWICK) {
+        ptit->pn = PIDX2PTR(sg_bound(pt, ptit->root, key, keysz, 0));
+        return;
+    }
+
+    root = ptit->root ? PTR2PIDX(ptit->root) : PN_LOAD(&pt->pt_root);
+    ptit->pn = root ? PIDX2PTR(pn_bound(pt, root, key, keysz, 0)) : NULL;
+}
 
-    ptit->pn = pn;
+/***********************************************************###**
+ * Start iter at the first key k with lo <= k < hi. A NULL lo 
+ * starts at the smallest key and a NULL hi runs to the largest.
+ * hi must stay valid until the iteration is done.
+ ***********************************************************###*/
+void
+ptrie_iter_range(ptrie_t *pt, ptrie_iter_t *ptit, void *lo, void *hi)
+{
+    ptrie_iter_range_len(pt, ptit, lo, lo ? keysize(pt, lo) : 0, 
+                         hi, hi ? keysize(pt, hi) : 0);
+}
+
+void
+ptrie_iter_range_len(ptrie_t *pt, ptrie_iter_t *ptit, void *lo, size_t losz,
+                     void *hi, size_t hisz)
+{
+    if (ptit == NULL)
+        ptit = &pt->pt_iter;
+
+    ptrie_iter_init(pt, 0, ptit);
+
+    if (lo)
+        ptrie_iter_seek_len(pt, ptit, lo, losz);
+
+    ptit->hi = hi;
+    ptit->hisz = hisz;
+}
+
+/***********************************************************###**
+ * Smallest key not less than (lower bound) or larger than (upper
+ * bound) key. Returns 0 if there's no such key, else sets *rkey
+ * and *rval if they aren't NULL and returns 1. The _len forms 
+ * also set *rkeysz to the size of the key found.
+ ***********************************************************###*/
+int
+ptrie_lower_bound(ptrie_t *pt, void *key, void **rkey, void **rval)
+{
+    return ptrie_lower_bound_len(pt, key, keysize(pt, key), rkey, NULL, rval);
+}
+
+int
+ptrie_lower_bound_len(ptrie_t *pt, void *key, size_t keysz, 
+                      void **rkey, size_t *rkeysz, void **rval)
+{
+    return pt_bound(pt, key, keysz, 0, rkey, rkeysz, rval);
+}
+
+int
+ptrie_upper_bound(ptrie_t *pt, void *key, void **rkey, void **rval)
+{
+    return ptrie_upper_bound_len(pt, key, keysize(pt, key), rkey, NULL, rval);
+}
+
+int
+ptrie_upper_bound_len(ptrie_t *pt, void *key, size_t keysz, 
+                      void **rkey, size_t *rkeysz, void **rval)
+{
+    return pt_bound(pt, key, keysz, 1, rkey, rkeysz, rval);
+}
+
+/***********************************************************###**
+ * Smallest and largest keys, and the keys just after and just 
+ * before key, which needn't be in the trie. Each returns 0 if 
+ * there's no such key, else sets *rkey and *rval if they aren't 
+ * NULL and returns 1. The _len forms also set *rkeysz.
+ ***********************************************************###*/
+int
+ptrie_min(ptrie_t *pt, void **rkey, void **rval)
+{
+    return pt_end(pt, 0, rkey, rval);
+}
+
+int
+ptrie_max(ptrie_t *pt, void **rkey, void **rval)
+{
+    return pt_end(pt, 1, rkey, rval);
+}
+
+int
+ptrie_next(ptrie_t *pt, void *key, void **rkey, void **rval)
+{
+    return ptrie_upper_bound(pt, key, rkey, rval);
+}
+
+int
+ptrie_next_len(ptrie_t *pt, void *key, size_t keysz, void **rkey, size_t *rkeysz, void **rval)
+{
+    return ptrie_upper_bound_len(pt, key, keysz, rkey, rkeysz, rval);
+}
+
+int
+ptrie_prev(ptrie_t *pt, void *key, void **rkey, void **rval)
+{
+    return ptrie_prev_len(pt, key, keysize(pt, key), rkey, NULL, rval);
+}
+
+int
+ptrie_prev_len(ptrie_t *pt, void *key, size_t keysz, void **rkey, size_t *rkeysz, void **rval)
+{
+    pidx_t   root;
+    pidx_t   x;
+    pleaf_t *pl;
+    snode_t *sn;
+
+    if ((root = PN_LOAD(&pt->pt_root)) == PN_NIL)
+        return 0;
+
+    if (pt->pt_flags & PTRIE_F_SEDGEWICK) {
+        if ((x = sg_prev(pt, NULL, key, keysz)) == PN_NIL)
+            return 0;
+        sn = sn_node(pt, x);
+        if (rkey) *rkey = sn->sn_key;
+        if (rkeysz) *rkeysz = sn->sn_keysz;
+        if (rval) *rval = sn->sn_val;
+        return 1;
+    }
+
+    if ((x = pn_prev(pt, root, key, keysz)) == PN_NIL)
+        return 0;
+
+    pl = pn_leaf(pt, x);
+    if (rkey) *rkey = pl->pl_key;
+    if (rkeysz) *rkeysz = pl->pl_keysz;
+    if (rval) *rval = pl->pl_val;
+    return 1;
+}
+
+static int
+pt_end(ptrie_t *pt, int last, void **rkey, void **rval)
+{
+    ptrie_iter_t it;
+    pidx_t       root;
+    pleaf_t     *pl;
+    snode_t     *sn;
+
+    if ((root = PN_LOAD(&pt->pt_root)) == PN_NIL)
+        return 0;
+
+    if (pt->pt_flags & PTRIE_F_SEDGEWICK) {
+        if (last)
+            sg_iter_init_reverse(pt, NULL, &it);
+        else
+            sg_iter_init(pt, NULL, &it);
+        sn = sn_node(pt, PTR2PIDX(it.pn));
+        if (rkey) *rkey = sn->sn_key;
+        if (rval) *rval = sn->sn_val;
+        return 1;
+    }
+
+    pl = pn_leaf(pt, last ? pn_rightmost(pt, root) : pn_leftmost(pt, root));
+    if (rkey) *rkey = pl->pl_key;
+    if (rval) *rval = pl->pl_val;
+    return 1;
+}
+
+static int
+pt_bound(ptrie_t *pt, void *key, size_t keysz, int upper, 
+         void **rkey, size_t *rkeysz, void **rval)
+{
+    pidx_t   root;
+    pidx_t   x;
+    pleaf_t *pl;
+    snode_t *sn;
+
+    if ((root = PN_LOAD(&pt->pt_root)) == PN_NIL)
+        return 0;
+
+    if (pt->pt_flags & PTRIE_F_SEDGEWICK) {
+        if ((x = sg_bound(pt, NULL, key, keysz, upper)) == PN_NIL)
+            return 0;
+        sn = sn_node(pt, x);
+        if (rkey) *rkey = sn->sn_key;
+        if (rkeysz) *rkeysz = sn->sn_keysz;
+        if (rval) *rval = sn->sn_val;
+        return 1;
+    }
+
+    if ((x = pn_bound(pt, root, key, keysz, upper)) == PN_NIL)
+        return 0;
+
+    pl = pn_leaf(pt, x);
+    if (rkey) *rkey = pl->pl_key;
+    if (rkeysz) *rkeysz = pl->pl_keysz;
+    if (rval) *rval = pl->pl_val;
     return 1;
 }
 
-static pnode_t *
-newpar(ptrie_t *pt, int diffbit, pnode_t *cld1, pnode_t *cld2)
+static pidx_t
+newpar(ptrie_t *pt, int diffbit, pidx_t cld1, pidx_t cld2)
 {
-    pnode_t *pn = pnode_new(pt, PN_NODE);
+    pidx_t   x = pnode_new(pt);
+    pnode_t *pn = pn_node(pt, x);
 
     pn->pn_bit = ABSVAL(diffbit); 
 
@@ -577,24 +1614,54 @@ newpar(ptrie_t *pt, int diffbit, pnode_t *cld1, pnode_t *cld2)
         pn->pn_cld[1] = cld1;
     }
 
-    return pn;
+    if (pt->pt_flags & PTRIE_F_COUNTS)
+        pn_count_set(pt, x);
+
+    return x;
 }
 
-static pnode_t *
+/*
+ * New leaf for key, with a copy of the key if the trie owns its
+ * keys
+ */
+pidx_t
 newcld(ptrie_t *pt, void *key, size_t keysz, void *val)
 {
-    pnode_t *pn = pnode_new(pt, PN_LEAF);
+    pidx_t   x = pleaf_new(pt);
+    pleaf_t *pl = pn_leaf(pt, x);
 
-    pn->pn_key   = key;
-    pn->pn_keysz = keysz;
+    if (pt->pt_flags & PTRIE_F_OWNKEYS)
+        key = keycopy(pt, pl, key, keysz);
 
-    pn->pn_val   = val;
-    pn->pn_valsz = 0;
+    pl->pl_key   = key;
+    pl->pl_keysz = keysz;
+    pl->pl_val   = val;
 
-    return pn;
+    return x;
 }
 
-static size_t
+/*
+ * Copy of key owned by leaf pl: in the leaf if it fits, else in
+ * the key arena. Variable length keys are usually strings, so 
+ * they keep a terminating nul.
+ */
+static void *
+keycopy(ptrie_t *pt, pleaf_t *pl, void *key, size_t keysz)
+{
+    uint8_t *copy;
+    size_t   size;
+
+    size = keysz + (pt->pt_keysz ? 0 : 1);
+    copy = size <= PL_INLINESZ ? PL_INLINE(pl) : pkey_alloc(pt, size);
+
+    memcpy(copy, key, keysz);
+    if (size > keysz)
+        copy[keysz] = '\0';
+
+    return copy;
+}
+
+size_t
 keysize(ptrie_t *pt, void *key)
 {
     if (pt->pt_keysz)
@@ -607,32 +1674,380 @@ keysize(ptrie_t *pt, void *key)
     }
 }
 
-static pnode_t *
-pnode_new(ptrie_t *pt, pn_type_t type)
+/***********************************************************###**
+ * Back up from leaf pn, reached by searching for addr, to find 
+ * the longest prefix matching addr. See ptrie_lpm().
+ ***********************************************************###*/
+static void *
+lpm_leaf(ptrie_t *pt, void *addr, size_t keysz, pidx_t x)
+{
+    pidx_t   up;
+    pleaf_t *pl;   /* left-most leaf of x */
+    pfx_t   *px;
+    pfx_t   *best;
+    size_t   maxbits;
+    size_t   lo;
+    int      diffbit;
+
+    pl = pn_leaf(pt, x);
+
+    diffbit = ABSVAL(keycmp(addr, keysz, pl->pl_key, pl->pl_keysz));
+    maxbits = diffbit ? diffbit - 1 : keysz * BITS_PER_BYTE;
+
+    best = NULL;
+
+    for (;;) {
+        for (px = PN_LOAD(&pl->pl_val); px; px = PN_LOAD(&px->px_next)) {
+            if (px->px_nbits <= maxbits)
+                break;
+        }
+
+        if (px && (best == NULL || px->px_nbits > best->px_nbits))
+            best = px;
+
+        up = pn_parent(pt, x);
+        lo = up ? pn_node(pt, up)->pn_bit : 0;
+        if (best && best->px_nbits >= lo)
+            break;
+
+        if (NOT up)
+            break;
+
+        /* prefixes further up must be shorter than x's parent bit */
+        if (lo - 1 < maxbits)
+            maxbits = lo - 1;
+
+        if (PN_LOAD(&pn_node(pt, up)->pn_cld[1]) == x)
+            pl = pn_leaf(pt, pn_leftmost(pt, PN_LOAD(&pn_node(pt, up)->pn_cld[0])));
+
+        x = up;
+    }
+
+    return best ? best->px_val : NULL;
+}
+
+/***********************************************************###**
+ * Advance the searches for keys[0..n-1] down the trie in 
+ * lock-step until each reaches a leaf, prefetching the next 
+ * node of every search. On return lf[i] is the leaf reached by 
+ * keys[i] and keysz[i] its size.
+ ***********************************************************###*/
+static void
+search_batch(ptrie_t *pt, pidx_t root, void **keys, size_t *keysz, pidx_t *lf, int n)
 {
     pnode_t *pn;
+    int      i;
+    int      active;
+
+    for (i = 0; i < n; i++) {
+        keysz[i] = keysize(pt, keys[i]);
+        lf[i] = root;
+    }
+
+    do {
+        active = 0;
+        for (i = 0; i < n; i++) {
+            if (NOT PN_ISLEAF(lf[i])) {
+                pn = pn_node(pt, lf[i]);
+                lf[i] = PN_LOAD(&pn->pn_cld[getbit(keys[i], keysz[i], pn->pn_bit)]);
+                PREFETCH(PN_ISLEAF(lf[i]) ? (void *)pn_leaf(pt, lf[i]) : (void *)pn_node(pt, lf[i]));
+                active++;
+            }
+        }
+    } while (active);
+}
+
+/***********************************************************###**
+ * Find the leaf holding masked prefix key, if any
+ ***********************************************************###*/
+static pidx_t
+pfx_leaf(ptrie_t *pt, void *key, size_t keysz)
+{
+    pidx_t   x;
+    pleaf_t *pl;
+
+    if (pt->pt_size == 0 ||
+        pt->pt_root == PN_NIL) {
+        return PN_NIL;
+    }
+
+    x  = pn_search(pt, pt->pt_root, key, keysz);
+    pl = pn_leaf(pt, x);
+
+    return keyseq(key, keysz, pl->pl_key, pl->pl_keysz) ? x : PN_NIL;
+}
+
+/***********************************************************###**
+ * Clear all bits of key past the first nbits
+ ***********************************************************###*/
+static void
+pfx_mask(void *key, size_t keysz, size_t nbits)
+{
+    uint8_t *ptr = (uint8_t *)key;
+    size_t   i = nbits / BITS_PER_BYTE;
+
+    if (i >= keysz)
+        return;
+
+    if (nbits % BITS_PER_BYTE)
+        ptr[i++] &= 0xff << (BITS_PER_BYTE - nbits % BITS_PER_BYTE);
+
+    memset(ptr + i, 0, keysz - i);
+}
+
+/***********************************************************###**
+ * Long key comparison kernels. Each returns the offset of the 
+ * first byte at which ptr1 and ptr2 differ, or n if the first 
+ * n bytes are equal.
+ ***********************************************************###*/
+static size_t
+keydiff_word(const uint8_t *ptr1, const uint8_t *ptr2, size_t n)
+{
+    uint64_t w1;
+    uint64_t w2;
+    size_t   i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        memcpy(&w1, ptr1 + i, 8);
+        memcpy(&w2, ptr2 + i, 8);
+        if (w1 != w2)
+            break;
+    }
+
+    for (; i < n; i++) {
+        if (ptr1[i] != ptr2[i])
+            break;
+    }
+
+    return i;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static size_t
+keydiff_sse2(const uint8_t *ptr1, const uint8_t *ptr2, size_t n)
+{
+    __m128i  v1;
+    __m128i  v2;
+    unsigned eq;
+    size_t   i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        v1 = _mm_loadu_si128((const __m128i *)(ptr1 + i));
+        v2 = _mm_loadu_si128((const __m128i *)(ptr2 + i));
+        eq = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2));
+        if (eq != 0xffff)
+            return i + __builtin_ctz(~eq);
+    }
+
+    return i + keydiff_word(ptr1 + i, ptr2 + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+keydiff_avx2(const uint8_t *ptr1, const uint8_t *ptr2, size_t n)
+{
+    __m256i  v1;
+    __m256i  v2;
+    unsigned eq;
+    size_t   i;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        v1 = _mm256_loadu_si256((const __m256i *)(ptr1 + i));
+        v2 = _mm256_loadu_si256((const __m256i *)(ptr2 + i));
+        eq = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, v2));
+        if (eq != 0xffffffff)
+            return i + __builtin_ctz(~eq);
+    }
+
+    return i + keydiff_sse2(ptr1 + i, ptr2 + i, n - i);
+}
+#endif
+
+/***********************************************************###**
+ * First call through ptrie_keydiff: pick the best kernel the 
+ * CPU supports and use it from now on.
+ ***********************************************************###*/
+static size_t
+keydiff_init(const uint8_t *ptr1, const uint8_t *ptr2, size_t n)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        ptrie_keydiff = keydiff_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        ptrie_keydiff = keydiff_sse2;
+    else
+#endif
+        ptrie_keydiff = keydiff_word;
+
+    return (*ptrie_keydiff)(ptr1, ptr2, n);
+}
+
+/*
+ * Free the masked keys and prefix chains owned by a trie that 
+ * holds route prefixes, below root.
+ */
+static void
+pfx_free_all(ptrie_t *pt, pidx_t root)
+{
+    ptrie_iter_t ptit;
+    pfx_t       *px;
+    void        *key;
+    void        *val;
+
+    if (NOT (pt->pt_flags & PTF_PREFIX))
+        return;
 
-    if (pt->pt_list == NULL) {
-        int i;
-        for (i = 0; i < PN_FREELIST_BLKSZ; i++) {
-            pn = pt->pt_malloc_func(sizeof(*pn));
-            pn->pn_cld[0] = pt->pt_list;
-            pt->pt_list = pn;
+    if (root == PN_NIL) {
+        pt->pt_flags &= ~PTF_PREFIX;
+        return;
+    }
+
+    ptrie_iter_init(pt, PIDX2PTR(root), &ptit);
+    while (ptrie_iter_next(pt, &ptit, &key, &val)) {
+        while ((px = val) != NULL) {
+            val = px->px_next;
+            pt->pt_free_func(px);
         }
+        if (NOT (pt->pt_flags & PTRIE_F_OWNKEYS))
+            pt->pt_free_func(key);
     }
 
-    pn = pt->pt_list;
-    pt->pt_list = pn->pn_cld[0];
-    pn->pn_type = type;
+    pt->pt_flags &= ~PTF_PREFIX;
+}
 
-    return pn;
+/*
+ * Free a node, or memory, that has been unlinked from the trie.
+ * In concurrent mode it's retired until readers are done with it,
+ * in persistent mode until no snapshot can reach it.
+ */
+static void
+pn_dispose(ptrie_t *pt, pnpool_t *pp, pidx_t x)
+{
+    if (pt->pt_rcu)
+        prcu_retire(pt, x, NULL);
+    else if (pt->pt_vers)
+        pvers_retire(pt, x, NULL);
+    else if (pp == &pt->pt_leaves)
+        pleaf_release(pt, x);
+    else
+        pnpool_free(pt, pp, x);
 }
 
-static void 
-pnode_free(ptrie_t *pt, pnode_t *pn)
+/*
+ * Give leaf x back to the pool, along with the copy of its key
+ * if it's in the key arena
+ */
+void
+pleaf_release(ptrie_t *pt, pidx_t x)
+{
+    pleaf_t *pl = pn_leaf(pt, x);
+
+    if (pt->pt_cache)
+        pcache_del(pt, x);
+
+    if ((pt->pt_flags & PTRIE_F_OWNKEYS) && pl->pl_key != PL_INLINE(pl))
+        pkey_free(pt, pl->pl_key);
+
+    pnpool_free(pt, &pt->pt_leaves, x);
+}
+
+static void
+pt_dispose(ptrie_t *pt, void *ptr)
+{
+    if (pt->pt_rcu)
+        prcu_retire(pt, PN_NIL, ptr);
+    else
+        pt->pt_free_func(ptr);
+}
+
+/*
+ * Leaf with the smallest key larger than (if upper is set) or 
+ * not less than key in the subtree rooted at x, or PN_NIL. Key 
+ * needn't be in the trie.
+ *
+ * Search for key and let d be the first bit at which it differs
+ * from the key of the leaf we reach. Going down the same path, 
+ * the subtree below the first node past bit d holds the keys 
+ * that agree with key up to bit d. They're all larger than key 
+ * if key has a 0 at bit d and all smaller if it has a 1. In that
+ * case, or if key is in the trie, the next key is the left-most
+ * leaf of the right subtree of the last node where we went left.
+ */
+pidx_t
+pn_bound(ptrie_t *pt, pidx_t x, void *key, size_t keysz, int upper)
+{
+    pnode_t *pn;
+    pleaf_t *pl;
+    pidx_t   right = PN_NIL; /* right subtree at the last left turn */
+    uint32_t bit;
+    int      diffbit;
+    int      i;
+
+    right = pn_search(pt, x, key, keysz);
+    pl = pn_leaf(pt, right);
+    diffbit = keycmp(key, keysz, pl->pl_key, pl->pl_keysz);
+    if (diffbit == 0 && NOT upper)
+        return right;
+
+    right = PN_NIL;
+    bit = diffbit ? ABSVAL(diffbit) : UINT32_MAX;
+
+    while (NOT PN_ISLEAF(x)) {
+        pn = pn_node(pt, x);
+        if (pn->pn_bit > bit)
+            break;
+
+        i = getbit(key, keysz, pn->pn_bit);
+        if (i == 0)
+            right = PN_LOAD(&pn->pn_cld[1]);
+        x = PN_LOAD(&pn->pn_cld[i]);
+    }
+
+    if (diffbit < 0)
+        return pn_leftmost(pt, x);
+
+    return right ? pn_leftmost(pt, right) : PN_NIL;
+}
+
+/*
+ * Leaf with the largest key smaller than key in the subtree 
+ * rooted at x, or PN_NIL. As pn_bound() with left and right 
+ * swapped: if key has a 1 at bit d, every key below the node 
+ * we stop at is smaller, else the previous key is the right-most
+ * leaf of the left subtree of the last node where we went right.
+ */
+static pidx_t
+pn_prev(ptrie_t *pt, pidx_t x, void *key, size_t keysz)
 {
-    pn->pn_cld[0] = pt->pt_list;
-    pt->pt_list = pn;
+    pnode_t *pn;
+    pleaf_t *pl;
+    pidx_t   left = PN_NIL; /* left subtree at the last right turn */
+    uint32_t bit;
+    int      diffbit;
+    int      i;
+
+    pl = pn_leaf(pt, pn_search(pt, x, key, keysz));
+    diffbit = keycmp(key, keysz, pl->pl_key, pl->pl_keysz);
+    bit = diffbit ? ABSVAL(diffbit) : UINT32_MAX;
+
+    while (NOT PN_ISLEAF(x)) {
+        pn = pn_node(pt, x);
+        if (pn->pn_bit > bit)
+            break;
+
+        i = getbit(key, keysz, pn->pn_bit);
+        if (i == 1)
+            left = PN_LOAD(&pn->pn_cld[0]);
+        x = PN_LOAD(&pn->pn_cld[i]);
+    }
+
+    if (diffbit > 0)
+        return pn_rightmost(pt, x);
+
+    return left ? pn_rightmost(pt, left) : PN_NIL;
 }
 
 static void *
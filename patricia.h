@@ -35,37 +35,271 @@
 #define PTRIEPARM_KEYSZ_FUNC  1
 #define PTRIEPARM_MALLOC_FUNC 2
 #define PTRIEPARM_FREE_FUNC   3
+#define PTRIEPARM_VALSZ_FUNC  4 /* size of value, for ptrie_freeze()/ptrie_save() */
+#define PTRIEPARM_CACHESZ     5 /* entries in the ptrie_get() front cache, 0 for none */
+
+/* ptrie_new2() flags */
+#define PTRIE_F_SEDGEWICK     0x0001 /* one node type, n nodes for n keys */
+#define PTRIE_F_CONCURRENT    0x0002 /* lock-free readers, single writer */
+#define PTRIE_F_OWNKEYS       0x0004 /* trie keeps its own copy of each key */
+#define PTRIE_F_PERSISTENT    0x0008 /* O(1) snapshots by path copying */
+#define PTRIE_F_COUNTS        0x0010 /* key counts per subtree for rank and select */
 
 typedef struct ptrie ptrie_t;
 typedef struct ptrie_iter ptrie_iter_t;
+typedef struct ptrie_frozen ptrie_frozen_t;
+typedef struct ptrie_reader ptrie_reader_t;
+typedef struct ptrie_sharded ptrie_sharded_t;
+typedef struct ptrie_sharded_iter ptrie_sharded_iter_t;
+typedef struct ptrie_lc ptrie_lc_t;
+typedef struct ptrie_poptrie ptrie_poptrie_t;
+typedef struct ptrie_snapshot ptrie_snapshot_t;
+typedef struct ptrie_stats ptrie_stats_t;
 
 struct ptrie_iter {
-    void *pn; /* current node */
-    void *root; /* root of subtree we're iterating over */
+    void  *pn; /* current node */
+    void  *root; /* root of subtree we're iterating over */
+    void  *hi; /* end of range (not included), or NULL */
+    size_t hisz;
+};
+
+/* at most 2^PTRIE_SHARDS_MAXBITS shards in a ptrie_sharded_t */
+#define PTRIE_SHARDS_MAXBITS 6
+#define PTRIE_SHARDS_MAX     (1 << PTRIE_SHARDS_MAXBITS)
+
+struct ptrie_sharded_iter {
+    ptrie_iter_t iter[PTRIE_SHARDS_MAX];  /* iterator for each shard */
+    void        *key[PTRIE_SHARDS_MAX];   /* next key of each shard */
+    void        *val[PTRIE_SHARDS_MAX];
+    size_t       keysz[PTRIE_SHARDS_MAX];
+    uint8_t      heap[PTRIE_SHARDS_MAX];  /* shards ordered by next key */
+    int          nheap;
+};
+
+/* 
+ * operation counters, only kept when the library is built with
+ * -DPTRIE_STATS
+ */
+typedef struct ptrie_counts {
+    uint64_t hits;   /* lookups that found their key */
+    uint64_t misses;
+    uint64_t adds;
+    uint64_t dups;   /* adds rejected because the key was there */
+    uint64_t dels;
+} ptrie_counts_t;
+
+#define PTRIE_STATS_DEPTHS 64 /* deeper leaves are counted in the last bucket */
+#define PTRIE_STATS_KEYSZS 16 /* keysz[i] counts keys of 2^i to 2^(i+1)-1 bytes */
+
+struct ptrie_stats {
+    size_t   nodes;     /* internal nodes */
+    size_t   leaves;
+    size_t   freelist;  /* nodes and leaves waiting to be reused */
+    size_t   bytes;     /* held by the node pools and key arena */
+    size_t   depth[PTRIE_STATS_DEPTHS]; /* keys found after testing i bits */
+    double   avgdepth;
+    int      maxdepth;
+    size_t   keysz[PTRIE_STATS_KEYSZS];
+    double   avgkeysz;
+    size_t   maxkeysz;
+    size_t   cachesz;   /* PTRIEPARM_CACHESZ entries */
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    ptrie_counts_t counts;
 };
 
 /* public api */
 extern ptrie_t *ptrie_new(void);
+extern ptrie_t *ptrie_new2(uint32_t flags);
 extern void     ptrie_free(ptrie_t *ptrie);
+extern void     ptrie_reset(ptrie_t *ptrie);
+extern size_t   ptrie_shrink(ptrie_t *ptrie);
 
 extern void     ptrie_set_parm(ptrie_t *ptrie, uint32_t parm, void *value);
 extern void    *ptrie_get_parm(ptrie_t *ptrie, uint32_t parm);
 
 extern void     ptrie_add(ptrie_t *ptrie, void *key, void *val);
 extern void     ptrie_add2(ptrie_t *ptrie, void *key, void *val, void **pnode);
+extern void     ptrie_build_sorted(ptrie_t *ptrie, void **keys, void **vals, int n);
+extern void     ptrie_build_parallel(ptrie_t *ptrie, void **keys, void **vals, int n, int nthreads);
 
 extern void    *ptrie_get(ptrie_t *ptrie, void *key);
+extern int      ptrie_get_batch(ptrie_t *ptrie, void **keys, int n, void **vals);
 extern void    *ptrie_get_prefix(ptrie_t *ptrie, void *prefix, size_t nbits);
 
 extern void     ptrie_del(ptrie_t *ptrie, void *key);
 extern void     ptrie_del_pnode(ptrie_t *ptrie, void *pnode);
 
+/* 
+ * route prefixes and longest-prefix match 
+ * (not supported with PTRIE_F_SEDGEWICK or PTRIE_F_PERSISTENT)
+ */
+extern int      ptrie_add_prefix(ptrie_t *ptrie, void *key, size_t nbits, void *val);
+extern void     ptrie_del_prefix(ptrie_t *ptrie, void *key, size_t nbits);
+extern void    *ptrie_lpm(ptrie_t *ptrie, void *addr);
+extern int      ptrie_lpm_batch(ptrie_t *ptrie, void **addrs, int n, void **vals);
+
 extern int      ptrie_size(ptrie_t *ptrie);
 extern int      ptrie_haskey(ptrie_t *ptrie, void *key);
 
 extern void     ptrie_iter_init(ptrie_t *ptrie, void *root, ptrie_iter_t *iter);
 extern int      ptrie_iter_next(ptrie_t *ptrie, ptrie_iter_t *iter, void **key, void **val);
 
+/* ordered lookups and range scans */
+extern int      ptrie_lower_bound(ptrie_t *ptrie, void *key, void **rkey, void **rval);
+extern int      ptrie_upper_bound(ptrie_t *ptrie, void *key, void **rkey, void **rval);
+extern void     ptrie_iter_seek(ptrie_t *ptrie, ptrie_iter_t *iter, void *key);
+extern void     ptrie_iter_range(ptrie_t *ptrie, ptrie_iter_t *iter, void *lo, void *hi);
+
+extern int      ptrie_min(ptrie_t *ptrie, void **rkey, void **rval);
+extern int      ptrie_max(ptrie_t *ptrie, void **rkey, void **rval);
+extern int      ptrie_next(ptrie_t *ptrie, void *key, void **rkey, void **rval);
+extern int      ptrie_prev(ptrie_t *ptrie, void *key, void **rkey, void **rval);
+
+/* iterate from the largest key to the smallest */
+extern void     ptrie_iter_init_reverse(ptrie_t *ptrie, void *root, ptrie_iter_t *iter);
+extern int      ptrie_iter_prev(ptrie_t *ptrie, ptrie_iter_t *iter, void **key, void **val);
+
+/* 
+ * keys given as (key, keysz) rather than sized by PTRIEPARM_KEYSZ 
+ * or PTRIEPARM_KEYSZ_FUNC, for binary keys and keys whose size 
+ * the caller already knows
+ */
+extern void     ptrie_add_len(ptrie_t *ptrie, void *key, size_t keysz, void *val);
+extern void     ptrie_add2_len(ptrie_t *ptrie, void *key, size_t keysz, void *val, void **pnode);
+extern void    *ptrie_get_len(ptrie_t *ptrie, void *key, size_t keysz);
+extern void    *ptrie_get_prefix_len(ptrie_t *ptrie, void *prefix, size_t pfxsz, size_t nbits);
+extern void     ptrie_del_len(ptrie_t *ptrie, void *key, size_t keysz);
+extern int      ptrie_haskey_len(ptrie_t *ptrie, void *key, size_t keysz);
+extern int      ptrie_lower_bound_len(ptrie_t *ptrie, void *key, size_t keysz, 
+                                      void **rkey, size_t *rkeysz, void **rval);
+extern int      ptrie_upper_bound_len(ptrie_t *ptrie, void *key, size_t keysz, 
+                                      void **rkey, size_t *rkeysz, void **rval);
+extern void     ptrie_iter_seek_len(ptrie_t *ptrie, ptrie_iter_t *iter, void *key, size_t keysz);
+extern void     ptrie_iter_range_len(ptrie_t *ptrie, ptrie_iter_t *iter, void *lo, size_t losz,
+                                     void *hi, size_t hisz);
+extern int      ptrie_iter_next_len(ptrie_t *ptrie, ptrie_iter_t *iter, void **key, size_t *keysz, 
+                                    void **val);
+extern int      ptrie_iter_prev_len(ptrie_t *ptrie, ptrie_iter_t *iter, void **key, size_t *keysz, 
+                                    void **val);
+extern int      ptrie_next_len(ptrie_t *ptrie, void *key, size_t keysz, 
+                               void **rkey, size_t *rkeysz, void **rval);
+extern int      ptrie_prev_len(ptrie_t *ptrie, void *key, size_t keysz, 
+                               void **rkey, size_t *rkeysz, void **rval);
+
+/* 
+ * split the keys under root into at most nparts subtrees that can
+ * be iterated over in parallel, or run func over them from 
+ * nthreads threads
+ */
+extern int      ptrie_iter_split(ptrie_t *ptrie, void *root, int nparts, ptrie_iter_t *iters);
+extern void     ptrie_parallel_foreach(ptrie_t *ptrie, void *root, int nthreads,
+                                       void (*func)(void *key, void *val, void *arg), void *arg);
+
+/* 
+ * change the first trie to the union, intersection or difference 
+ * of the keys of both
+ */
+extern int      ptrie_union(ptrie_t *ptrie, ptrie_t *other);
+extern int      ptrie_intersect(ptrie_t *ptrie, ptrie_t *other);
+extern int      ptrie_diff(ptrie_t *ptrie, ptrie_t *other);
+
+/* 
+ * PTRIE_F_COUNTS: number of keys with a prefix, position of a key
+ * in key order, and the key at a position, in O(key bits) time
+ */
+extern int      ptrie_count_prefix(ptrie_t *ptrie, void *prefix, size_t nbits);
+extern int      ptrie_count_prefix_len(ptrie_t *ptrie, void *prefix, size_t pfxsz, size_t nbits);
+extern int      ptrie_rank(ptrie_t *ptrie, void *key);
+extern int      ptrie_rank_len(ptrie_t *ptrie, void *key, size_t keysz);
+extern int      ptrie_select(ptrie_t *ptrie, int i, void **rkey, void **rval);
+
+/* shape and memory use of a trie, see stats.c */
+extern void     ptrie_stats(ptrie_t *ptrie, ptrie_stats_t *st);
+
+/* 
+ * PTRIE_F_CONCURRENT: each reader thread registers a reader and
+ * brackets its lookups with ptrie_read_lock()/ptrie_read_unlock().
+ * Writers must be serialized by the caller. Keys and values that
+ * were removed may be freed once ptrie_synchronize() returns.
+ */
+extern ptrie_reader_t *ptrie_reader_new(ptrie_t *ptrie);
+extern void            ptrie_reader_free(ptrie_t *ptrie, ptrie_reader_t *rd);
+extern void            ptrie_read_lock(ptrie_reader_t *rd);
+extern void            ptrie_read_unlock(ptrie_reader_t *rd);
+extern void            ptrie_synchronize(ptrie_t *ptrie);
+
+/* 
+ * PTRIE_F_PERSISTENT: read-only views of the trie at a point in
+ * time. Snapshots can be read from any thread, and are freed 
+ * (and restored) by the thread that changes the trie.
+ */
+extern ptrie_snapshot_t *ptrie_snapshot(ptrie_t *ptrie);
+extern void              ptrie_snapshot_free(ptrie_snapshot_t *ss);
+extern void              ptrie_snapshot_restore(ptrie_t *ptrie, ptrie_snapshot_t *ss);
+extern void             *ptrie_snapshot_get(ptrie_snapshot_t *ss, void *key);
+extern void             *ptrie_snapshot_get_len(ptrie_snapshot_t *ss, void *key, size_t keysz);
+extern int               ptrie_snapshot_size(ptrie_snapshot_t *ss);
+extern void              ptrie_snapshot_iter_init(ptrie_snapshot_t *ss, ptrie_iter_t *iter);
+extern int               ptrie_snapshot_iter_next(ptrie_snapshot_t *ss, ptrie_iter_t *iter, 
+                                                  void **key, void **val);
+
+/* 
+ * trie split into 2^nbits shards on bits offset+1 to offset+nbits
+ * of the key, each with its own lock, for several writer threads.
+ * Iteration merges the shards in key order, and mustn't run while
+ * there are writers.
+ */
+extern ptrie_sharded_t *ptrie_sharded_new(uint32_t flags, int offset, int nbits);
+extern void             ptrie_sharded_free(ptrie_sharded_t *ps);
+extern void             ptrie_sharded_set_parm(ptrie_sharded_t *ps, uint32_t parm, void *value);
+extern void             ptrie_sharded_add(ptrie_sharded_t *ps, void *key, void *val);
+extern void            *ptrie_sharded_get(ptrie_sharded_t *ps, void *key);
+extern void             ptrie_sharded_del(ptrie_sharded_t *ps, void *key);
+extern int              ptrie_sharded_size(ptrie_sharded_t *ps);
+extern void             ptrie_sharded_iter_init(ptrie_sharded_t *ps, void *prefix, size_t nbits, 
+                                                ptrie_sharded_iter_t *iter);
+extern int              ptrie_sharded_iter_next(ptrie_sharded_t *ps, ptrie_sharded_iter_t *iter, 
+                                                void **key, void **val);
+
+/* 
+ * read-only copy of a trie in a single flat image, with 
+ * keys copied into the image
+ */
+extern ptrie_frozen_t *ptrie_freeze(ptrie_t *ptrie);
+extern void            ptrie_frozen_free(ptrie_frozen_t *pf);
+extern void           *ptrie_frozen_get(ptrie_frozen_t *pf, void *key);
+extern void           *ptrie_frozen_get_len(ptrie_frozen_t *pf, void *key, size_t keysz);
+extern void           *ptrie_frozen_get_prefix(ptrie_frozen_t *pf, void *prefix, size_t nbits);
+extern int             ptrie_frozen_size(ptrie_frozen_t *pf);
+extern void            ptrie_frozen_iter_init(ptrie_frozen_t *pf, void *root, ptrie_iter_t *iter);
+extern int             ptrie_frozen_iter_next(ptrie_frozen_t *pf, ptrie_iter_t *iter, void **key, void **val);
+
+/* 
+ * read-only level-compressed copy of a trie, for route lookups 
+ * that visit fewer nodes
+ */
+extern ptrie_lc_t *ptrie_lc_build(ptrie_t *ptrie, double fill);
+extern void        ptrie_lc_free(ptrie_lc_t *lc);
+extern void       *ptrie_lc_get(ptrie_lc_t *lc, void *key);
+extern void       *ptrie_lc_get_len(ptrie_lc_t *lc, void *key, size_t keysz);
+extern void       *ptrie_lc_lpm(ptrie_lc_t *lc, void *addr);
+extern int         ptrie_lc_size(ptrie_lc_t *lc);
+extern void        ptrie_lc_depth(ptrie_lc_t *lc, int *maxdepth, double *avgdepth);
+
+/* 
+ * read-only poptrie compiled from a trie of route prefixes with
+ * fixed size keys, for IPv4 and IPv6 forwarding
+ */
+extern ptrie_poptrie_t *ptrie_poptrie_build(ptrie_t *ptrie);
+extern void             ptrie_poptrie_free(ptrie_poptrie_t *pp);
+extern void            *ptrie_poptrie_lpm(ptrie_poptrie_t *pp, void *addr);
+extern size_t           ptrie_poptrie_memsize(ptrie_poptrie_t *pp);
+
+/* save a trie in frozen form and map it back in */
+extern int             ptrie_save(ptrie_t *ptrie, const char *path);
+extern ptrie_frozen_t *ptrie_map(const char *path);
+
 /* iterate over items in the trie */
 #define foreach_ptrie_keyval(ptrie, iter, key, val) \
     for (ptrie_iter_init(ptrie, 0, iter);           \
@@ -91,5 +325,68 @@ extern int      ptrie_iter_next(ptrie_t *ptrie, ptrie_iter_t *iter, void **key,
     for (ptrie_iter_init(ptrie, ptrie_get_prefix(ptrie, prefix, nbits), iter); \
          ptrie_iter_next(ptrie, iter, (void **)0, (void **)val); /**/)
 
+#define foreach_ptrie_keyval_reverse(ptrie, iter, key, val) \
+    for (ptrie_iter_init_reverse(ptrie, 0, iter);           \
+         ptrie_iter_prev(ptrie, iter, (void **)key, (void **)val); /**/)
+
+#define foreach_ptrie_key_reverse(ptrie, iter, key) \
+    for (ptrie_iter_init_reverse(ptrie, 0, iter);   \
+         ptrie_iter_prev(ptrie, iter, (void **)key, (void **)0); /**/)
+
+#define foreach_ptrie_val_reverse(ptrie, iter, val) \
+    for (ptrie_iter_init_reverse(ptrie, 0, iter);   \
+         ptrie_iter_prev(ptrie, iter, (void **)0, (void **)val); /**/)
+
+#define foreach_ptrie_keyval_with_prefix_reverse(ptrie, iter, prefix, nbits, key, val) \
+    for (ptrie_iter_init_reverse(ptrie, ptrie_get_prefix(ptrie, prefix, nbits), iter); \
+         ptrie_iter_prev(ptrie, iter, (void **)key, (void **)val); /**/)
+
+#define foreach_ptrie_keyval_range(ptrie, iter, lo, hi, key, val) \
+    for (ptrie_iter_range(ptrie, iter, lo, hi);                    \
+         ptrie_iter_next(ptrie, iter, (void **)key, (void **)val); /**/)
+
+#define foreach_ptrie_keyval_len(ptrie, iter, key, keysz, val) \
+    for (ptrie_iter_init(ptrie, 0, iter);                       \
+         ptrie_iter_next_len(ptrie, iter, (void **)key, keysz, (void **)val); /**/)
+
+#define foreach_ptrie_key_len(ptrie, iter, key, keysz) \
+    for (ptrie_iter_init(ptrie, 0, iter);               \
+         ptrie_iter_next_len(ptrie, iter, (void **)key, keysz, (void **)0); /**/)
+
+#define foreach_ptrie_keyval_with_prefix_len(ptrie, iter, prefix, pfxsz, nbits, key, keysz, val) \
+    for (ptrie_iter_init(ptrie, ptrie_get_prefix_len(ptrie, prefix, pfxsz, nbits), iter);        \
+         ptrie_iter_next_len(ptrie, iter, (void **)key, keysz, (void **)val); /**/)
+
+#define foreach_ptrie_key_with_prefix_len(ptrie, iter, prefix, pfxsz, nbits, key, keysz)    \
+    for (ptrie_iter_init(ptrie, ptrie_get_prefix_len(ptrie, prefix, pfxsz, nbits), iter); \
+         ptrie_iter_next_len(ptrie, iter, (void **)key, keysz, (void **)0); /**/)
+
+#define foreach_ptrie_val_with_prefix_len(ptrie, iter, prefix, pfxsz, nbits, val)           \
+    for (ptrie_iter_init(ptrie, ptrie_get_prefix_len(ptrie, prefix, pfxsz, nbits), iter); \
+         ptrie_iter_next_len(ptrie, iter, (void **)0, (size_t *)0, (void **)val); /**/)
+
+#define foreach_ptrie_keyval_len_reverse(ptrie, iter, key, keysz, val) \
+    for (ptrie_iter_init_reverse(ptrie, 0, iter);                       \
+         ptrie_iter_prev_len(ptrie, iter, (void **)key, keysz, (void **)val); /**/)
+
+#define foreach_ptrie_snapshot_keyval(ss, iter, key, val) \
+    for (ptrie_snapshot_iter_init(ss, iter);               \
+         ptrie_snapshot_iter_next(ss, iter, (void **)key, (void **)val); /**/)
+
+#define foreach_ptrie_frozen_keyval(pf, iter, key, val) \
+    for (ptrie_frozen_iter_init(pf, 0, iter);           \
+         ptrie_frozen_iter_next(pf, iter, (void **)key, (void **)val); /**/)
+
+#define foreach_ptrie_frozen_keyval_with_prefix(pf, iter, prefix, nbits, key, val) \
+    for (ptrie_frozen_iter_init(pf, ptrie_frozen_get_prefix(pf, prefix, nbits), iter); \
+         ptrie_frozen_iter_next(pf, iter, (void **)key, (void **)val); /**/)
+
+#define foreach_ptrie_sharded_keyval(ps, iter, key, val) \
+    for (ptrie_sharded_iter_init(ps, 0, 0, iter);         \
+         ptrie_sharded_iter_next(ps, iter, (void **)key, (void **)val); /**/)
+
+#define foreach_ptrie_sharded_keyval_with_prefix(ps, iter, prefix, nbits, key, val) \
+    for (ptrie_sharded_iter_init(ps, prefix, nbits, iter);                           \
+         ptrie_sharded_iter_next(ps, iter, (void **)key, (void **)val); /**/)
 
 #endif /* PATRICIA_H */
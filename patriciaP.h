@@ -32,41 +32,201 @@
 
 #include "patriciaP.h"
 
-typedef enum {
-    PN_LEAF,
-    PN_NODE
-} pn_type_t;
-
-typedef struct pnode {
-    pn_type_t     pn_type; /* leaf or internal node */
-    struct pnode *pn_up;   /* parent pointer */
-    union {
-        struct { /* leaf node */
-            void    *pn_Key;
-            size_t   pn_Keysz;
-            void    *pn_Val;
-            size_t   pn_Valsz;
-        } pn_leaf;
-        struct { /* internal node */
-            int            pn_Bit;
-            struct pnode * pn_Cld[2]; /* children */
-        } pn_node;
-    } pn_u;
+/*
+ * Nodes are referred to by 32-bit index rather than by pointer.
+ * Internal nodes and leaves live in separate pools, and the top
+ * bit of an index tells us which pool it refers to:
+ *
+ *    0xxx...x  internal node x   (index 0 is the nil index)
+ *    1xxx...x  leaf x
+ *
+ * The public api hands out indices cast to (void *) wherever it
+ * used to hand out node pointers (ptrie_add2(), ptrie_get_prefix(),
+ * iterators), so a nil index is still a NULL node.
+ */
+typedef uint32_t pidx_t;
+
+#define PN_NIL       ((pidx_t)0)
+#define PN_LEAFBIT   ((pidx_t)0x80000000)
+#define PN_ISLEAF(x) ((x) & PN_LEAFBIT)
+#define PN_NUM(x)    ((x) & ~PN_LEAFBIT)
+
+#define PIDX2PTR(x)  ((void *)(uintptr_t)(x))
+#define PTR2PIDX(p)  ((pidx_t)(uintptr_t)(p))
+
+typedef struct pnode { /* internal node */
+    uint32_t pn_bit;    /* difference bit */
+    pidx_t   pn_up;     /* parent */
+    pidx_t   pn_cld[2]; /* children */
 } pnode_t;
 
-#define pn_key    pn_u.pn_leaf.pn_Key
-#define pn_keysz  pn_u.pn_leaf.pn_Keysz
-#define pn_val    pn_u.pn_leaf.pn_Val
-#define pn_valsz  pn_u.pn_leaf.pn_Valsz
-#define pn_bit    pn_u.pn_node.pn_Bit
-#define pn_cld    pn_u.pn_node.pn_Cld
+typedef struct pleaf { /* leaf node */
+    void    *pl_key;
+    void    *pl_val;
+    uint32_t pl_keysz;
+    pidx_t   pl_up;     /* parent */
+} pleaf_t;
+
+/* 
+ * Patricia nodes are allocated from slabs (chunks) of PN_CHUNKSZ
+ * nodes. A pool keeps a directory of its chunks; chunks never 
+ * move once allocated, so node pointers stay valid as the pool 
+ * grows. See pnpool.c.
+ */
+#define PN_CHUNKSHIFT 10
+#define PN_CHUNKSZ    (1 << PN_CHUNKSHIFT)
+#define PN_CHUNKMASK  (PN_CHUNKSZ - 1)
+
+typedef struct pnpool {
+    void   **pp_chunk;   /* chunk directory, NULL for released chunks */
+    uint32_t *pp_live;   /* nodes in use per chunk */
+    uint32_t pp_nchunks; /* directory entries in use */
+    uint32_t pp_maxchunks; /* directory size */
+    uint32_t pp_cur;     /* chunk we're carving nodes from */
+    uint32_t pp_next;    /* next unused node in pp_cur */
+    uint32_t pp_end;     /* end of pp_cur */
+    uint32_t pp_scan;    /* where to start looking for a free chunk */
+    pidx_t   pp_list;    /* freelist */
+    pidx_t   pp_tag;     /* PN_LEAFBIT for leaf pools, else 0 */
+    uint32_t pp_gens;    /* chunks end with a generation per node */
+    uint32_t pp_counts;  /* and then a key count per node */
+    size_t   pp_objsz;   /* size of a node */
+} pnpool_t;
+
+/*
+ * Free nodes are linked through their first four bytes
+ */
+#define PNPOOL_NEXT(obj) (*(pidx_t *)(obj))
+
+static inline void *pnpool_obj(pnpool_t *pp, pidx_t x)
+{
+    x = PN_NUM(x);
+    return (uint8_t *)pp->pp_chunk[x >> PN_CHUNKSHIFT] + (x & PN_CHUNKMASK) * pp->pp_objsz;
+}
+
+/*
+ * With PTRIE_F_PERSISTENT each chunk is followed by the 
+ * generation in which each of its nodes was allocated (see 
+ * persist.c)
+ */
+static inline uint32_t *pnpool_gen(pnpool_t *pp, pidx_t x)
+{
+    x = PN_NUM(x);
+    return (uint32_t *)((uint8_t *)pp->pp_chunk[x >> PN_CHUNKSHIFT] + 
+                        PN_CHUNKSZ * pp->pp_objsz) + (x & PN_CHUNKMASK);
+}
+
+/*
+ * Number of keys below internal node x, with PTRIE_F_COUNTS. The
+ * directory is loaded as in pn_node() for concurrent readers.
+ */
+static inline uint32_t *pnpool_count(pnpool_t *pp, pidx_t x)
+{
+    void **dir = __atomic_load_n(&pp->pp_chunk, __ATOMIC_ACQUIRE);
+
+    x = PN_NUM(x);
+    return (uint32_t *)((uint8_t *)dir[x >> PN_CHUNKSHIFT] + PN_CHUNKSZ * 
+                        (pp->pp_objsz + (pp->pp_gens ? sizeof(uint32_t) : 0))) + (x & PN_CHUNKMASK);
+}
+
+/*
+ * With PTRIE_F_SEDGEWICK there is a single node type, as in 
+ * Sedgewick's Algorithms in C. Every node holds a key as well 
+ * as a difference bit, and a link is external (points back up 
+ * to the node holding the key we were looking for) when the 
+ * bit of the node it points to is not larger than the bit of 
+ * the node it leaves. The root is a head node with bit 0 whose 
+ * only child is pn_cld[0].
+ *
+ * Nodes come from the pt_nodes pool.
+ */
+typedef struct snode {
+    void    *sn_key;
+    void    *sn_val;
+    uint32_t sn_keysz;
+    uint32_t sn_bit;    /* difference bit */
+    pidx_t   sn_cld[2]; /* children */
+} snode_t;
+
+/*
+ * Prefixes added with ptrie_add_prefix() are stored under their
+ * masked key. Prefixes whose masked keys are equal (eg, 10/8 and
+ * 10.0/16) share a leaf, whose value is then a chain of pfx_t
+ * entries ordered from longest to shortest prefix.
+ */
+typedef struct pfx {
+    struct pfx *px_next;
+    size_t      px_nbits; /* prefix length in bits */
+    void       *px_val;
+} pfx_t;
+
+/*
+ * A frozen trie (see frozen.c) is a single image that holds no
+ * pointers:
+ *
+ *    pfhdr_t | leaves, in key order | internal nodes, breadth 
+ *    first from the root | key bytes | value bytes
+ *
+ * Children are indices, with PN_LEAFBIT set for leaves. Leaf i
+ * is the i-th smallest key, so a subtree covers a run of leaves.
+ *
+ * The same image is what ptrie_save() writes to disk and what
+ * ptrie_map() maps back in, so every field has a fixed size.
+ * Files are in host byte order; a file from a host of the other
+ * byte order fails the magic number check.
+ */
+#define PF_MAGIC   0x50545246 /* "PTRF" */
+#define PF_VERSION 1
+
+#define PF_F_VALCOPY 0x0001 /* fl_val is an offset into the value area */
+
+typedef struct pfhdr {
+    uint32_t ph_magic;
+    uint32_t ph_version;
+    uint32_t ph_nleaves;
+    uint32_t ph_nnodes;
+    pidx_t   ph_root;
+    uint32_t ph_flags;    /* PF_F_* */
+    uint64_t ph_keysz;    /* fixed key size, or 0 */
+    uint64_t ph_keybytes; /* size of key area */
+    uint64_t ph_valbytes; /* size of value area */
+} pfhdr_t;
+
+typedef struct pfleaf {
+    uint64_t fl_keyoff;   /* offset of key in key area */
+    uint64_t fl_val;      /* value, or its offset in the value area */
+    uint32_t fl_keysz;
+    uint32_t fl_valsz;
+} pfleaf_t;
+
+typedef struct pfnode {
+    uint32_t fn_bit;
+    pidx_t   fn_cld[2];
+} pfnode_t;
+
+struct ptrie_frozen {
+    pfhdr_t  *pf_hdr;     /* start of image */
+    size_t    pf_imgsz;
+    pfleaf_t *pf_leaves;
+    pfnode_t *pf_nodes;
+    uint8_t  *pf_keys;
+    uint8_t  *pf_vals;
+    int       pf_mapped;  /* image is mmap()ed from a file */
+    ptrie_iter_t pf_iter; /* default iterator */
+
+    void     (*pf_free_func)(void *);
+    size_t     pf_keysz;
+    size_t   (*pf_keysz_func)(void *key);
+};
 
 struct ptrie {
-    pnode_t     *pt_root; /* top of trie */
-    pnode_t     *pt_list; /* freelist of patricia nodes */
-    size_t       pt_size; /* num nodes in trie */
+    pidx_t       pt_root;  /* top of trie */
+    pnpool_t     pt_nodes; /* internal node pool */
+    pnpool_t     pt_leaves; /* leaf pool */
+    size_t       pt_size;  /* num keys in trie */
 
     uint32_t     pt_parms; /* configurable settings */
+    uint32_t     pt_flags; /* PTF_* flags */
     ptrie_iter_t pt_iter;  /* default iterator */
 
     void       *(*pt_malloc_func)(size_t); /* malloc function */
@@ -74,8 +234,120 @@ struct ptrie {
 
     size_t       pt_keysz;                  /* fixed size keys */
     size_t     (*pt_keysz_func)(void *key); /* variable length string keys */
+    size_t     (*pt_valsz_func)(void *val); /* copy values into frozen tries */
+
+    struct prcu *pt_rcu;   /* PTRIE_F_CONCURRENT state, see rcu.c */
+    struct pkblock *pt_kblocks; /* PTRIE_F_OWNKEYS key arena, see pnpool.c */
+    struct pvers *pt_vers; /* PTRIE_F_PERSISTENT snapshots, see persist.c */
+    uint32_t     pt_gen;   /* generation new nodes are stamped with */
+    struct pcache *pt_cache; /* PTRIEPARM_CACHESZ front cache, see cache.c */
+#ifdef PTRIE_STATS
+    ptrie_counts_t pt_counts; /* see ptrie_stats() */
+#endif
 };
 
+/*
+ * Bump one of the operation counters. Lookups may run in several
+ * threads at once on a concurrent trie, hence the atomic add.
+ */
+#ifdef PTRIE_STATS
+#define PT_COUNT(pt, ctr) __atomic_add_fetch(&(pt)->pt_counts.ctr, 1, __ATOMIC_RELAXED)
+#else
+#define PT_COUNT(pt, ctr) ((void)0)
+#endif
+
+/*
+ * In PTRIE_F_CONCURRENT mode readers follow links while the 
+ * writer changes them, so links that readers follow (child and
+ * parent links, the root, prefix chains and the chunk directory)
+ * are published with release stores and read with acquire loads.
+ * On x86 both are plain moves.
+ */
+#define PN_LOAD(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define PN_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+/* pt_flags, in addition to the public PTRIE_F_* flags */
+#define PTF_PREFIX 0x80000000 /* leaves hold pfx_t chains */
+
+#define PTRIE_F_ALL (PTRIE_F_SEDGEWICK | PTRIE_F_CONCURRENT | PTRIE_F_OWNKEYS | \
+                     PTRIE_F_PERSISTENT | PTRIE_F_COUNTS)
+
+/*
+ * With PTRIE_F_OWNKEYS leaves are followed by PL_INLINESZ bytes
+ * in which keys that fit are kept, so that comparing against the
+ * key of a leaf doesn't take another cache miss. Longer keys go 
+ * in the key arena.
+ */
+#define PL_INLINESZ   16
+#define PL_INLINE(pl) ((uint8_t *)((pl) + 1))
+
+/* pnpool.c */
+extern void   pnpool_init(pnpool_t *pp, size_t objsz, pidx_t tag);
+extern pidx_t pnpool_alloc(ptrie_t *pt, pnpool_t *pp);
+extern void   pnpool_free(ptrie_t *pt, pnpool_t *pp, pidx_t x);
+extern void   pnpool_reset(pnpool_t *pp);
+extern size_t pnpool_shrink(ptrie_t *pt, pnpool_t *pp);
+extern void   pnpool_destroy(ptrie_t *pt, pnpool_t *pp);
+extern void   pnpool_stats(pnpool_t *pp, size_t *nfree, size_t *nbytes);
+extern uint32_t pnpool_take(ptrie_t *pt, pnpool_t *pp, ptrie_t *ft, pnpool_t *from);
+
+extern void  *pkey_alloc(ptrie_t *pt, size_t size);
+extern void   pkey_free(ptrie_t *pt, void *key);
+extern size_t pkey_shrink(ptrie_t *pt);
+extern void   pkey_destroy(ptrie_t *pt);
+extern size_t pkey_bytes(ptrie_t *pt);
+extern void   pkey_take(ptrie_t *pt, ptrie_t *from);
+
+/* cache.c */
+typedef struct pcache pcache_t;
+
+extern int    pcache_init(ptrie_t *pt, size_t n);
+extern void   pcache_destroy(ptrie_t *pt);
+extern void   pcache_reset(ptrie_t *pt);
+extern pidx_t pcache_get(ptrie_t *pt, void *key, size_t keysz, uint32_t *hash);
+extern void   pcache_put(ptrie_t *pt, uint32_t hash, pidx_t x);
+extern void   pcache_del(ptrie_t *pt, pidx_t x);
+extern size_t pcache_size(ptrie_t *pt);
+extern void   pcache_stats(ptrie_t *pt, ptrie_stats_t *st);
+
+/* counts.c */
+extern uint32_t pn_count(ptrie_t *pt, pidx_t x);
+extern void     pn_count_add(ptrie_t *pt, pidx_t x, int delta);
+extern void     pn_count_set(ptrie_t *pt, pidx_t x);
+extern uint32_t pn_recount(ptrie_t *pt, pidx_t x);
+
+/* patricia.c */
+extern pidx_t newcld(ptrie_t *pt, void *key, size_t keysz, void *val);
+extern void   pleaf_release(ptrie_t *pt, pidx_t x);
+extern size_t keysize(ptrie_t *pt, void *key);
+extern pidx_t pn_bound(ptrie_t *pt, pidx_t x, void *key, size_t keysz, int upper);
+
+/* persist.c */
+extern void   pvers_init(ptrie_t *pt);
+extern void   pvers_destroy(ptrie_t *pt);
+extern int    pvers_shared(ptrie_t *pt, pnpool_t *pp, pidx_t x);
+extern void   pvers_retire(ptrie_t *pt, pidx_t x, void *ptr);
+extern void   pvers_link(ptrie_t *pt, pidx_t up, void *key, size_t keysz, pidx_t x);
+extern int    pvers_reset(ptrie_t *pt);
+
+/* rcu.c */
+extern void   prcu_init(ptrie_t *pt);
+extern void   prcu_destroy(ptrie_t *pt);
+extern void   prcu_retire(ptrie_t *pt, pidx_t x, void *ptr);
+
+/* sedgewick.c */
+extern void   sg_add(ptrie_t *pt, void *key, size_t keysz, void *val, void **pnode);
+extern void  *sg_get(ptrie_t *pt, void *key, size_t keysz);
+extern void  *sg_get_prefix(ptrie_t *pt, void *prefix, size_t pfxsz, size_t nbits);
+extern void   sg_del(ptrie_t *pt, void *key, size_t keysz);
+extern void   sg_del_pnode(ptrie_t *pt, void *pnode);
+extern pidx_t sg_bound(ptrie_t *pt, void *root, void *key, size_t keysz, int upper);
+extern pidx_t sg_prev(ptrie_t *pt, void *root, void *key, size_t keysz);
+extern void   sg_iter_init(ptrie_t *pt, void *root, ptrie_iter_t *ptit);
+extern void   sg_iter_init_reverse(ptrie_t *pt, void *root, ptrie_iter_t *ptit);
+extern int    sg_iter_prev(ptrie_t *pt, ptrie_iter_t *ptit, void **key, size_t *keysz, void **val);
+extern int    sg_iter_next(ptrie_t *pt, ptrie_iter_t *ptit, void **key, size_t *keysz, void **val);
+
 #ifndef ABSVAL
 #define ABSVAL(x) ((x) < 0 ? -(x) : (x))
 #endif
@@ -92,12 +364,50 @@ struct ptrie {
  */
 #define OTHER_CLDIDX(c) ((c) ^ 1)
 
+/*
+ * Map an index to its node
+ */
+static inline pnode_t *pn_node(ptrie_t *pt, pidx_t x)
+{
+    void **dir = __atomic_load_n(&pt->pt_nodes.pp_chunk, __ATOMIC_ACQUIRE);
+    return &((pnode_t *)dir[x >> PN_CHUNKSHIFT])[x & PN_CHUNKMASK];
+}
+
+/* leaves have room for an inline key with PTRIE_F_OWNKEYS */
+static inline pleaf_t *pn_leaf(ptrie_t *pt, pidx_t x)
+{
+    void **dir = __atomic_load_n(&pt->pt_leaves.pp_chunk, __ATOMIC_ACQUIRE);
+    x = PN_NUM(x);
+    return (pleaf_t *)((uint8_t *)dir[x >> PN_CHUNKSHIFT] + (x & PN_CHUNKMASK) * pt->pt_leaves.pp_objsz);
+}
+
+static inline snode_t *sn_node(ptrie_t *pt, pidx_t x)
+{
+    return &((snode_t *)pt->pt_nodes.pp_chunk[x >> PN_CHUNKSHIFT])[x & PN_CHUNKMASK];
+}
+
+/*
+ * Parent of leaf or internal node x
+ */
+static inline pidx_t pn_parent(ptrie_t *pt, pidx_t x)
+{
+    return PN_ISLEAF(x) ? PN_LOAD(&pn_leaf(pt, x)->pl_up) : PN_LOAD(&pn_node(pt, x)->pn_up);
+}
+
+static inline void pn_setparent(ptrie_t *pt, pidx_t x, pidx_t up)
+{
+    if (PN_ISLEAF(x))
+        PN_STORE(&pn_leaf(pt, x)->pl_up, up);
+    else
+        PN_STORE(&pn_node(pt, x)->pn_up, up);
+}
+
 /*
  * Tests to determine if a given node is 
  * the left or right child of its parent.
  */
-#define NODE_IS_LCLD(n) ((n) == (n)->pn_up->pn_cld[0])
-#define NODE_IS_RCLD(n) ((n) == (n)->pn_up->pn_cld[1])
+#define NODE_IS_LCLD(pt, x) ((x) == pn_node(pt, pn_parent(pt, x))->pn_cld[0])
+#define NODE_IS_RCLD(pt, x) ((x) == pn_node(pt, pn_parent(pt, x))->pn_cld[1])
 
 /*
  * Determine if bit at index 'bit' is set in 
@@ -113,20 +423,81 @@ struct ptrie {
  *    12345678
  *    --------
  *    00100000
+ *
+ * Bits past the end of the key are 0, except for the length 
+ * bits: bit LENBIT(n) is 1 if the key is longer than n bytes. 
+ * They tell apart keys that only differ by trailing nul bytes,
+ * such as "a" and "a\0", and sort after every bit of a key up 
+ * to PN_LENBIT / 8 bytes long.
  */
+#define PN_LENBIT     (1 << 30)
+#define LENBIT(keysz) ((int)(PN_LENBIT + (keysz) + 1))
+
 static inline int getbit(void *key, size_t keysz, int bit)
 {
     uint8_t *ptr = (uint8_t *)key;
     if (bit) {
         bit--;
-        /* return 0 if bit out of range */
-        if ((bit >> 3) > keysz)
-            return 0;
+        /* past the end, only the length bits are set */
+        if ((bit >> 3) >= keysz)
+            return bit >= PN_LENBIT && keysz > (size_t)(bit - PN_LENBIT);
         return ptr[bit >> 3] & 1<<(7 - (bit & 7)) ? 1 : 0;
     }
     return 0;
 }
 
+/*
+ * The k bits of key starting at index bit, indexed as for getbit(),
+ * as an integer. Bits past the end of the key are 0. k is at most 
+ * 16, so the bits are within 3 bytes.
+ */
+static inline uint32_t keybits(const void *key, size_t keysz, size_t bit, uint32_t k)
+{
+    const uint8_t *ptr = (const uint8_t *)key;
+    uint32_t w = 0;
+    size_t   i;
+    size_t   j;
+
+    bit--;
+    i = bit >> 3;
+    for (j = i; j < i + 3; j++)
+        w = (w << 8) | (j < keysz ? ptr[j] : 0);
+
+    return (w >> (24 - (bit & 7) - k)) & ((1 << k) - 1);
+}
+
+/*
+ * Load 8 bytes as a big-endian word so that the first bit 
+ * of the key is the most significant bit of the word.
+ */
+static inline uint64_t load64be(const uint8_t *ptr)
+{
+    uint64_t w;
+    memcpy(&w, ptr, sizeof(w));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+
+/*
+ * Return the bit index (counted from 1) of the most significant 
+ * set bit of non-zero x, where x is the XOR of the bytes of two
+ * keys starting at byte offset 'off' and 'nbits' bits wide.
+ */
+#define DIFFBIT(off, x, nbits) \
+    ((int)((off) * BITS_PER_BYTE + __builtin_clzll(x) - (64 - (nbits)) + 1))
+
+/*
+ * Keys at least KEYCMP_LONGSZ bytes long are compared with a 
+ * SIMD kernel selected at run-time (see keydiff_init()). The
+ * kernel returns the offset of the first byte at which the keys
+ * differ, or n if the first n bytes are equal.
+ */
+#define KEYCMP_LONGSZ 32
+
+extern size_t (*ptrie_keydiff)(const uint8_t *ptr1, const uint8_t *ptr2, size_t n);
+
 /***********************************************************###**
  * Return 0 if keys are equal
  *
@@ -145,38 +516,148 @@ static inline int getbit(void *key, size_t keysz, int bit)
  *
  *     bit(key1, diffbit) = 0
  *     bit(key2, diffbit) = 1
+ *
+ * As with getbit(), the shorter of two keys is treated as if
+ * it were padded out with 0 bits. Keys that only differ by 
+ * trailing 0 bytes first differ at the length bit of the shorter
+ * one, LENBIT(shorter keysz), so the shorter key sorts first.
+ *
+ * Keys are compared a 64-bit word at a time; the first differing
+ * bit is found by counting the leading zeros of the XOR of the 
+ * first pair of words that differ.
  ***********************************************************###*/
 static inline int keycmp(void *key1, size_t key1sz, void *key2, size_t key2sz)
 {
-    int      i;
-    int      j;
-    uint8_t *ptr1 = (uint8_t *)key1;
-    uint8_t *ptr2 = (uint8_t *)key2;
+    const uint8_t *ptr1 = (const uint8_t *)key1;
+    const uint8_t *ptr2 = (const uint8_t *)key2;
+    const uint8_t *lptr;
+    uint64_t       x;
+    size_t         n;
+    size_t         i;
+
+    n = key1sz < key2sz ? key1sz : key2sz;
+    i = 0;
 
-    for (i = 0; *ptr1 == *ptr2; ptr1++, ptr2++, i++) {
-        if (key1sz == key2sz) {
-            if (i+1 == key1sz)
-                return 0;
-        } 
+    if (n >= KEYCMP_LONGSZ) {
+        i = (*ptrie_keydiff)(ptr1, ptr2, n);
+        if (i < n) {
+            x = ptr1[i] ^ ptr2[i];
+            return ptr1[i] & (0x80 >> (__builtin_clzll(x) - 56)) ? 
+                DIFFBIT(i, x, 8) : -DIFFBIT(i, x, 8);
+        }
+    } else {
+        for (; i + 8 <= n; i += 8) {
+            x = load64be(ptr1 + i) ^ load64be(ptr2 + i);
+            if (x) {
+                return load64be(ptr1 + i) & (1ULL << (63 - __builtin_clzll(x))) ?
+                    DIFFBIT(i, x, 64) : -DIFFBIT(i, x, 64);
+            }
+        }
+        for (; i < n; i++) {
+            x = ptr1[i] ^ ptr2[i];
+            if (x) {
+                return ptr1[i] & (0x80 >> (__builtin_clzll(x) - 56)) ?
+                    DIFFBIT(i, x, 8) : -DIFFBIT(i, x, 8);
+            }
+        }
     }
 
-    i = i*8 + 1;
+    if (key1sz == key2sz)
+        return 0;
 
-    for (j = 1<<7; (*ptr1 & j) == (*ptr2 & j); i++, j >>= 1)
-        /**/;
-    
-    return (*ptr1 & j) ? i : -i;
+    /* first set bit in the rest of the longer key */
+    lptr = key1sz > key2sz ? ptr1 : ptr2;
+    n = key1sz > key2sz ? key1sz : key2sz;
+
+    for (; i < n; i++) {
+        if ((x = lptr[i])) {
+            return lptr == ptr1 ? DIFFBIT(i, x, 8) : -DIFFBIT(i, x, 8);
+        }
+    }
+
+    return lptr == ptr1 ? LENBIT(key2sz) : -LENBIT(key1sz);
 }
 
+/*
+ * Test two keys for equality. Common fixed key sizes (IPv4 and 
+ * IPv6 addresses, 64-bit integers) are compared inline rather 
+ * than through memcmp().
+ */
 static inline int keyseq(void *key1, size_t key1sz, void *key2, size_t key2sz)
 {
-    return key1sz == key2sz && memcmp(key1, key2, key1sz) == 0;
+    uint64_t w1[2];
+    uint64_t w2[2];
+    uint32_t u1;
+    uint32_t u2;
+
+    if (key1sz != key2sz)
+        return 0;
+
+    switch (key1sz) {
+    case 4:
+        memcpy(&u1, key1, 4);
+        memcpy(&u2, key2, 4);
+        return u1 == u2;
+
+    case 8:
+        memcpy(w1, key1, 8);
+        memcpy(w2, key2, 8);
+        return w1[0] == w2[0];
+
+    case 16:
+        memcpy(w1, key1, 16);
+        memcpy(w2, key2, 16);
+        return ((w1[0] ^ w2[0]) | (w1[1] ^ w2[1])) == 0;
+
+    default:
+        return memcmp(key1, key2, key1sz) == 0;
+    }
 }
 
-/* 
- * New patricia nodes are put onto a freelist PN_FREELIST_BLKSZ 
- * nodes at a time 
+/*
+ * Search down the trie from internal node or leaf x using key, 
+ * returning the leaf we arrive at.
  */
-#define PN_FREELIST_BLKSZ 1024
+static inline pidx_t pn_search(ptrie_t *pt, pidx_t x, void *key, size_t keysz)
+{
+    pnode_t *pn;
+
+    while (NOT PN_ISLEAF(x)) {
+        pn = pn_node(pt, x);
+        x = PN_LOAD(&pn->pn_cld[getbit(key, keysz, pn->pn_bit)]);
+    }
+
+    return x;
+}
+
+/*
+ * Left-most and right-most leaves of the subtree rooted at x
+ */
+static inline pidx_t pn_leftmost(ptrie_t *pt, pidx_t x)
+{
+    while (NOT PN_ISLEAF(x))
+        x = PN_LOAD(&pn_node(pt, x)->pn_cld[0]);
+    return x;
+}
+
+static inline pidx_t pn_rightmost(ptrie_t *pt, pidx_t x)
+{
+    while (NOT PN_ISLEAF(x))
+        x = PN_LOAD(&pn_node(pt, x)->pn_cld[1]);
+    return x;
+}
+
+/*
+ * Batched lookups advance up to PTRIE_BATCHSZ searches in 
+ * lock-step, prefetching the next node of each search so that 
+ * their cache misses overlap.
+ */
+#define PTRIE_BATCHSZ 16
+
+#ifdef __GNUC__
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) ((void)(p))
+#endif
 
 #endif /* PATRICIAP_H */
@@ -0,0 +1,525 @@
+/*
+ * Copyright (c) 2012, Todd Hayton <thayton@neekanee.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * PTRIE_F_PERSISTENT mode: ptrie_snapshot() returns a read-only
+ * view of the trie as it is now, in O(1) time, and the trie can 
+ * go on changing without the view changing with it.
+ *
+ * The trie counts generations. A snapshot ends the current 
+ * generation, and each node is stamped with the generation it
+ * was allocated in (see pnpool_gen()), so a node is shared with 
+ * a snapshot if it's no newer than the newest snapshot. Shared
+ * nodes aren't changed: an add or delete that has to relink one
+ * copies it instead, and the nodes above it up to the root, and
+ * the new path is linked in (path copying). Everything else is 
+ * shared between the trie and its snapshots. Nodes allocated 
+ * since the newest snapshot are changed in place as usual, so 
+ * a path is only copied once per snapshot.
+ *
+ * Parent links are kept for the trie only. A shared node's 
+ * parent is moved to the copy of its parent, which snapshots 
+ * can't tell since they only ever search from their root.
+ *
+ * A shared node that is unlinked is retired along with the 
+ * generations in which it was alive. It goes back to its pool 
+ * once none of the snapshots taken in those generations is left.
+ *
+ * Snapshots may be read from other threads while one thread 
+ * changes the trie; nothing a snapshot can reach is changed or
+ * freed before the snapshot is.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "patricia.h"
+#include "patriciaP.h"
+
+/* initial size of the list of retired nodes */
+#define PVERS_RETIRESZ 64
+
+/* parent link of nodes that ptrie_snapshot_restore() is sorting out */
+#define PVERS_MARK PN_LEAFBIT
+
+typedef struct pvretire {
+    uint32_t vr_birth;  /* generation it was allocated in */
+    uint32_t vr_death;  /* generation in which it was unlinked */
+    pidx_t   vr_idx;    /* node, or */
+    void    *vr_ptr;    /* memory for pt_free_func */
+} pvretire_t;
+
+struct ptrie_snapshot {
+    ptrie_t          *ss_ptrie;
+    pidx_t            ss_root;
+    size_t            ss_size;
+    uint32_t          ss_gen;   /* generation the snapshot ended */
+    ptrie_snapshot_t *ss_older;
+    ptrie_snapshot_t *ss_newer;
+};
+
+typedef struct pvers {
+    ptrie_snapshot_t *pv_oldest;
+    ptrie_snapshot_t *pv_newest;
+    pvretire_t       *pv_retired;
+    size_t            pv_nretired;
+    size_t            pv_maxretired;
+} pvers_t;
+
+static void     pvers_release(ptrie_t *pt, pvretire_t *vr);
+static int      pvers_visible(pvers_t *pv, uint32_t birth, uint32_t death);
+static uint32_t pvers_birth(ptrie_t *pt, pidx_t x);
+static void     pvers_mark(ptrie_t *pt, pidx_t x);
+static void     pvers_drop(ptrie_t *pt, pidx_t x);
+static void     pvers_parents(ptrie_t *pt, pidx_t x, pidx_t up);
+
+void
+pvers_init(ptrie_t *pt)
+{
+    pvers_t *pv;
+
+    if ((pv = malloc(sizeof(*pv))) == NULL) {
+        fprintf(stderr, "pvers_init - out of memory\n");
+        exit(1);
+    }
+    memset(pv, 0, sizeof(*pv));
+
+    pt->pt_nodes.pp_gens = 1;
+    pt->pt_leaves.pp_gens = 1;
+    pt->pt_gen = 1;
+    pt->pt_vers = pv;
+}
+
+/***********************************************************###**
+ * Free the snapshots that are left, and memory that was retired.
+ * Retired nodes go with their pools.
+ ***********************************************************###*/
+void
+pvers_destroy(ptrie_t *pt)
+{
+    pvers_t          *pv = pt->pt_vers;
+    ptrie_snapshot_t *ss;
+    size_t            i;
+
+    if (NOT pv)
+        return;
+
+    while ((ss = pv->pv_oldest) != NULL) {
+        pv->pv_oldest = ss->ss_newer;
+        pt->pt_free_func(ss);
+    }
+
+    for (i = 0; i < pv->pv_nretired; i++) {
+        if (pv->pv_retired[i].vr_ptr)
+            pt->pt_free_func(pv->pv_retired[i].vr_ptr);
+    }
+
+    if (pv->pv_retired)
+        pt->pt_free_func(pv->pv_retired);
+    free(pv);
+    pt->pt_vers = NULL;
+}
+
+/***********************************************************###**
+ * Is node x (from pool pp) shared with a snapshot?
+ ***********************************************************###*/
+int
+pvers_shared(ptrie_t *pt, pnpool_t *pp, pidx_t x)
+{
+    pvers_t *pv = pt->pt_vers;
+
+    return pv->pv_newest && *pnpool_gen(pp, x) <= pv->pv_newest->ss_gen;
+}
+
+/***********************************************************###**
+ * Hand back node x (or, if x is PN_NIL, memory ptr), which has 
+ * just been unlinked from the trie, once no snapshot can reach
+ * it. Nodes that no snapshot shares are freed right away.
+ ***********************************************************###*/
+void
+pvers_retire(ptrie_t *pt, pidx_t x, void *ptr)
+{
+    pvers_t    *pv = pt->pt_vers;
+    pvretire_t *vr;
+    pvretire_t  tmp;
+
+    tmp.vr_birth = x ? pvers_birth(pt, x) : 0;
+    tmp.vr_death = pt->pt_gen;
+    tmp.vr_idx = x;
+    tmp.vr_ptr = ptr;
+
+    if (NOT pv->pv_newest || tmp.vr_birth > pv->pv_newest->ss_gen) {
+        pvers_release(pt, &tmp);
+        return;
+    }
+
+    if (pv->pv_nretired == pv->pv_maxretired) {
+        pv->pv_maxretired = 2 * pv->pv_maxretired + PVERS_RETIRESZ;
+        vr = pt->pt_malloc_func(pv->pv_maxretired * sizeof(*vr));
+        if (pv->pv_retired) {
+            memcpy(vr, pv->pv_retired, pv->pv_nretired * sizeof(*vr));
+            pt->pt_free_func(pv->pv_retired);
+        }
+        pv->pv_retired = vr;
+    }
+
+    pv->pv_retired[pv->pv_nretired++] = tmp;
+}
+
+/***********************************************************###**
+ * Point the link of internal node up that key goes through (or
+ * the root, if up is PN_NIL) at x. If up is shared, it's copied
+ * and the copy is linked into its parent the same way, and so on
+ * up to the first node that isn't shared.
+ ***********************************************************###*/
+void
+pvers_link(ptrie_t *pt, pidx_t up, void *key, size_t keysz, pidx_t x)
+{
+    pnode_t *pn;
+    pnode_t *cp;
+    pidx_t   copy;
+    int      i;
+
+    while (up != PN_NIL) {
+        pn = pn_node(pt, up);
+        i = getbit(key, keysz, pn->pn_bit);
+
+        if (NOT pvers_shared(pt, &pt->pt_nodes, up)) {
+            pn->pn_cld[i] = x;
+            pn_setparent(pt, x, up);
+            return;
+        }
+
+        /* chunks don't move, so pn stays valid */
+        copy = pnpool_alloc(pt, &pt->pt_nodes);
+        cp = pn_node(pt, copy);
+        cp->pn_bit = pn->pn_bit;
+        cp->pn_up = pn->pn_up;
+        cp->pn_cld[i] = x;
+        cp->pn_cld[OTHER_CLDIDX(i)] = pn->pn_cld[OTHER_CLDIDX(i)];
+        pn_setparent(pt, cp->pn_cld[0], copy);
+        pn_setparent(pt, cp->pn_cld[1], copy);
+
+        pvers_retire(pt, up, NULL);
+
+        x = copy;
+        up = cp->pn_up;
+    }
+
+    pn_setparent(pt, x, PN_NIL);
+    pt->pt_root = x;
+}
+
+/***********************************************************###**
+ * For ptrie_reset(): if there are snapshots, unlink the whole 
+ * trie node by node and return 1. Otherwise the pools can just 
+ * be reset.
+ ***********************************************************###*/
+int
+pvers_reset(ptrie_t *pt)
+{
+    if (NOT pt->pt_vers->pv_newest)
+        return 0;
+
+    pvers_mark(pt, pt->pt_root);
+    pvers_drop(pt, pt->pt_root);
+    pt->pt_root = PN_NIL;
+    pt->pt_size = 0;
+
+    return 1;
+}
+
+/***********************************************************###**
+ * Take a snapshot of the trie, which must have been created with
+ * PTRIE_F_PERSISTENT. Returns NULL with errno set to EINVAL 
+ * otherwise.
+ ***********************************************************###*/
+ptrie_snapshot_t *
+ptrie_snapshot(ptrie_t *pt)
+{
+    pvers_t          *pv = pt->pt_vers;
+    ptrie_snapshot_t *ss;
+
+    if (NOT pv) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ss = pt->pt_malloc_func(sizeof(*ss));
+    ss->ss_ptrie = pt;
+    ss->ss_root = pt->pt_root;
+    ss->ss_size = pt->pt_size;
+    ss->ss_gen = pt->pt_gen++;
+
+    ss->ss_newer = NULL;
+    ss->ss_older = pv->pv_newest;
+    if (pv->pv_newest)
+        pv->pv_newest->ss_newer = ss;
+    else
+        pv->pv_oldest = ss;
+    pv->pv_newest = ss;
+
+    return ss;
+}
+
+/***********************************************************###**
+ * Free a snapshot, along with the nodes that only it could still
+ * reach. Must be called from the thread that changes the trie,
+ * and before the trie is freed.
+ ***********************************************************###*/
+void
+ptrie_snapshot_free(ptrie_snapshot_t *ss)
+{
+    ptrie_t    *pt;
+    pvers_t    *pv;
+    pvretire_t *vr;
+    size_t      i;
+    size_t      j;
+
+    if (NOT ss)
+        return;
+
+    pt = ss->ss_ptrie;
+    pv = pt->pt_vers;
+
+    if (ss->ss_older)
+        ss->ss_older->ss_newer = ss->ss_newer;
+    else
+        pv->pv_oldest = ss->ss_newer;
+    if (ss->ss_newer)
+        ss->ss_newer->ss_older = ss->ss_older;
+    else
+        pv->pv_newest = ss->ss_older;
+
+    pt->pt_free_func(ss);
+
+    for (i = j = 0; i < pv->pv_nretired; i++) {
+        vr = &pv->pv_retired[i];
+        if (pvers_visible(pv, vr->vr_birth, vr->vr_death))
+            pv->pv_retired[j++] = *vr;
+        else
+            pvers_release(pt, vr);
+    }
+
+    pv->pv_nretired = j;
+}
+
+/***********************************************************###**
+ * Put the trie back the way it was when snapshot ss was taken.
+ * The snapshot stays valid. Takes time proportional to the size
+ * of the trie, since parent links have to be set again.
+ ***********************************************************###*/
+void
+ptrie_snapshot_restore(ptrie_t *pt, ptrie_snapshot_t *ss)
+{
+    pvers_t    *pv = pt->pt_vers;
+    pvretire_t *vr;
+    size_t      i;
+    size_t      j;
+
+    if (ss->ss_ptrie != pt)
+        return;
+
+    /* 
+     * Mark the nodes of the trie and the retired nodes, then set
+     * the parent links of the nodes of the snapshot. Nodes that
+     * are still marked aren't in the snapshot.
+     */
+    pvers_mark(pt, pt->pt_root);
+    for (i = 0; i < pv->pv_nretired; i++) {
+        if (pv->pv_retired[i].vr_idx)
+            pn_setparent(pt, pv->pv_retired[i].vr_idx, PVERS_MARK);
+    }
+
+    if (ss->ss_root != PN_NIL)
+        pvers_parents(pt, ss->ss_root, PN_NIL);
+
+    /* retired nodes that are back in the trie */
+    for (i = j = 0; i < pv->pv_nretired; i++) {
+        vr = &pv->pv_retired[i];
+        if (vr->vr_ptr || pn_parent(pt, vr->vr_idx) == PVERS_MARK)
+            pv->pv_retired[j++] = *vr;
+    }
+    pv->pv_nretired = j;
+
+    pvers_drop(pt, pt->pt_root);
+
+    pt->pt_root = ss->ss_root;
+    pt->pt_size = ss->ss_size;
+}
+
+void *
+ptrie_snapshot_get(ptrie_snapshot_t *ss, void *key)
+{
+    ptrie_t *pt = ss->ss_ptrie;
+
+    return ptrie_snapshot_get_len(ss, key, keysize(pt, key));
+}
+
+void *
+ptrie_snapshot_get_len(ptrie_snapshot_t *ss, void *key, size_t keysz)
+{
+    ptrie_t *pt = ss->ss_ptrie;
+    pleaf_t *pl;
+
+    if (ss->ss_root == PN_NIL)
+        return NULL;
+
+    pl = pn_leaf(pt, pn_search(pt, ss->ss_root, key, keysz));
+
+    return keyseq(key, keysz, pl->pl_key, pl->pl_keysz) ? pl->pl_val : NULL;
+}
+
+int
+ptrie_snapshot_size(ptrie_snapshot_t *ss)
+{
+    return ss ? ss->ss_size : 0;
+}
+
+/***********************************************************###**
+ * Iterate over the keys of a snapshot in order. Each step looks
+ * for the next key from the root, as parent links may lead out
+ * of the snapshot.
+ ***********************************************************###*/
+void
+ptrie_snapshot_iter_init(ptrie_snapshot_t *ss, ptrie_iter_t *ptit)
+{
+    ptit->root = PIDX2PTR(ss->ss_root);
+    ptit->hi = NULL;
+    ptit->pn = ss->ss_root ? PIDX2PTR(pn_leftmost(ss->ss_ptrie, ss->ss_root)) : NULL;
+}
+
+int
+ptrie_snapshot_iter_next(ptrie_snapshot_t *ss, ptrie_iter_t *ptit, void **key, void **val)
+{
+    ptrie_t *pt = ss->ss_ptrie;
+    pleaf_t *pl;
+
+    if (NOT ptit->pn)
+        return 0;
+
+    pl = pn_leaf(pt, PTR2PIDX(ptit->pn));
+
+    if (key) *key = pl->pl_key;
+    if (val) *val = pl->pl_val;
+
+    ptit->pn = PIDX2PTR(pn_bound(pt, PTR2PIDX(ptit->root), pl->pl_key, pl->pl_keysz, 1));
+    return 1;
+}
+
+/*
+ * Is a node that was alive from generation birth up to death 
+ * reachable from a snapshot? Snapshots are listed oldest first.
+ */
+static int
+pvers_visible(pvers_t *pv, uint32_t birth, uint32_t death)
+{
+    ptrie_snapshot_t *ss;
+
+    for (ss = pv->pv_oldest; ss && ss->ss_gen < death; ss = ss->ss_newer) {
+        if (ss->ss_gen >= birth)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void
+pvers_release(ptrie_t *pt, pvretire_t *vr)
+{
+    if (vr->vr_ptr)
+        pt->pt_free_func(vr->vr_ptr);
+    else if (PN_ISLEAF(vr->vr_idx))
+        pleaf_release(pt, vr->vr_idx);
+    else
+        pnpool_free(pt, &pt->pt_nodes, vr->vr_idx);
+}
+
+static uint32_t
+pvers_birth(ptrie_t *pt, pidx_t x)
+{
+    return *pnpool_gen(PN_ISLEAF(x) ? &pt->pt_leaves : &pt->pt_nodes, x);
+}
+
+/*
+ * Mark the nodes below x
+ */
+static void
+pvers_mark(ptrie_t *pt, pidx_t x)
+{
+    pnode_t *pn;
+
+    if (x == PN_NIL)
+        return;
+
+    pn_setparent(pt, x, PVERS_MARK);
+
+    if (NOT PN_ISLEAF(x)) {
+        pn = pn_node(pt, x);
+        pvers_mark(pt, pn->pn_cld[0]);
+        pvers_mark(pt, pn->pn_cld[1]);
+    }
+}
+
+/*
+ * Unlink the marked nodes below x. A node that isn't marked is
+ * in a snapshot, as is everything below it.
+ */
+static void
+pvers_drop(ptrie_t *pt, pidx_t x)
+{
+    pnode_t *pn;
+
+    if (x == PN_NIL || pn_parent(pt, x) != PVERS_MARK)
+        return;
+
+    if (NOT PN_ISLEAF(x)) {
+        pn = pn_node(pt, x);
+        pvers_drop(pt, pn->pn_cld[0]);
+        pvers_drop(pt, pn->pn_cld[1]);
+    }
+
+    pvers_retire(pt, x, NULL);
+}
+
+static void
+pvers_parents(ptrie_t *pt, pidx_t x, pidx_t up)
+{
+    pnode_t *pn;
+
+    pn_setparent(pt, x, up);
+
+    if (NOT PN_ISLEAF(x)) {
+        pn = pn_node(pt, x);
+        pvers_parents(pt, pn->pn_cld[0], x);
+        pvers_parents(pt, pn->pn_cld[1], x);
+    }
+}
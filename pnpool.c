@@ -0,0 +1,488 @@
+/*
+ * Copyright (c) 2012, Todd Hayton <thayton@neekanee.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Slab allocator for patricia nodes.
+ *
+ * A pool hands out nodes from chunks (slabs) of PN_CHUNKSZ nodes
+ * that are allocated in one piece. Nodes are carved off the 
+ * current chunk in order, so growing the pool doesn't touch the
+ * nodes of the new chunk. Freed nodes go onto the pool's freelist
+ * and are reused first.
+ *
+ * Each chunk keeps a count of the nodes in use. A chunk whose
+ * count drops to zero can be given back to the system by 
+ * pnpool_shrink(). Its directory slot is left empty and is 
+ * filled again the next time the pool grows, so the indices of
+ * the nodes in the other chunks don't change.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "patricia.h"
+#include "patriciaP.h"
+
+#define PN_CHUNK(x) (PN_NUM(x) >> PN_CHUNKSHIFT)
+
+/* bytes in a chunk, including the generations and counts of its nodes */
+#define PNPOOL_CHUNKSZ(pp) \
+    (PN_CHUNKSZ * ((pp)->pp_objsz + ((pp)->pp_gens ? sizeof(uint32_t) : 0) + \
+                   ((pp)->pp_counts ? sizeof(uint32_t) : 0)))
+
+static void pnpool_grow(ptrie_t *pt, pnpool_t *pp);
+static void pnpool_growdir(ptrie_t *pt, pnpool_t *pp, uint32_t max);
+
+void
+pnpool_init(pnpool_t *pp, size_t objsz, pidx_t tag)
+{
+    memset(pp, 0, sizeof(*pp));
+    pp->pp_objsz = objsz;
+    pp->pp_tag = tag;
+}
+
+pidx_t
+pnpool_alloc(ptrie_t *pt, pnpool_t *pp)
+{
+    pidx_t x;
+
+    if (pp->pp_list != PN_NIL) {
+        x = pp->pp_list;
+        pp->pp_list = PNPOOL_NEXT(pnpool_obj(pp, x));
+    } else {
+        if (pp->pp_next == pp->pp_end)
+            pnpool_grow(pt, pp);
+        x = ((pp->pp_cur << PN_CHUNKSHIFT) | pp->pp_next++) | pp->pp_tag;
+    }
+
+    pp->pp_live[PN_CHUNK(x)]++;
+    if (pp->pp_gens)
+        *pnpool_gen(pp, x) = pt->pt_gen;
+    return x;
+}
+
+void
+pnpool_free(ptrie_t *pt, pnpool_t *pp, pidx_t x)
+{
+    uint32_t c = PN_CHUNK(x);
+
+    PNPOOL_NEXT(pnpool_obj(pp, x)) = pp->pp_list;
+    pp->pp_list = x;
+
+    if (--pp->pp_live[c] == 0 && c < pp->pp_scan)
+        pp->pp_scan = c;
+}
+
+/***********************************************************###**
+ * Forget every node in the pool but keep the chunks around so 
+ * they can be reused.
+ ***********************************************************###*/
+void
+pnpool_reset(pnpool_t *pp)
+{
+    if (pp->pp_live)
+        memset(pp->pp_live, 0, pp->pp_nchunks * sizeof(*pp->pp_live));
+
+    pp->pp_list = PN_NIL;
+    pp->pp_cur = 0;
+    pp->pp_next = 0;
+    pp->pp_end = 0;
+    pp->pp_scan = 0;
+}
+
+/***********************************************************###**
+ * Give chunks that have no nodes in use back to the system.
+ * Returns the number of bytes released.
+ ***********************************************************###*/
+size_t
+pnpool_shrink(ptrie_t *pt, pnpool_t *pp)
+{
+    pidx_t  *xp;
+    uint32_t c;
+    size_t   nbytes = 0;
+
+    /* drop nodes in the chunks we're about to release */
+    for (xp = &pp->pp_list; *xp != PN_NIL; ) {
+        if (pp->pp_live[PN_CHUNK(*xp)] == 0)
+            *xp = PNPOOL_NEXT(pnpool_obj(pp, *xp));
+        else
+            xp = &PNPOOL_NEXT(pnpool_obj(pp, *xp));
+    }
+
+    for (c = 0; c < pp->pp_nchunks; c++) {
+        if (pp->pp_chunk[c] == NULL || pp->pp_live[c] != 0)
+            continue;
+
+        pt->pt_free_func(pp->pp_chunk[c]);
+        pp->pp_chunk[c] = NULL;
+        nbytes += PNPOOL_CHUNKSZ(pp);
+
+        if (c == pp->pp_cur)
+            pp->pp_next = pp->pp_end = 0;
+    }
+
+    while (pp->pp_nchunks > 0 && pp->pp_chunk[pp->pp_nchunks - 1] == NULL)
+        pp->pp_nchunks--;
+
+    if (pp->pp_nchunks == 0 && pp->pp_chunk) {
+        nbytes += pp->pp_maxchunks * (sizeof(*pp->pp_chunk) + sizeof(*pp->pp_live));
+        pt->pt_free_func(pp->pp_chunk);
+        pt->pt_free_func(pp->pp_live);
+        pp->pp_chunk = NULL;
+        pp->pp_live = NULL;
+        pp->pp_maxchunks = 0;
+    }
+
+    pp->pp_scan = 0;
+    return nbytes;
+}
+
+/***********************************************************###**
+ * Add the number of nodes on the freelist and the bytes held by 
+ * the pool's chunks and directory to *nfree and *nbytes.
+ ***********************************************************###*/
+void
+pnpool_stats(pnpool_t *pp, size_t *nfree, size_t *nbytes)
+{
+    pidx_t   x;
+    uint32_t c;
+
+    for (x = pp->pp_list; x != PN_NIL; x = PNPOOL_NEXT(pnpool_obj(pp, x)))
+        (*nfree)++;
+
+    for (c = 0; c < pp->pp_nchunks; c++) {
+        if (pp->pp_chunk[c])
+            *nbytes += PNPOOL_CHUNKSZ(pp);
+    }
+
+    *nbytes += pp->pp_maxchunks * (sizeof(*pp->pp_chunk) + sizeof(*pp->pp_live));
+}
+
+/***********************************************************###**
+ * Release all of the pool's memory. Takes time proportional to 
+ * the number of chunks, not the number of nodes.
+ ***********************************************************###*/
+void
+pnpool_destroy(ptrie_t *pt, pnpool_t *pp)
+{
+    uint32_t c;
+
+    for (c = 0; c < pp->pp_nchunks; c++) {
+        if (pp->pp_chunk[c])
+            pt->pt_free_func(pp->pp_chunk[c]);
+    }
+
+    if (pp->pp_chunk) {
+        pt->pt_free_func(pp->pp_chunk);
+        pt->pt_free_func(pp->pp_live);
+    }
+
+    pnpool_init(pp, pp->pp_objsz, pp->pp_tag);
+}
+
+/***********************************************************###**
+ * Find a chunk to carve nodes from: an empty directory slot or
+ * a chunk with no nodes in use (after a reset), else a new chunk
+ * at the end of the directory, growing the directory if it's 
+ * full. Only called when the freelist is empty, so none of the
+ * nodes of an unused chunk can be on the freelist.
+ *
+ * Index 0 of a pool whose indices aren't tagged is never handed
+ * out since it is the nil index.
+ ***********************************************************###*/
+static void
+pnpool_grow(ptrie_t *pt, pnpool_t *pp)
+{
+    uint32_t c;
+
+    for (c = pp->pp_scan; c < pp->pp_nchunks; c++) {
+        if (pp->pp_chunk[c] == NULL || pp->pp_live[c] == 0)
+            break;
+    }
+
+    if (c == pp->pp_maxchunks) {
+        if (pp->pp_maxchunks >= (PN_LEAFBIT >> PN_CHUNKSHIFT)) {
+            fprintf(stderr, "pnpool_grow - too many nodes\n");
+            exit(1);
+        }
+        pnpool_growdir(pt, pp, 2 * (pp->pp_maxchunks + 1));
+    }
+
+    if (c == pp->pp_nchunks) {
+        pp->pp_chunk[c] = NULL;
+        pp->pp_live[c] = 0;
+        pp->pp_nchunks++;
+    }
+
+    if (pp->pp_chunk[c] == NULL)
+        pp->pp_chunk[c] = pt->pt_malloc_func(PNPOOL_CHUNKSZ(pp));
+
+    pp->pp_cur = c;
+    pp->pp_next = (c == 0 && pp->pp_tag == 0) ? 1 : 0;
+    pp->pp_end = PN_CHUNKSZ;
+    pp->pp_scan = c + 1;
+}
+
+/***********************************************************###**
+ * Make room for max chunks in the directory
+ ***********************************************************###*/
+static void
+pnpool_growdir(ptrie_t *pt, pnpool_t *pp, uint32_t max)
+{
+    void    **dir;
+    void    **old;
+    uint32_t *live;
+
+    dir = pt->pt_malloc_func(max * sizeof(*dir));
+    live = pt->pt_malloc_func(max * sizeof(*live));
+    memset(dir, 0, max * sizeof(*dir));
+    memset(live, 0, max * sizeof(*live));
+
+    if (pp->pp_chunk) {
+        memcpy(dir, pp->pp_chunk, pp->pp_nchunks * sizeof(*dir));
+        memcpy(live, pp->pp_live, pp->pp_nchunks * sizeof(*live));
+        pt->pt_free_func(pp->pp_live);
+    }
+
+    /* 
+     * concurrent readers, or readers of snapshots, may still be
+     * looking at the old directory 
+     */
+    old = pp->pp_chunk;
+    PN_STORE(&pp->pp_chunk, dir);
+    if (old && pt->pt_rcu)
+        prcu_retire(pt, PN_NIL, old);
+    else if (old && pt->pt_vers)
+        pvers_retire(pt, PN_NIL, old);
+    else if (old)
+        pt->pt_free_func(old);
+
+    pp->pp_live = live;
+    pp->pp_maxchunks = max;
+}
+
+/***********************************************************###**
+ * Move every chunk of pool 'from', which belongs to trie 'ft', to
+ * the end of pp's directory, leaving 'from' empty. Returns the 
+ * directory slot the first chunk went to. The indices of nodes in
+ * the chunks go up by that many chunks and it's up to the caller
+ * to fix up the links to them.
+ ***********************************************************###*/
+uint32_t
+pnpool_take(ptrie_t *pt, pnpool_t *pp, ptrie_t *ft, pnpool_t *from)
+{
+    uint32_t base = pp->pp_nchunks;
+
+    if (base + from->pp_nchunks > pp->pp_maxchunks) {
+        if (base + from->pp_nchunks > (PN_LEAFBIT >> PN_CHUNKSHIFT)) {
+            fprintf(stderr, "pnpool_take - too many nodes\n");
+            exit(1);
+        }
+        pnpool_growdir(pt, pp, base + from->pp_nchunks);
+    }
+
+    if (from->pp_nchunks) {
+        memcpy(&pp->pp_chunk[base], from->pp_chunk, from->pp_nchunks * sizeof(*pp->pp_chunk));
+        memcpy(&pp->pp_live[base], from->pp_live, from->pp_nchunks * sizeof(*pp->pp_live));
+        pp->pp_nchunks += from->pp_nchunks;
+    }
+
+    if (from->pp_chunk) {
+        ft->pt_free_func(from->pp_chunk);
+        ft->pt_free_func(from->pp_live);
+    }
+    pnpool_init(from, from->pp_objsz, from->pp_tag);
+
+    return base;
+}
+
+/*
+ * Key arena for PTRIE_F_OWNKEYS. Keys too long to sit in their
+ * leaf are packed back to back into blocks of PK_BLOCKSZ bytes. 
+ * Blocks are aligned on their size, so the block a key is in is
+ * found by masking its address, and each block counts the keys 
+ * in it that are in use so that it can be freed when the last 
+ * one goes. A key too long for a block gets a block of its own.
+ *
+ * New keys are carved from the block at the head of the list.
+ */
+#define PK_BLOCKSZ (64 * 1024)
+#define PK_BLOCK(key) ((pkblock_t *)((uintptr_t)(key) & ~(uintptr_t)(PK_BLOCKSZ - 1)))
+
+typedef struct pkblock {
+    struct pkblock *kb_next;
+    struct pkblock *kb_prev;
+    size_t          kb_live;  /* keys in use */
+    size_t          kb_used;  /* bytes handed out, including this header */
+    size_t          kb_size;
+} pkblock_t;
+
+static void pkblock_unlink(ptrie_t *pt, pkblock_t *kb);
+
+void *
+pkey_alloc(ptrie_t *pt, size_t size)
+{
+    pkblock_t *kb = pt->pt_kblocks;
+    size_t     bsize;
+    void      *key;
+
+    if (NOT kb || kb->kb_used + size > kb->kb_size) {
+        bsize = sizeof(*kb) + size > PK_BLOCKSZ ? sizeof(*kb) + size : PK_BLOCKSZ;
+
+        if (posix_memalign((void **)&kb, PK_BLOCKSZ, bsize) != 0) {
+            fprintf(stderr, "pkey_alloc - out of memory\n");
+            exit(1);
+        }
+
+        kb->kb_live = 0;
+        kb->kb_used = sizeof(*kb);
+        kb->kb_size = bsize;
+
+        /* a block for one long key goes behind the current block */
+        if (bsize > PK_BLOCKSZ && pt->pt_kblocks) {
+            kb->kb_prev = pt->pt_kblocks;
+            kb->kb_next = pt->pt_kblocks->kb_next;
+            pt->pt_kblocks->kb_next = kb;
+        } else {
+            kb->kb_prev = NULL;
+            kb->kb_next = pt->pt_kblocks;
+            pt->pt_kblocks = kb;
+        }
+        if (kb->kb_next)
+            kb->kb_next->kb_prev = kb;
+    }
+
+    key = (uint8_t *)kb + kb->kb_used;
+    kb->kb_used += size;
+    kb->kb_live++;
+
+    return key;
+}
+
+void
+pkey_free(ptrie_t *pt, void *key)
+{
+    pkblock_t *kb = PK_BLOCK(key);
+
+    if (--kb->kb_live != 0)
+        return;
+
+    if (kb == pt->pt_kblocks)
+        kb->kb_used = sizeof(*kb); /* start over */
+    else
+        pkblock_unlink(pt, kb);
+}
+
+/***********************************************************###**
+ * Free the current block if it holds no keys. Blocks further 
+ * down the list are freed as soon as they're empty. Returns the
+ * number of bytes released.
+ ***********************************************************###*/
+size_t
+pkey_shrink(ptrie_t *pt)
+{
+    pkblock_t *kb = pt->pt_kblocks;
+    size_t     nbytes;
+
+    if (NOT kb || kb->kb_live)
+        return 0;
+
+    nbytes = kb->kb_size;
+    pkblock_unlink(pt, kb);
+    return nbytes;
+}
+
+size_t
+pkey_bytes(ptrie_t *pt)
+{
+    pkblock_t *kb;
+    size_t     nbytes = 0;
+
+    for (kb = pt->pt_kblocks; kb; kb = kb->kb_next)
+        nbytes += kb->kb_size;
+
+    return nbytes;
+}
+
+void
+pkey_destroy(ptrie_t *pt)
+{
+    pkblock_t *kb;
+
+    while ((kb = pt->pt_kblocks) != NULL) {
+        pt->pt_kblocks = kb->kb_next;
+        free(kb);
+    }
+}
+
+/***********************************************************###**
+ * Move the key blocks of trie 'from' to pt, behind pt's current 
+ * block, so that keys copied into 'from' can live on in pt.
+ ***********************************************************###*/
+void
+pkey_take(ptrie_t *pt, ptrie_t *from)
+{
+    pkblock_t *head = pt->pt_kblocks;
+    pkblock_t *first = from->pt_kblocks;
+    pkblock_t *last;
+
+    if (NOT first)
+        return;
+
+    from->pt_kblocks = NULL;
+
+    if (NOT head) {
+        pt->pt_kblocks = first;
+        return;
+    }
+
+    for (last = first; last->kb_next; last = last->kb_next)
+        ;
+
+    last->kb_next = head->kb_next;
+    if (head->kb_next)
+        head->kb_next->kb_prev = last;
+    head->kb_next = first;
+    first->kb_prev = head;
+}
+
+static void
+pkblock_unlink(ptrie_t *pt, pkblock_t *kb)
+{
+    if (kb->kb_prev)
+        kb->kb_prev->kb_next = kb->kb_next;
+    else
+        pt->pt_kblocks = kb->kb_next;
+
+    if (kb->kb_next)
+        kb->kb_next->kb_prev = kb->kb_prev;
+
+    free(kb);
+}
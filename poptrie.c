@@ -0,0 +1,461 @@
+/*
+ * Copyright (c) 2012, Todd Hayton <thayton@neekanee.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Poptrie (Asai and Ohara, "Poptrie: A Compressed Trie with
+ * Population Count for Fast and Scalable Software IP Routing
+ * Table Lookup"): a read-only route lookup engine compiled from
+ * a ptrie of route prefixes.
+ *
+ * The first POP_DIRBITS bits of an address index a flat array 
+ * (direct pointing), each entry of which is either the result 
+ * for all addresses under it or an internal node. An internal
+ * node consumes the next 6 bits of the address, picking one of 
+ * 64 slots:
+ *
+ *  - bit i of po_vector is set if slot i has a child node. The
+ *    children are stored contiguously from po_base1, so child i
+ *    is at po_base1 + popcount(po_vector up to bit i) - 1
+ *
+ *  - otherwise slot i holds a result. Runs of slots with the
+ *    same result share one entry in the leaf array: bit i of
+ *    po_leafvec is set where a new run starts, and the result
+ *    is at po_base0 + popcount(po_leafvec up to bit i) - 1
+ *
+ * A node is 24 bytes whatever its fan-out, and a lookup reads 
+ * one node per 6 bits plus the leaf. A full BGP table fits in
+ * a few MB, most of which stays in cache.
+ *
+ * The lookup is compiled twice, with and without the popcnt
+ * instruction, and the version the CPU supports is picked on 
+ * first use, as for keycmp()'s SIMD kernels.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_POPCNT 1
+#endif
+
+#include "patricia.h"
+#include "patriciaP.h"
+
+#define POP_DIRBITS 16
+#define POP_STRIDE  6
+#define POP_LEAF    0x80000000 /* direct pointing entry is a leaf */
+
+typedef struct popnode {
+    uint64_t po_vector;  /* slots with a child node */
+    uint64_t po_leafvec; /* slots that start a run of leaves */
+    uint32_t po_base0;   /* first leaf */
+    uint32_t po_base1;   /* first child */
+} popnode_t;
+
+/* route prefix, while building */
+typedef struct poproute {
+    void    *pr_key;
+    size_t   pr_nbits;
+    void    *pr_val;
+} poproute_t;
+
+struct ptrie_poptrie {
+    uint32_t  *pop_dir;
+    popnode_t *pop_nodes;
+    void     **pop_leaves;
+    uint32_t   pop_nnodes;
+    uint32_t   pop_maxnodes;
+    uint32_t   pop_nleaves;
+    uint32_t   pop_maxleaves;
+    size_t     pop_keysz;
+
+    poproute_t *pop_routes; /* only while building */
+
+    void    *(*pop_malloc_func)(size_t);
+    void     (*pop_free_func)(void *);
+};
+
+/* slots of a node, while building */
+typedef struct popslot {
+    void    *ps_val;     /* result for the slot */
+    uint32_t ps_lo;      /* routes under the slot */
+    uint32_t ps_hi;
+    int      ps_child;   /* some are longer than the slot */
+} popslot_t;
+
+static void    *pop_lookup_init(ptrie_poptrie_t *pp, const uint8_t *key);
+static void    *(*pop_lookup)(ptrie_poptrie_t *pp, const uint8_t *key) = pop_lookup_init;
+
+static void     pop_slots(ptrie_poptrie_t *pp, size_t d, uint32_t k, uint32_t lo, uint32_t hi, 
+                          void *val, popslot_t *slots);
+static void     pop_build(ptrie_poptrie_t *pp, uint32_t x, size_t d, uint32_t lo, uint32_t hi, 
+                          void *val);
+static uint32_t pop_newnodes(ptrie_poptrie_t *pp, uint32_t n);
+static uint32_t pop_newleaf(ptrie_poptrie_t *pp, void *val);
+
+/***********************************************************###**
+ * Compile a trie of route prefixes (see ptrie_add_prefix()) with
+ * a fixed key size of at least 2 bytes, eg. IPv4 or IPv6 
+ * addresses. Returns NULL with errno set to EINVAL for any other 
+ * trie. Values are the trie's values, not copies.
+ ***********************************************************###*/
+ptrie_poptrie_t *
+ptrie_poptrie_build(ptrie_t *pt)
+{
+    ptrie_poptrie_t *pp;
+    ptrie_iter_t     ptit;
+    popslot_t       *slots;
+    pfx_t           *px;
+    void            *key;
+    void            *val;
+    void            *last = NULL;
+    uint32_t         leaf = 0;
+    uint32_t         nroutes = 0;
+    uint32_t         i;
+    uint32_t         j;
+    uint32_t         s;
+    int              run = 0;
+
+    if (pt->pt_keysz < 2 || 
+        (pt->pt_size && NOT (pt->pt_flags & PTF_PREFIX)) ||
+        (pt->pt_flags & PTRIE_F_SEDGEWICK)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pp = pt->pt_malloc_func(sizeof(*pp));
+    memset(pp, 0, sizeof(*pp));
+
+    pp->pop_malloc_func = pt->pt_malloc_func;
+    pp->pop_free_func = pt->pt_free_func;
+    pp->pop_keysz = pt->pt_keysz;
+
+    /* 
+     * Routes in key order, shorter prefixes of the same key 
+     * first. The trie keeps each key's chain longest first.
+     */
+    ptrie_iter_init(pt, NULL, &ptit);
+    while (ptrie_iter_next(pt, &ptit, &key, &val)) {
+        for (px = val; px; px = px->px_next)
+            nroutes++;
+    }
+
+    pp->pop_routes = pp->pop_malloc_func((nroutes + 1) * sizeof(poproute_t));
+
+    i = 0;
+    ptrie_iter_init(pt, NULL, &ptit);
+    while (ptrie_iter_next(pt, &ptit, &key, &val)) {
+        for (px = val, j = i; px; px = px->px_next)
+            j++;
+        for (px = val; px; px = px->px_next) {
+            j--;
+            pp->pop_routes[j].pr_key = key;
+            pp->pop_routes[j].pr_nbits = px->px_nbits;
+            pp->pop_routes[j].pr_val = px->px_val;
+            i++;
+        }
+    }
+
+    pp->pop_dir = pp->pop_malloc_func((1 << POP_DIRBITS) * sizeof(*pp->pop_dir));
+    slots = pp->pop_malloc_func((1 << POP_DIRBITS) * sizeof(*slots));
+
+    /* a default route sorts first */
+    if (nroutes && pp->pop_routes[0].pr_nbits == 0)
+        last = pp->pop_routes[0].pr_val;
+
+    pop_slots(pp, 0, POP_DIRBITS, 0, nroutes, last, slots);
+
+    for (s = 0; s < (1 << POP_DIRBITS); s++) {
+        if (slots[s].ps_child) {
+            pp->pop_dir[s] = pop_newnodes(pp, 1);
+            pop_build(pp, pp->pop_dir[s], POP_DIRBITS, 
+                      slots[s].ps_lo, slots[s].ps_hi, slots[s].ps_val);
+            run = 0;
+            continue;
+        }
+
+        /* neighbouring entries with the same result share a leaf */
+        if (NOT run || slots[s].ps_val != last) {
+            leaf = POP_LEAF | pop_newleaf(pp, slots[s].ps_val);
+            last = slots[s].ps_val;
+            run = 1;
+        }
+        pp->pop_dir[s] = leaf;
+    }
+
+    pp->pop_free_func(slots);
+    pp->pop_free_func(pp->pop_routes);
+    pp->pop_routes = NULL;
+
+    return pp;
+}
+
+void
+ptrie_poptrie_free(ptrie_poptrie_t *pp)
+{
+    if (NOT pp)
+        return;
+
+    pp->pop_free_func(pp->pop_dir);
+    if (pp->pop_nodes)
+        pp->pop_free_func(pp->pop_nodes);
+    if (pp->pop_leaves)
+        pp->pop_free_func(pp->pop_leaves);
+    pp->pop_free_func(pp);
+}
+
+/***********************************************************###**
+ * Longest-prefix match, as ptrie_lpm()
+ ***********************************************************###*/
+void *
+ptrie_poptrie_lpm(ptrie_poptrie_t *pp, void *addr)
+{
+    return (*pop_lookup)(pp, addr);
+}
+
+/***********************************************************###**
+ * Bytes used by the lookup structures
+ ***********************************************************###*/
+size_t
+ptrie_poptrie_memsize(ptrie_poptrie_t *pp)
+{
+    return (1 << POP_DIRBITS) * sizeof(*pp->pop_dir) +
+           pp->pop_nnodes * sizeof(popnode_t) +
+           pp->pop_nleaves * sizeof(void *);
+}
+
+/*
+ * The lookup proper. It's inlined into a copy built for CPUs 
+ * with popcnt and a copy built without.
+ */
+static inline __attribute__((always_inline)) void *
+pop_lookup_body(ptrie_poptrie_t *pp, const uint8_t *key)
+{
+    popnode_t *pn;
+    uint64_t   bit;
+    uint32_t   x;
+    size_t     d;
+    size_t     i;
+    uint32_t   w;
+
+    x = pp->pop_dir[(key[0] << 8) | key[1]];
+    if (x & POP_LEAF)
+        return pp->pop_leaves[x & ~POP_LEAF];
+
+    pn = &pp->pop_nodes[x];
+
+    for (d = POP_DIRBITS; ; d += POP_STRIDE) {
+        /* next 6 bits, padding the key out with 0s */
+        i = d >> 3;
+        w = (i < pp->pop_keysz ? key[i] << 8 : 0) | 
+            (i + 1 < pp->pop_keysz ? key[i + 1] : 0);
+        bit = 1ULL << ((w >> (16 - POP_STRIDE - (d & 7))) & 63);
+
+        if (NOT (pn->po_vector & bit))
+            break;
+
+        pn = &pp->pop_nodes[pn->po_base1 + __builtin_popcountll(pn->po_vector & ((bit << 1) - 1)) - 1];
+    }
+
+    return pp->pop_leaves[pn->po_base0 + __builtin_popcountll(pn->po_leafvec & ((bit << 1) - 1)) - 1];
+}
+
+static void *
+pop_lookup_generic(ptrie_poptrie_t *pp, const uint8_t *key)
+{
+    return pop_lookup_body(pp, key);
+}
+
+#ifdef HAVE_X86_POPCNT
+__attribute__((target("popcnt")))
+static void *
+pop_lookup_popcnt(ptrie_poptrie_t *pp, const uint8_t *key)
+{
+    return pop_lookup_body(pp, key);
+}
+#endif
+
+/*
+ * First lookup: use the popcnt instruction if the CPU has it
+ */
+static void *
+pop_lookup_init(ptrie_poptrie_t *pp, const uint8_t *key)
+{
+#ifdef HAVE_X86_POPCNT
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("popcnt"))
+        pop_lookup = pop_lookup_popcnt;
+    else
+#endif
+        pop_lookup = pop_lookup_generic;
+
+    return (*pop_lookup)(pp, key);
+}
+
+/***********************************************************###**
+ * Work out the 2^k slots of a node d bits down, for routes lo to
+ * hi, which all agree on the first d bits. 'val' is the result 
+ * for addresses that no route longer than d bits matches.
+ *
+ * A route of n bits, d < n <= d+k, covers a block of 2^(d+k-n) 
+ * slots starting at the one its key is in. Shorter routes are 
+ * painted first so that longer ones win. A slot with a route 
+ * longer than d+k bits gets a child node.
+ ***********************************************************###*/
+static void
+pop_slots(ptrie_poptrie_t *pp, size_t d, uint32_t k, uint32_t lo, uint32_t hi, 
+          void *val, popslot_t *slots)
+{
+    poproute_t *pr;
+    uint32_t    s;
+    uint32_t    i;
+    uint32_t    j;
+    size_t      n;
+
+    for (s = 0; s < (1U << k); s++) {
+        slots[s].ps_val = val;
+        slots[s].ps_lo = slots[s].ps_hi = 0;
+        slots[s].ps_child = 0;
+    }
+
+    for (n = d + 1; n <= d + k; n++) {
+        for (i = lo; i < hi; i++) {
+            pr = &pp->pop_routes[i];
+            if (pr->pr_nbits != n)
+                continue;
+            s = keybits(pr->pr_key, pp->pop_keysz, d + 1, k);
+            for (j = 0; j < (1U << (d + k - n)); j++)
+                slots[s + j].ps_val = pr->pr_val;
+        }
+    }
+
+    for (i = lo; i < hi; i++) {
+        pr = &pp->pop_routes[i];
+        s = keybits(pr->pr_key, pp->pop_keysz, d + 1, k);
+        if (slots[s].ps_hi == 0)
+            slots[s].ps_lo = i;
+        slots[s].ps_hi = i + 1;
+        if (pr->pr_nbits > d + k)
+            slots[s].ps_child = 1;
+    }
+}
+
+/*
+ * Fill in node x, d bits down, for routes lo to hi
+ */
+static void
+pop_build(ptrie_poptrie_t *pp, uint32_t x, size_t d, uint32_t lo, uint32_t hi, void *val)
+{
+    popslot_t slots[1 << POP_STRIDE];
+    uint64_t  vector = 0;
+    uint64_t  leafvec = 0;
+    uint32_t  base0;
+    uint32_t  base1;
+    uint32_t  s;
+    int       run = 0; /* in a run of leaves */
+    void     *last = NULL;
+
+    pop_slots(pp, d, POP_STRIDE, lo, hi, val, slots);
+
+    base0 = pp->pop_nleaves;
+
+    for (s = 0; s < (1 << POP_STRIDE); s++) {
+        if (slots[s].ps_child) {
+            vector |= 1ULL << s;
+        } else if (NOT run || slots[s].ps_val != last) {
+            leafvec |= 1ULL << s;
+            pop_newleaf(pp, slots[s].ps_val);
+            last = slots[s].ps_val;
+            run = 1;
+        }
+    }
+
+    base1 = pop_newnodes(pp, __builtin_popcountll(vector));
+
+    pp->pop_nodes[x].po_vector = vector;
+    pp->pop_nodes[x].po_leafvec = leafvec;
+    pp->pop_nodes[x].po_base0 = base0;
+    pp->pop_nodes[x].po_base1 = base1;
+
+    for (s = 0; s < (1 << POP_STRIDE); s++) {
+        if (slots[s].ps_child)
+            pop_build(pp, base1++, d + POP_STRIDE, slots[s].ps_lo, slots[s].ps_hi, slots[s].ps_val);
+    }
+}
+
+/*
+ * Append n nodes and return the index of the first. The array 
+ * may move.
+ */
+static uint32_t
+pop_newnodes(ptrie_poptrie_t *pp, uint32_t n)
+{
+    popnode_t *nodes;
+    uint32_t   max;
+    uint32_t   x;
+
+    if (pp->pop_nnodes + n > pp->pop_maxnodes) {
+        max = 2 * pp->pop_maxnodes + n;
+        nodes = pp->pop_malloc_func(max * sizeof(*nodes));
+        if (pp->pop_nodes) {
+            memcpy(nodes, pp->pop_nodes, pp->pop_nnodes * sizeof(*nodes));
+            pp->pop_free_func(pp->pop_nodes);
+        }
+        pp->pop_nodes = nodes;
+        pp->pop_maxnodes = max;
+    }
+
+    x = pp->pop_nnodes;
+    pp->pop_nnodes += n;
+    return x;
+}
+
+static uint32_t
+pop_newleaf(ptrie_poptrie_t *pp, void *val)
+{
+    void   **leaves;
+    uint32_t max;
+
+    if (pp->pop_nleaves == pp->pop_maxleaves) {
+        max = 2 * pp->pop_maxleaves + 64;
+        leaves = pp->pop_malloc_func(max * sizeof(*leaves));
+        if (pp->pop_leaves) {
+            memcpy(leaves, pp->pop_leaves, pp->pop_nleaves * sizeof(*leaves));
+            pp->pop_free_func(pp->pop_leaves);
+        }
+        pp->pop_leaves = leaves;
+        pp->pop_maxleaves = max;
+    }
+
+    pp->pop_leaves[pp->pop_nleaves] = val;
+    return pp->pop_nleaves++;
+}
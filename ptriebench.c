@@ -0,0 +1,913 @@
+/*
+ * Copyright (c) 2012, Todd Hayton <thayton@neekanee.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * ptriebench [-j] [-s skew] [-w workload] [nkeys [maxthreads]]
+ *
+ * Compare the default node layout with PTRIE_F_SEDGEWICK and
+ * PTRIE_F_OWNKEYS on a dictionary of random string keys: bytes
+ * allocated per key, insert time and lookup latency.
+ *
+ * Then insert the same keys from 1, 2, 4... maxthreads writer 
+ * threads, into a single trie behind one mutex and into a 
+ * ptrie_sharded_t, to show how insert throughput scales, and 
+ * build a trie with ptrie_build_parallel() and scan it with 
+ * ptrie_parallel_foreach() on as many threads.
+ *
+ * Then compare longest-prefix match on a table of random IPv4
+ * routes, mostly /24s as in a BGP table, in the trie and in an 
+ * LC-trie and a poptrie built from it.
+ *
+ * Finally, run the workload suite: for IPv4 and IPv6 routing 
+ * tables, URLs, file paths and random 16 byte binary keys, time
+ * add, get, get_prefix, a full iteration and del, and report the
+ * bytes allocated per key and how much the resident set grew. 
+ * Lookups pick keys with a Zipf distribution of exponent skew 
+ * (default 0, uniform). -w runs a single workload.
+ *
+ * With -j only the suite is run, and its results are printed as 
+ * JSON, for comparing builds.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "patricia.h"
+
+static size_t nalloc; /* bytes allocated through the trie */
+
+/* shard on the 5 low bits of the first character */
+#define BENCH_SHARD_OFFSET 3
+#define BENCH_SHARD_BITS   5
+
+typedef struct bench_writer {
+    pthread_t        bw_tid;
+    ptrie_t         *bw_ptrie;  /* single trie, or */
+    pthread_mutex_t *bw_lock;
+    ptrie_sharded_t *bw_ps;     /* sharded trie */
+    char           **bw_keys;
+    int              bw_first;  /* add keys first, first+step... */
+    int              bw_step;
+    int              bw_n;
+} bench_writer_t;
+
+/* 
+ * A workload of the suite: how to make its keys, their size if 
+ * fixed (0 for strings), and the prefix length in bits used for 
+ * ptrie_get_prefix() (0 for half of the key)
+ */
+typedef struct bench_workload {
+    const char *wl_name;
+    void     **(*wl_make)(int n);
+    size_t      wl_keysz;
+    size_t      wl_pfxbits;
+} bench_workload_t;
+
+#define BENCH_NOPS 6
+
+static const char *bench_ops[BENCH_NOPS] = { "add", "get", "get_cached", "get_prefix", "iter", "del" };
+
+typedef struct bench_result {
+    const char *br_name;
+    int         br_keys;       /* distinct keys */
+    double      br_bytes;      /* allocated per key */
+    long        br_rss;        /* resident set growth in bytes, or -1 */
+    double      br_depth;      /* average lookup depth */
+    int         br_maxdepth;
+    double      br_cachehit;   /* share of get_cached answered by the cache */
+    double      br_ns[BENCH_NOPS];
+} bench_result_t;
+
+static void  *count_malloc(size_t size);
+static double now(void);
+static char **make_keys(int n);
+static void   bench_layout(const char *name, uint32_t flags, char **keys, int n);
+static void  *bench_writer(void *arg);
+static double bench_writers(int sharded, int nthreads, char **keys, int n);
+static void   bench_scan_key(void *key, void *val, void *arg);
+static void   bench_parallel(int maxthreads, char **keys, int n);
+static void   bench_routes(int n);
+static void   bench_counts(char **keys, int n);
+static void **make_ipv4(int n);
+static void **make_ipv6(int n);
+static void **make_urls(int n);
+static void **make_paths(int n);
+static void **make_random(int n);
+static int   *make_zipf(int n, int m, double skew);
+static long   rss(void);
+static void   bench_workload(bench_workload_t *wl, int n, double skew, bench_result_t *br);
+static void   bench_suite(const char *only, int n, double skew, int json);
+
+static bench_workload_t bench_workloads[] = {
+    { "ipv4",   make_ipv4,   4,  16 },
+    { "ipv6",   make_ipv6,   16, 32 },
+    { "url",    make_urls,   0,  0 },
+    { "path",   make_paths,  0,  0 },
+    { "random", make_random, 16, 32 },
+    { NULL }
+};
+
+int main(int argc, char **argv)
+{
+    char      **keys;
+    const char *only = NULL;
+    double      skew = 0;
+    int         json = 0;
+    int         n;
+    int         maxthreads;
+    int         usage = 0;
+    int         t;
+    int         c;
+
+    while ((c = getopt(argc, argv, "js:w:")) != -1) {
+        switch (c) {
+        case 'j':
+            json = 1;
+            break;
+        case 's':
+            skew = atof(optarg);
+            break;
+        case 'w':
+            only = optarg;
+            break;
+        default:
+            usage = 1;
+            break;
+        }
+    }
+
+    n = optind < argc ? atoi(argv[optind]) : 1000000;
+    maxthreads = optind + 1 < argc ? atoi(argv[optind + 1]) : 8;
+    if (usage || n <= 0 || maxthreads <= 0 || skew < 0) {
+        fprintf(stderr, "usage: %s [-j] [-s skew] [-w workload] [nkeys [maxthreads]]\n", argv[0]);
+        exit(1);
+    }
+
+    if (json || only) {
+        bench_suite(only, n, skew, json);
+        exit(0);
+    }
+
+    keys = make_keys(n);
+
+    printf("%-10s %10s %12s %12s %12s\n",
+           "layout", "keys", "bytes/key", "add ns/op", "get ns/op");
+
+    bench_layout("default", 0, keys, n);
+    bench_layout("sedgewick", PTRIE_F_SEDGEWICK, keys, n);
+    bench_layout("ownkeys", PTRIE_F_OWNKEYS, keys, n);
+    bench_layout("counts", PTRIE_F_COUNTS, keys, n);
+
+    printf("\n%-10s %14s %14s\n", "writers", "locked Mops/s", "sharded Mops/s");
+
+    for (t = 1; t <= maxthreads; t *= 2) {
+        printf("%-10d %14.2f %14.2f\n", t, 
+               n / bench_writers(0, t, keys, n) / 1e6,
+               n / bench_writers(1, t, keys, n) / 1e6);
+    }
+
+    bench_parallel(maxthreads, keys, n);
+
+    bench_routes(n);
+
+    bench_counts(keys, n);
+
+    bench_suite(NULL, n, skew, 0);
+
+    exit(0);
+}
+
+static void *
+count_malloc(size_t size)
+{
+    void *data = malloc(size);
+    if (data == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    nalloc += size;
+    return data;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Random lower case keys 8 to 32 characters long
+ */
+static char **
+make_keys(int n)
+{
+    char **keys;
+    int    i;
+    int    j;
+    int    len;
+
+    srandom(1);
+
+    keys = count_malloc(n * sizeof(*keys));
+    for (i = 0; i < n; i++) {
+        len = 8 + random() % 25;
+        keys[i] = count_malloc(len + 1);
+        for (j = 0; j < len; j++)
+            keys[i][j] = 'a' + random() % 26;
+        keys[i][len] = '\0';
+    }
+
+    return keys;
+}
+
+static void
+bench_layout(const char *name, uint32_t flags, char **keys, int n)
+{
+    ptrie_t *ptrie;
+    double   t0;
+    double   tadd;
+    double   tget;
+    int     *order;
+    int      i;
+    int      misses = 0;
+
+    /* look keys up in a different order than they were added */
+    order = malloc(n * sizeof(*order));
+    for (i = 0; i < n; i++)
+        order[i] = i;
+    for (i = n - 1; i > 0; i--) {
+        int j = random() % (i + 1);
+        int t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    nalloc = 0;
+
+    ptrie = ptrie_new2(flags);
+    ptrie_set_parm(ptrie, PTRIEPARM_MALLOC_FUNC, (void *)count_malloc);
+
+    t0 = now();
+    for (i = 0; i < n; i++)
+        ptrie_add(ptrie, keys[i], keys[i]);
+    tadd = now() - t0;
+
+    t0 = now();
+    for (i = 0; i < n; i++) {
+        if (ptrie_get(ptrie, keys[order[i]]) != keys[order[i]])
+            misses++;
+    }
+    tget = now() - t0;
+
+    if (misses)
+        fprintf(stderr, "%s: %d lookups failed\n", name, misses);
+
+    printf("%-10s %10d %12.1f %12.1f %12.1f\n", name, ptrie_size(ptrie),
+           (double)nalloc / ptrie_size(ptrie), tadd * 1e9 / n, tget * 1e9 / n);
+
+    free(order);
+}
+
+static void *
+bench_writer(void *arg)
+{
+    bench_writer_t *bw = arg;
+    int             i;
+
+    for (i = bw->bw_first; i < bw->bw_n; i += bw->bw_step) {
+        if (bw->bw_ps) {
+            ptrie_sharded_add(bw->bw_ps, bw->bw_keys[i], bw->bw_keys[i]);
+        } else {
+            pthread_mutex_lock(bw->bw_lock);
+            ptrie_add(bw->bw_ptrie, bw->bw_keys[i], bw->bw_keys[i]);
+            pthread_mutex_unlock(bw->bw_lock);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Seconds taken by nthreads writers to add all n keys
+ */
+static double
+bench_writers(int sharded, int nthreads, char **keys, int n)
+{
+    bench_writer_t  *bw;
+    pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+    ptrie_t         *ptrie = NULL;
+    ptrie_sharded_t *ps = NULL;
+    double           t0;
+    double           t;
+    int              i;
+
+    if (sharded)
+        ps = ptrie_sharded_new(0, BENCH_SHARD_OFFSET, BENCH_SHARD_BITS);
+    else
+        ptrie = ptrie_new();
+
+    bw = malloc(nthreads * sizeof(*bw));
+
+    t0 = now();
+
+    for (i = 0; i < nthreads; i++) {
+        bw[i].bw_ptrie = ptrie;
+        bw[i].bw_lock = &lock;
+        bw[i].bw_ps = ps;
+        bw[i].bw_keys = keys;
+        bw[i].bw_first = i;
+        bw[i].bw_step = nthreads;
+        bw[i].bw_n = n;
+        pthread_create(&bw[i].bw_tid, NULL, bench_writer, &bw[i]);
+    }
+
+    for (i = 0; i < nthreads; i++)
+        pthread_join(bw[i].bw_tid, NULL);
+
+    t = now() - t0;
+
+    if (sharded)
+        ptrie_sharded_free(ps);
+    else
+        ptrie_free(ptrie);
+
+    free(bw);
+    return t;
+}
+
+static void
+bench_scan_key(void *key, void *val, void *arg)
+{
+    /* touch the key so the scan isn't just a walk over the leaves */
+    __atomic_fetch_add((size_t *)arg, ((char *)key)[0], __ATOMIC_RELAXED);
+}
+
+static void
+bench_parallel(int maxthreads, char **keys, int n)
+{
+    ptrie_t *ptrie;
+    size_t   sum;
+    double   t0;
+    double   tbuild;
+    int      t;
+
+    printf("\n%-10s %14s %14s\n", "threads", "build Mkeys/s", "scan Mkeys/s");
+
+    for (t = 1; t <= maxthreads; t *= 2) {
+        ptrie = ptrie_new();
+
+        t0 = now();
+        ptrie_build_parallel(ptrie, (void **)keys, (void **)keys, n, t);
+        tbuild = now() - t0;
+
+        sum = 0;
+        t0 = now();
+        ptrie_parallel_foreach(ptrie, NULL, t, bench_scan_key, &sum);
+
+        printf("%-10d %14.2f %14.2f\n", t, n / tbuild / 1e6, 
+               ptrie_size(ptrie) / (now() - t0) / 1e6);
+
+        ptrie_free(ptrie);
+    }
+}
+
+/*
+ * Counting the keys with a 16 bit prefix with PTRIE_F_COUNTS 
+ * against iterating over them, and rank and select
+ */
+static void
+bench_counts(char **keys, int n)
+{
+    ptrie_t     *ptrie;
+    ptrie_iter_t iter;
+    void        *key;
+    long         total[2] = { 0, 0 };
+    double       t0;
+    double       tcount;
+    double       titer;
+    double       trank;
+    double       tselect;
+    int          m = n < 10000 ? n : 10000;
+    int          i;
+
+    ptrie = ptrie_new2(PTRIE_F_COUNTS);
+    for (i = 0; i < n; i++)
+        ptrie_add(ptrie, keys[i], keys[i]);
+
+    t0 = now();
+    for (i = 0; i < m; i++)
+        total[0] += ptrie_count_prefix(ptrie, keys[i], 16);
+    tcount = now() - t0;
+
+    t0 = now();
+    for (i = 0; i < m; i++) {
+        foreach_ptrie_key_with_prefix(ptrie, &iter, keys[i], 16, &key)
+            total[1]++;
+    }
+    titer = now() - t0;
+
+    if (total[0] != total[1])
+        fprintf(stderr, "counts: ptrie_count_prefix found %ld keys, iteration %ld\n", 
+                total[0], total[1]);
+
+    t0 = now();
+    for (i = 0; i < m; i++)
+        total[0] += ptrie_rank(ptrie, keys[i]);
+    trank = now() - t0;
+
+    t0 = now();
+    for (i = 0; i < m; i++)
+        total[1] += ptrie_select(ptrie, random() % ptrie_size(ptrie), &key, NULL);
+    tselect = now() - t0;
+
+    printf("\n%-10s %14s %14s %14s %14s\n", "counts", "prefix ns/op", "iterate ns/op", 
+           "rank ns/op", "select ns/op");
+    printf("%-10d %14.1f %14.1f %14.1f %14.1f\n", ptrie_size(ptrie), tcount * 1e9 / m, 
+           titer * 1e9 / m, trank * 1e9 / m, tselect * 1e9 / m);
+
+    ptrie_free(ptrie);
+}
+
+static void
+bench_routes(int n)
+{
+    ptrie_t         *ptrie;
+    ptrie_lc_t      *lc;
+    ptrie_poptrie_t *pp;
+    uint32_t        *addrs;
+    uint32_t         net;
+    double           t0;
+    double           tpt;
+    double           tlc;
+    double           tpop;
+    double           avgdepth;
+    int              maxdepth;
+    int              nbits;
+    int              found[3] = { 0, 0, 0 };
+    int              i;
+
+    ptrie = ptrie_new();
+    ptrie_set_parm(ptrie, PTRIEPARM_KEYSZ, (void *)sizeof(uint32_t));
+
+    for (i = 0; i < n; i++) {
+        nbits = random() % 10 < 6 ? 24 : 8 + random() % 16;
+        net = (uint32_t)random() << 1;
+        net = htonl(net & ~(~0U >> nbits));
+        ptrie_add_prefix(ptrie, &net, nbits, (void *)(intptr_t)(i + 1));
+    }
+
+    lc = ptrie_lc_build(ptrie, 0);
+    ptrie_lc_depth(lc, &maxdepth, &avgdepth);
+    pp = ptrie_poptrie_build(ptrie);
+
+    addrs = malloc(n * sizeof(*addrs));
+    for (i = 0; i < n; i++)
+        addrs[i] = (uint32_t)random() << 1;
+
+    t0 = now();
+    for (i = 0; i < n; i++) {
+        if (ptrie_lpm(ptrie, &addrs[i]))
+            found[0]++;
+    }
+    tpt = now() - t0;
+
+    t0 = now();
+    for (i = 0; i < n; i++) {
+        if (ptrie_lc_lpm(lc, &addrs[i]))
+            found[1]++;
+    }
+    tlc = now() - t0;
+
+    t0 = now();
+    for (i = 0; i < n; i++) {
+        if (ptrie_poptrie_lpm(pp, &addrs[i]))
+            found[2]++;
+    }
+    tpop = now() - t0;
+
+    if (found[1] != found[0] || found[2] != found[0])
+        fprintf(stderr, "routes: matches differ: %d %d %d\n", found[0], found[1], found[2]);
+
+    printf("\n%-10s %10s %12s %12s %12s\n", 
+           "routes", "keys", "lpm ns/op", "depth", "max depth");
+    printf("%-10s %10d %12.1f %12s %12s\n", "ptrie", ptrie_size(ptrie), tpt * 1e9 / n, "-", "-");
+    printf("%-10s %10d %12.1f %12.2f %12d\n", "lc-trie", ptrie_lc_size(lc), tlc * 1e9 / n,
+           avgdepth, maxdepth);
+    printf("%-10s %10d %12.1f %12s %12s   %.1f MB\n", "poptrie", ptrie_size(ptrie), tpop * 1e9 / n,
+           "-", "-", ptrie_poptrie_memsize(pp) / 1e6);
+
+    ptrie_poptrie_free(pp);
+    ptrie_lc_free(lc);
+    ptrie_free(ptrie);
+    free(addrs);
+}
+
+/*
+ * IPv4 routes in network byte order: 60% /24s, the rest /8 to /23,
+ * with the host bits cleared
+ */
+static void **
+make_ipv4(int n)
+{
+    void   **keys;
+    uint32_t net;
+    int      nbits;
+    int      i;
+
+    keys = count_malloc(n * sizeof(*keys));
+    for (i = 0; i < n; i++) {
+        nbits = random() % 10 < 6 ? 24 : 8 + random() % 16;
+        net = (uint32_t)random() << 1;
+        net = htonl(net & ~(~0U >> nbits));
+        keys[i] = count_malloc(sizeof(net));
+        memcpy(keys[i], &net, sizeof(net));
+    }
+
+    return keys;
+}
+
+/*
+ * IPv6 routes: /32 allocations under a few hundred /12 registry 
+ * blocks in 2000::/3, mostly split into /48s
+ */
+static void **
+make_ipv6(int n)
+{
+    void   **keys;
+    uint8_t *addr;
+    uint32_t alloc;
+    int      i;
+
+    keys = count_malloc(n * sizeof(*keys));
+    for (i = 0; i < n; i++) {
+        addr = count_malloc(16);
+        memset(addr, 0, 16);
+
+        alloc = 0x20000000 | (random() % 256) << 20 | (random() % 4096) << 8;
+        addr[0] = alloc >> 24;
+        addr[1] = alloc >> 16;
+        addr[2] = alloc >> 8;
+        if (random() % 10 < 8) {
+            addr[4] = random();
+            addr[5] = random();
+        }
+
+        keys[i] = addr;
+    }
+
+    return keys;
+}
+
+static const char *bench_tlds[] = { "com", "org", "net", "de", "io", "co.uk" };
+
+/*
+ * URLs on hosts picked with a Zipf distribution, so that a few 
+ * sites have most of the pages, as in a crawl or a proxy cache
+ */
+static void **
+make_urls(int n)
+{
+    void **keys;
+    char   buf[128];
+    int   *host;
+    int    nhosts = n / 20 + 1;
+    int    i;
+
+    host = make_zipf(n, nhosts, 1.0);
+
+    keys = count_malloc(n * sizeof(*keys));
+    for (i = 0; i < n; i++) {
+        snprintf(buf, sizeof(buf), "https://www.site%d.%s/%s/%ld/page%ld.html", 
+                 host[i], bench_tlds[host[i] % 6], 
+                 random() % 2 ? "news" : "products", random() % 1000, random());
+        keys[i] = count_malloc(strlen(buf) + 1);
+        strcpy(keys[i], buf);
+    }
+
+    free(host);
+    return keys;
+}
+
+static const char *bench_dirs[] = { "/usr/lib", "/usr/share/doc", "/home/user/src", 
+                                    "/var/log", "/opt/app/data" };
+
+/*
+ * File paths a few directories deep under a handful of roots
+ */
+static void **
+make_paths(int n)
+{
+    void **keys;
+    char   buf[128];
+    int    i;
+
+    keys = count_malloc(n * sizeof(*keys));
+    for (i = 0; i < n; i++) {
+        snprintf(buf, sizeof(buf), "%s/pkg%ld/sub%ld/file%ld.%s", 
+                 bench_dirs[random() % 5], random() % 500, random() % 50, 
+                 random(), random() % 2 ? "c" : "so");
+        keys[i] = count_malloc(strlen(buf) + 1);
+        strcpy(keys[i], buf);
+    }
+
+    return keys;
+}
+
+/*
+ * Uniform random 16 byte keys
+ */
+static void **
+make_random(int n)
+{
+    void   **keys;
+    uint8_t *key;
+    int      i;
+    int      j;
+
+    keys = count_malloc(n * sizeof(*keys));
+    for (i = 0; i < n; i++) {
+        key = count_malloc(16);
+        for (j = 0; j < 16; j++)
+            key[j] = random();
+        keys[i] = key;
+    }
+
+    return keys;
+}
+
+/*
+ * n draws from 0..m-1 with a Zipf distribution of exponent skew,
+ * so that the i-th most popular value is drawn in proportion to
+ * 1/i^skew. The ranks are shuffled over the values so that the 
+ * popular ones aren't neighbours.
+ */
+static int *
+make_zipf(int n, int m, double skew)
+{
+    double *cdf;
+    int    *perm;
+    int    *draws;
+    double  u;
+    int     lo;
+    int     hi;
+    int     mid;
+    int     i;
+    int     j;
+    int     t;
+
+    cdf = malloc(m * sizeof(*cdf));
+    perm = malloc(m * sizeof(*perm));
+    draws = malloc(n * sizeof(*draws));
+
+    for (i = 0; i < m; i++) {
+        cdf[i] = (i ? cdf[i - 1] : 0) + 1 / pow(i + 1, skew);
+        perm[i] = i;
+    }
+    for (i = m - 1; i > 0; i--) {
+        j = random() % (i + 1);
+        t = perm[i];
+        perm[i] = perm[j];
+        perm[j] = t;
+    }
+
+    for (i = 0; i < n; i++) {
+        u = (double)random() / RAND_MAX * cdf[m - 1];
+        for (lo = 0, hi = m - 1; lo < hi; ) {
+            mid = (lo + hi) / 2;
+            if (cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        draws[i] = perm[lo];
+    }
+
+    free(cdf);
+    free(perm);
+    return draws;
+}
+
+/*
+ * Resident set size in bytes, or -1 where /proc isn't available
+ */
+static long
+rss(void)
+{
+    FILE *fp;
+    long  size;
+    long  resident = -1;
+
+    if ((fp = fopen("/proc/self/statm", "r")) != NULL) {
+        if (fscanf(fp, "%ld %ld", &size, &resident) != 2)
+            resident = -1;
+        fclose(fp);
+    }
+
+    return resident < 0 ? -1 : resident * sysconf(_SC_PAGESIZE);
+}
+
+static void
+bench_workload(bench_workload_t *wl, int n, double skew, bench_result_t *br)
+{
+    ptrie_t     *ptrie;
+    ptrie_iter_t iter;
+    ptrie_stats_t st;
+    void       **keys;
+    void        *key;
+    int         *pick;
+    int         *order;
+    size_t      *nbits;
+    size_t       keysz;
+    long         rss0;
+    double       t0;
+    int          misses = 0;
+    int          i;
+
+    srandom(1);
+
+    keys = wl->wl_make(n);
+    pick = make_zipf(n, n, skew);
+
+    /* delete in a different order than the keys were added */
+    order = malloc(n * sizeof(*order));
+    for (i = 0; i < n; i++)
+        order[i] = i;
+    for (i = n - 1; i > 0; i--) {
+        int j = random() % (i + 1);
+        int t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    nbits = malloc(n * sizeof(*nbits));
+    for (i = 0; i < n; i++) {
+        keysz = wl->wl_keysz ? wl->wl_keysz : strlen(keys[pick[i]]);
+        nbits[i] = wl->wl_pfxbits ? wl->wl_pfxbits : keysz * 8 / 2;
+    }
+
+    br->br_name = wl->wl_name;
+    nalloc = 0;
+    rss0 = rss();
+
+    ptrie = ptrie_new();
+    ptrie_set_parm(ptrie, PTRIEPARM_MALLOC_FUNC, (void *)count_malloc);
+    if (wl->wl_keysz)
+        ptrie_set_parm(ptrie, PTRIEPARM_KEYSZ, (void *)wl->wl_keysz);
+
+    t0 = now();
+    for (i = 0; i < n; i++)
+        ptrie_add(ptrie, keys[i], keys[i]);
+    br->br_ns[0] = (now() - t0) * 1e9 / n;
+
+    br->br_keys = ptrie_size(ptrie);
+    br->br_bytes = (double)nalloc / br->br_keys;
+    br->br_rss = rss0 < 0 ? -1 : rss() - rss0;
+
+    ptrie_stats(ptrie, &st);
+    br->br_depth = st.avgdepth;
+    br->br_maxdepth = st.maxdepth;
+
+    t0 = now();
+    for (i = 0; i < n; i++) {
+        if (ptrie_get(ptrie, keys[pick[i]]) == NULL)
+            misses++;
+    }
+    br->br_ns[1] = (now() - t0) * 1e9 / n;
+
+    /* the same lookups through a front cache of about 1% of the keys */
+    ptrie_set_parm(ptrie, PTRIEPARM_CACHESZ, (void *)(size_t)(n / 100));
+    t0 = now();
+    for (i = 0; i < n; i++) {
+        if (ptrie_get(ptrie, keys[pick[i]]) == NULL)
+            misses++;
+    }
+    br->br_ns[2] = (now() - t0) * 1e9 / n;
+    ptrie_stats(ptrie, &st);
+    br->br_cachehit = (double)st.cache_hits / n;
+    ptrie_set_parm(ptrie, PTRIEPARM_CACHESZ, (void *)0);
+
+    t0 = now();
+    for (i = 0; i < n; i++) {
+        if (ptrie_get_prefix(ptrie, keys[pick[i]], nbits[i]) == NULL)
+            misses++;
+    }
+    br->br_ns[3] = (now() - t0) * 1e9 / n;
+
+    t0 = now();
+    i = 0;
+    foreach_ptrie_key(ptrie, &iter, &key)
+        i++;
+    br->br_ns[4] = (now() - t0) * 1e9 / i;
+    if (i != br->br_keys)
+        misses++;
+
+    t0 = now();
+    for (i = 0; i < n; i++)
+        ptrie_del(ptrie, keys[order[i]]);
+    br->br_ns[5] = (now() - t0) * 1e9 / n;
+
+    if (misses || ptrie_size(ptrie) != 0)
+        fprintf(stderr, "%s: %d lookups failed\n", wl->wl_name, misses);
+
+    ptrie_free(ptrie);
+
+    for (i = 0; i < n; i++)
+        free(keys[i]);
+    free(keys);
+    free(pick);
+    free(order);
+    free(nbits);
+}
+
+static void
+bench_suite(const char *only, int n, double skew, int json)
+{
+    bench_workload_t *wl;
+    bench_result_t    br;
+    int               first = 1;
+    int               i;
+
+    for (wl = bench_workloads; only && wl->wl_name; wl++) {
+        if (strcmp(only, wl->wl_name) == 0)
+            break;
+    }
+    if (only && wl->wl_name == NULL) {
+        fprintf(stderr, "unknown workload %s\n", only);
+        exit(1);
+    }
+
+    if (json) {
+        printf("{\n  \"nkeys\": %d,\n  \"skew\": %g,\n  \"workloads\": [", n, skew);
+    } else {
+        printf("\n%-10s %10s %10s %10s %10s %10s", "workload", "keys", "bytes/key", "rss MB", "depth", "cache hit");
+        for (i = 0; i < BENCH_NOPS; i++)
+            printf(" %10s", bench_ops[i]);
+        printf("   (ns/op)\n");
+    }
+
+    for (wl = bench_workloads; wl->wl_name; wl++) {
+        if (only && strcmp(only, wl->wl_name) != 0)
+            continue;
+
+        bench_workload(wl, n, skew, &br);
+
+        if (json) {
+            printf("%s\n    {\n      \"name\": \"%s\",\n      \"keys\": %d,\n"
+                   "      \"bytes_per_key\": %.1f,\n      \"rss_bytes\": %ld,\n"
+                   "      \"avg_depth\": %.2f,\n      \"max_depth\": %d,\n"
+                   "      \"cache_hit_rate\": %.3f,\n"
+                   "      \"ops\": {", first ? "" : ",", br.br_name, br.br_keys, 
+                   br.br_bytes, br.br_rss, br.br_depth, br.br_maxdepth, br.br_cachehit);
+            for (i = 0; i < BENCH_NOPS; i++) {
+                printf("%s\n        \"%s\": { \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f }",
+                       i ? "," : "", bench_ops[i], br.br_ns[i], 1e9 / br.br_ns[i]);
+            }
+            printf("\n      }\n    }");
+        } else {
+            printf("%-10s %10d %10.1f %10.1f %10.1f %9.1f%%", br.br_name, br.br_keys, br.br_bytes, 
+                   br.br_rss / 1e6, br.br_depth, br.br_cachehit * 100);
+            for (i = 0; i < BENCH_NOPS; i++)
+                printf(" %10.1f", br.br_ns[i]);
+            printf("\n");
+        }
+
+        first = 0;
+    }
+
+    if (json)
+        printf("\n  ]\n}\n");
+}
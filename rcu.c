@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2012, Todd Hayton <thayton@neekanee.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * PTRIE_F_CONCURRENT mode: any number of readers search the trie
+ * without locks while one writer at a time changes it.
+ *
+ * The writer never changes a node that readers can reach except
+ * to swing a single link (see PN_STORE), so a reader sees each 
+ * change either in full or not at all. Nodes and keys that are 
+ * unlinked can still be in use by a reader, so instead of being
+ * freed they're retired along with the epoch in which they were
+ * unlinked.
+ *
+ * A reader records the current epoch in its slot when it enters
+ * a read-side critical section and clears it when it leaves. To 
+ * reclaim, the writer advances the epoch and scans the slots:
+ * anything retired before the oldest epoch a reader is in can't
+ * be reached by any reader, and goes back to its pool.
+ *
+ * Readers only ever store to their own slot, which sits in a 
+ * cache line of its own, so adding reader threads doesn't add
+ * cache line traffic between them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "patricia.h"
+#include "patriciaP.h"
+
+#define PRCU_CACHELINE 64
+
+/* 
+ * How many retired items to collect before trying to reclaim
+ * them, so that the writer doesn't scan the reader slots on 
+ * every delete
+ */
+#define PRCU_BATCH 64
+
+struct ptrie_reader {
+    uint64_t             rd_epoch; /* epoch entered in, 0 if outside */
+    struct prcu         *rd_rcu;
+    struct ptrie_reader *rd_next;
+} __attribute__((aligned(PRCU_CACHELINE)));
+
+typedef struct pretire {
+    uint64_t rt_epoch;  /* epoch in which it was retired */
+    pidx_t   rt_idx;    /* node, or */
+    void    *rt_ptr;    /* memory for pt_free_func */
+} pretire_t;
+
+typedef struct prcu {
+    uint64_t         rc_epoch;
+    pthread_mutex_t  rc_lock;  /* protects rc_readers */
+    ptrie_reader_t  *rc_readers;
+    pretire_t       *rc_retired;
+    size_t           rc_nretired;
+    size_t           rc_maxretired;
+} prcu_t;
+
+static void prcu_reclaim(ptrie_t *pt, int wait);
+
+void
+prcu_init(ptrie_t *pt)
+{
+    prcu_t *rc;
+
+    /* like the ptrie_t, allocated before any parms are set */
+    if ((rc = malloc(sizeof(*rc))) == NULL) {
+        fprintf(stderr, "prcu_init - out of memory\n");
+        exit(1);
+    }
+    memset(rc, 0, sizeof(*rc));
+
+    rc->rc_epoch = 1;
+    pthread_mutex_init(&rc->rc_lock, NULL);
+
+    pt->pt_rcu = rc;
+}
+
+/***********************************************************###**
+ * Free everything still retired, and any readers that weren't 
+ * freed. There must be no readers left in the trie.
+ ***********************************************************###*/
+void
+prcu_destroy(ptrie_t *pt)
+{
+    prcu_t         *rc = pt->pt_rcu;
+    ptrie_reader_t *rd;
+
+    if (NOT rc)
+        return;
+
+    prcu_reclaim(pt, 1);
+
+    while ((rd = rc->rc_readers) != NULL) {
+        rc->rc_readers = rd->rd_next;
+        free(rd);
+    }
+
+    pthread_mutex_destroy(&rc->rc_lock);
+    if (rc->rc_retired)
+        pt->pt_free_func(rc->rc_retired);
+    free(rc);
+    pt->pt_rcu = NULL;
+}
+
+/***********************************************************###**
+ * Hand node x (or, if x is PN_NIL, memory ptr) back once no 
+ * reader can be using it. It must already be unlinked.
+ ***********************************************************###*/
+void
+prcu_retire(ptrie_t *pt, pidx_t x, void *ptr)
+{
+    prcu_t    *rc = pt->pt_rcu;
+    pretire_t *rt;
+
+    if (rc->rc_nretired == rc->rc_maxretired) {
+        rc->rc_maxretired = 2 * rc->rc_maxretired + PRCU_BATCH;
+        rt = pt->pt_malloc_func(rc->rc_maxretired * sizeof(*rt));
+        if (rc->rc_retired) {
+            memcpy(rt, rc->rc_retired, rc->rc_nretired * sizeof(*rt));
+            pt->pt_free_func(rc->rc_retired);
+        }
+        rc->rc_retired = rt;
+    }
+
+    rt = &rc->rc_retired[rc->rc_nretired++];
+    rt->rt_epoch = rc->rc_epoch;
+    rt->rt_idx = x;
+    rt->rt_ptr = ptr;
+
+    if (rc->rc_nretired % PRCU_BATCH == 0)
+        prcu_reclaim(pt, 0);
+}
+
+/***********************************************************###**
+ * Start a new epoch and free what was retired before the oldest
+ * epoch a reader is still in. If wait is set, wait for readers
+ * in older epochs to leave and free everything.
+ ***********************************************************###*/
+static void
+prcu_reclaim(ptrie_t *pt, int wait)
+{
+    prcu_t         *rc = pt->pt_rcu;
+    ptrie_reader_t *rd;
+    pretire_t      *rt;
+    uint64_t        epoch;
+    uint64_t        oldest;
+    uint64_t        e;
+    size_t          i;
+    size_t          j;
+
+    epoch = rc->rc_epoch + 1;
+    __atomic_store_n(&rc->rc_epoch, epoch, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    oldest = epoch;
+
+    pthread_mutex_lock(&rc->rc_lock);
+    for (rd = rc->rc_readers; rd; rd = rd->rd_next) {
+        while ((e = __atomic_load_n(&rd->rd_epoch, __ATOMIC_ACQUIRE)) != 0 && e < epoch) {
+            if (NOT wait) {
+                if (e < oldest)
+                    oldest = e;
+                break;
+            }
+            sched_yield();
+        }
+    }
+    pthread_mutex_unlock(&rc->rc_lock);
+
+    for (i = j = 0; i < rc->rc_nretired; i++) {
+        rt = &rc->rc_retired[i];
+        if (rt->rt_epoch >= oldest) {
+            rc->rc_retired[j++] = *rt;
+        } else if (rt->rt_ptr) {
+            pt->pt_free_func(rt->rt_ptr);
+        } else if (PN_ISLEAF(rt->rt_idx)) {
+            pleaf_release(pt, rt->rt_idx);
+        } else {
+            pnpool_free(pt, &pt->pt_nodes, rt->rt_idx);
+        }
+    }
+
+    rc->rc_nretired = j;
+}
+
+/***********************************************************###**
+ * Register a reader thread. Each thread that reads the trie 
+ * needs its own reader.
+ ***********************************************************###*/
+ptrie_reader_t *
+ptrie_reader_new(ptrie_t *pt)
+{
+    prcu_t         *rc = pt->pt_rcu;
+    ptrie_reader_t *rd;
+
+    if (NOT rc)
+        return NULL;
+
+    if (posix_memalign((void **)&rd, PRCU_CACHELINE, sizeof(*rd)) != 0) {
+        fprintf(stderr, "ptrie_reader_new - out of memory\n");
+        exit(1);
+    }
+
+    rd->rd_epoch = 0;
+    rd->rd_rcu = rc;
+
+    pthread_mutex_lock(&rc->rc_lock);
+    rd->rd_next = rc->rc_readers;
+    rc->rc_readers = rd;
+    pthread_mutex_unlock(&rc->rc_lock);
+
+    return rd;
+}
+
+void
+ptrie_reader_free(ptrie_t *pt, ptrie_reader_t *rd)
+{
+    prcu_t          *rc = pt->pt_rcu;
+    ptrie_reader_t **rp;
+
+    if (NOT rc || NOT rd)
+        return;
+
+    pthread_mutex_lock(&rc->rc_lock);
+    for (rp = &rc->rc_readers; *rp; rp = &(*rp)->rd_next) {
+        if (*rp == rd) {
+            *rp = rd->rd_next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rc->rc_lock);
+
+    free(rd);
+}
+
+/***********************************************************###**
+ * Enter/leave a read-side critical section. Nodes, keys and 
+ * handles (from ptrie_add2(), ptrie_get_prefix(), iterators) 
+ * are only good until ptrie_read_unlock(). Critical sections 
+ * don't nest.
+ ***********************************************************###*/
+void
+ptrie_read_lock(ptrie_reader_t *rd)
+{
+    uint64_t epoch = __atomic_load_n(&rd->rd_rcu->rc_epoch, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&rd->rd_epoch, epoch, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+ptrie_read_unlock(ptrie_reader_t *rd)
+{
+    __atomic_store_n(&rd->rd_epoch, 0, __ATOMIC_RELEASE);
+}
+
+/***********************************************************###**
+ * Writer: wait until every reader has left the critical section
+ * it was in, then free everything retired. After this returns,
+ * keys and values removed from the trie are no longer in use.
+ ***********************************************************###*/
+void
+ptrie_synchronize(ptrie_t *pt)
+{
+    if (pt->pt_rcu)
+        prcu_reclaim(pt, 1);
+}
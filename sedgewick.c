@@ -0,0 +1,615 @@
+/*
+ * Copyright (c) 2012, Todd Hayton <thayton@neekanee.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * PTRIE_F_SEDGEWICK mode: a PATRICIA trie with a single node type
+ * as described in Sedgewick's Algorithms in C.
+ *
+ * Each node holds one key. Searching down the trie we stop as
+ * soon as we follow a link to a node whose difference bit isn't
+ * larger than the bit of the node we came from. The key we want
+ * (if it's in the trie) is in that node:
+ *
+ *              head [0] (0001)
+ *                   |
+ *                  [1] (1001)
+ *                 /   \__
+ *       (0010) [3]       `-> [1]
+ *             /   \__
+ *        -> head     `-> [3]
+ *
+ * The left child of [3] is an upward link to the head node,
+ * which holds 0001. The right child of [3] is a link back to
+ * [3] itself, which holds 0010.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "patricia.h"
+#include "patriciaP.h"
+
+#define SN_BIT(pt, x) (sn_node(pt, x)->sn_bit)
+
+/*
+ * Is the link from node p to node x an upward link?
+ */
+#define SN_UPLINK(pt, p, x) (SN_BIT(pt, x) <= SN_BIT(pt, p))
+
+static pidx_t sg_search(ptrie_t *pt, pidx_t p, pidx_t x, void *key, size_t keysz);
+static pidx_t sg_leftmost(ptrie_t *pt, pidx_t p, pidx_t x);
+static pidx_t sg_rightmost(ptrie_t *pt, pidx_t p, pidx_t x);
+static void   sg_relink(ptrie_t *pt, pidx_t p, void *key, size_t keysz, pidx_t x);
+
+/***********************************************************###**
+ * Search for key starting with the link from p to x. Returns
+ * the node holding the key at the end of the search.
+ ***********************************************************###*/
+static pidx_t
+sg_search(ptrie_t *pt, pidx_t p, pidx_t x, void *key, size_t keysz)
+{
+    snode_t *sn;
+
+    while (NOT SN_UPLINK(pt, p, x)) {
+        p  = x;
+        sn = sn_node(pt, x);
+        x  = sn->sn_cld[getbit(key, keysz, sn->sn_bit)];
+    }
+
+    return x;
+}
+
+/***********************************************************###**
+ * Node holding the smallest key under the link from p to x
+ ***********************************************************###*/
+static pidx_t
+sg_leftmost(ptrie_t *pt, pidx_t p, pidx_t x)
+{
+    while (NOT SN_UPLINK(pt, p, x)) {
+        p = x;
+        x = sn_node(pt, x)->sn_cld[0];
+    }
+
+    return x;
+}
+
+static pidx_t
+sg_rightmost(ptrie_t *pt, pidx_t p, pidx_t x)
+{
+    while (NOT SN_UPLINK(pt, p, x)) {
+        p = x;
+        x = sn_node(pt, x)->sn_cld[1];
+    }
+
+    return x;
+}
+
+/***********************************************************###**
+ * Point the link that the search for key follows out of node p
+ * at x.
+ ***********************************************************###*/
+static void
+sg_relink(ptrie_t *pt, pidx_t p, void *key, size_t keysz, pidx_t x)
+{
+    if (p == pt->pt_root)
+        sn_node(pt, p)->sn_cld[0] = x;
+    else
+        sn_node(pt, p)->sn_cld[getbit(key, keysz, SN_BIT(pt, p))] = x;
+}
+
+/***********************************************************###**
+ * Insert key (Sedgewick's Program 15.6).
+ *
+ * Search for key to find the key t closest to it and the first
+ * bit i where they differ. Then search again, stopping when we
+ * reach an upward link or a node whose bit is larger than i,
+ * and put a new node with bit i holding key there. One child of
+ * the new node links back to itself, the other to the node we
+ * stopped at.
+ ***********************************************************###*/
+void
+sg_add(ptrie_t *pt, void *key, size_t keysz, void *val, void **pnode)
+{
+    pidx_t   h;     /* head node */
+    pidx_t   p;
+    pidx_t   x;
+    pidx_t   t;
+    pidx_t  *lk;    /* link from p to x */
+    snode_t *sn;
+    int      diffbit;
+    int      b;
+
+    if (pt->pt_size == 0 ||
+        pt->pt_root == PN_NIL) {
+        h  = pnpool_alloc(pt, &pt->pt_nodes);
+        sn = sn_node(pt, h);
+        sn->sn_key    = key;
+        sn->sn_keysz  = keysz;
+        sn->sn_val    = val;
+        sn->sn_bit    = 0;
+        sn->sn_cld[0] = h;
+        sn->sn_cld[1] = PN_NIL;
+
+        pt->pt_root = h;
+        pt->pt_size++;
+        PT_COUNT(pt, adds);
+
+        if (pnode)
+            *pnode = PIDX2PTR(h);
+
+        return;
+    }
+
+    h  = pt->pt_root;
+    t  = sg_search(pt, h, sn_node(pt, h)->sn_cld[0], key, keysz);
+    sn = sn_node(pt, t);
+
+    diffbit = ABSVAL(keycmp(key, keysz, sn->sn_key, sn->sn_keysz));
+    if (diffbit == 0) {
+        PT_COUNT(pt, dups);
+        return;     /* duplicate! */
+    }
+
+    p  = h;
+    lk = &sn_node(pt, h)->sn_cld[0];
+    x  = *lk;
+
+    while (NOT SN_UPLINK(pt, p, x) && SN_BIT(pt, x) < (uint32_t)diffbit) {
+        p  = x;
+        sn = sn_node(pt, x);
+        lk = &sn->sn_cld[getbit(key, keysz, sn->sn_bit)];
+        x  = *lk;
+    }
+
+    /* chunks don't move, so lk stays valid */
+    t  = pnpool_alloc(pt, &pt->pt_nodes);
+    sn = sn_node(pt, t);
+
+    sn->sn_key   = key;
+    sn->sn_keysz = keysz;
+    sn->sn_val   = val;
+    sn->sn_bit   = diffbit;
+
+    b = getbit(key, keysz, diffbit);
+    sn->sn_cld[b] = t;
+    sn->sn_cld[OTHER_CLDIDX(b)] = x;
+
+    *lk = t;
+    pt->pt_size++;
+    PT_COUNT(pt, adds);
+
+    if (pnode)
+        *pnode = PIDX2PTR(t);
+}
+
+void *
+sg_get(ptrie_t *pt, void *key, size_t keysz)
+{
+    pidx_t   h = pt->pt_root;
+    snode_t *sn;
+
+    sn = sn_node(pt, sg_search(pt, h, sn_node(pt, h)->sn_cld[0], key, keysz));
+
+    if (keyseq(key, keysz, sn->sn_key, sn->sn_keysz)) {
+        PT_COUNT(pt, hits);
+        return sn->sn_val;
+    }
+
+    PT_COUNT(pt, misses);
+    return NULL;
+}
+
+/***********************************************************###**
+ * Delete key.
+ *
+ * Let x be the node holding key and y the node whose upward
+ * link to x ended the search.
+ *
+ * If y is x, the link is a loop, so x has no other keys in its
+ * subtree below that link: x is replaced by its other child.
+ *
+ * Otherwise y is taken out of the trie by replacing it with its
+ * other child, and y's key moves into x. Then the link which
+ * pointed up to y is pointed at x instead. Since y is below x
+ * that link is still an upward link.
+ *
+ *       pp [1]                    pp [1]
+ *         /   \  ...                /   \  ...
+ *      y [3]   ...   ==>   (y's other)   ...
+ *       /   \__
+ *     ...      `-> x
+ ***********************************************************###*/
+void
+sg_del(ptrie_t *pt, void *key, size_t keysz)
+{
+    pidx_t   h;
+    pidx_t   pp;  /* parent of y */
+    pidx_t   y;
+    pidx_t   x;
+    pidx_t   oc;  /* y's other child */
+    snode_t *sx;
+    snode_t *sy;
+    void    *ykey;
+    size_t   ykeysz;
+
+    h  = pt->pt_root;
+    pp = PN_NIL;
+    y  = h;
+    x  = sn_node(pt, h)->sn_cld[0];
+
+    while (NOT SN_UPLINK(pt, y, x)) {
+        pp = y;
+        y  = x;
+        x  = sn_node(pt, x)->sn_cld[getbit(key, keysz, SN_BIT(pt, x))];
+    }
+
+    sx = sn_node(pt, x);
+    if (NOT keyseq(key, keysz, sx->sn_key, sx->sn_keysz))
+        return;
+
+    if (x == y) {
+        if (x == h) {
+            /* trie is made up of just the head node */
+            pt->pt_root = PN_NIL;
+        } else {
+            oc = sx->sn_cld[OTHER_CLDIDX(getbit(key, keysz, sx->sn_bit))];
+            sg_relink(pt, pp, key, keysz, oc);
+        }
+    } else {
+        sy = sn_node(pt, y);
+        oc = sy->sn_cld[OTHER_CLDIDX(getbit(key, keysz, sy->sn_bit))];
+
+        ykey   = sy->sn_key;
+        ykeysz = sy->sn_keysz;
+
+        sg_relink(pt, pp, key, keysz, oc == y ? x : oc);
+
+        sx->sn_key   = sy->sn_key;
+        sx->sn_keysz = sy->sn_keysz;
+        sx->sn_val   = sy->sn_val;
+
+        if (oc != y) {
+            /* find the upward link to y and point it at x */
+            pp = h;
+            y  = sn_node(pt, h)->sn_cld[0];
+
+            while (NOT SN_UPLINK(pt, pp, y)) {
+                pp = y;
+                y  = sn_node(pt, y)->sn_cld[getbit(ykey, ykeysz, SN_BIT(pt, y))];
+            }
+
+            sg_relink(pt, pp, ykey, ykeysz, x);
+        }
+
+        x = y;
+    }
+
+    pnpool_free(pt, &pt->pt_nodes, x);
+    pt->pt_size--;
+    PT_COUNT(pt, dels);
+}
+
+/***********************************************************###**
+ * Delete the key currently held by pnode
+ ***********************************************************###*/
+void
+sg_del_pnode(ptrie_t *pt, void *pnode)
+{
+    snode_t *sn = sn_node(pt, PTR2PIDX(pnode));
+
+    sg_del(pt, sn->sn_key, sn->sn_keysz);
+}
+
+/***********************************************************###**
+ * Find the subtree whose keys all match prefix up to the first
+ * nbits.
+ *
+ * The handle returned is either a node x, meaning every key
+ * below x, or x|PN_LEAFBIT, meaning just the key held by x.
+ ***********************************************************###*/
+void *
+sg_get_prefix(ptrie_t *pt, void *prefix, size_t pfxsz, size_t nbits)
+{
+    pidx_t   p;
+    pidx_t   x;
+    pidx_t   t;
+    snode_t *sn;
+    int      diffbit;
+
+    p = pt->pt_root;
+    x = sn_node(pt, p)->sn_cld[0];
+
+    while (NOT SN_UPLINK(pt, p, x) && SN_BIT(pt, x) <= nbits) {
+        p = x;
+        x = sn_node(pt, x)->sn_cld[getbit(prefix, pfxsz, SN_BIT(pt, x))];
+    }
+
+    t  = sg_search(pt, p, x, prefix, pfxsz);
+    sn = sn_node(pt, t);
+
+    diffbit = ABSVAL(keycmp(prefix, pfxsz, sn->sn_key, sn->sn_keysz));
+
+    if ((diffbit == 0 || nbits < diffbit) && NOT SN_UPLINK(pt, p, x))
+        return PIDX2PTR(x);
+
+    return PIDX2PTR(t | PN_LEAFBIT);
+}
+
+void
+sg_iter_init(ptrie_t *pt, void *root, ptrie_iter_t *ptit)
+{
+    pidx_t h;
+    pidx_t r;
+
+    if (pt->pt_size == 0 ||
+        pt->pt_root == PN_NIL) {
+        ptit->root = NULL;
+        ptit->pn = NULL;
+        return;
+    }
+
+    if (NOT root) {
+        h = pt->pt_root;
+        r = sn_node(pt, h)->sn_cld[0];
+        root = PIDX2PTR(r == h ? (h | PN_LEAFBIT) : r);
+    }
+
+    ptit->root = root;
+    r = PTR2PIDX(root);
+
+    if (PN_ISLEAF(r))
+        ptit->pn = PIDX2PTR(PN_NUM(r));
+    else
+        ptit->pn = PIDX2PTR(sg_leftmost(pt, r, sn_node(pt, r)->sn_cld[0]));
+}
+
+/***********************************************************###**
+ * Node with the smallest key larger than (if upper is set) or 
+ * not less than key under iteration root, or PN_NIL. A NULL root
+ * is the whole trie.
+ *
+ * As with pn_bound(), search for key to find the first bit d at
+ * which it differs from the key it lands on, then go down the 
+ * same path until a node past bit d or an upward link. If key 
+ * has a 0 at bit d, every key under that link is larger; if not,
+ * the answer is the smallest key under the right link of the 
+ * last node where we went left.
+ ***********************************************************###*/
+pidx_t
+sg_bound(ptrie_t *pt, void *root, void *key, size_t keysz, int upper)
+{
+    pidx_t   h;
+    pidx_t   p;
+    pidx_t   x;
+    pidx_t   lt = PN_NIL;  /* last node where we went left */
+    snode_t *sn;
+    uint32_t bit;
+    int      diffbit;
+    int      b;
+
+    if (pt->pt_size == 0 ||
+        pt->pt_root == PN_NIL) {
+        return PN_NIL;
+    }
+
+    if (NOT root) {
+        h = pt->pt_root;
+        x = sn_node(pt, h)->sn_cld[0];
+        root = PIDX2PTR(x == h ? (h | PN_LEAFBIT) : x);
+    }
+
+    h = PTR2PIDX(root);
+
+    if (PN_ISLEAF(h)) {
+        /* a single key */
+        sn = sn_node(pt, PN_NUM(h));
+        diffbit = keycmp(key, keysz, sn->sn_key, sn->sn_keysz);
+        return diffbit < 0 || (diffbit == 0 && NOT upper) ? PN_NUM(h) : PN_NIL;
+    }
+
+    sn = sn_node(pt, h);
+    x  = sg_search(pt, h, sn->sn_cld[getbit(key, keysz, sn->sn_bit)], key, keysz);
+    sn = sn_node(pt, x);
+
+    diffbit = keycmp(key, keysz, sn->sn_key, sn->sn_keysz);
+    if (diffbit == 0 && NOT upper)
+        return x;
+
+    bit = diffbit ? ABSVAL(diffbit) : UINT32_MAX;
+
+    /* the root is always branched on, as in sg_iter_next() */
+    if (SN_BIT(pt, h) > bit)
+        return diffbit < 0 ? sg_leftmost(pt, h, sn_node(pt, h)->sn_cld[0]) : PN_NIL;
+
+    for (;;) {
+        b = getbit(key, keysz, SN_BIT(pt, h));
+        if (b == 0)
+            lt = h;
+
+        p = h;
+        x = sn_node(pt, h)->sn_cld[b];
+        if (SN_UPLINK(pt, p, x) || SN_BIT(pt, x) > bit)
+            break;
+        h = x;
+    }
+
+    if (diffbit < 0)
+        return sg_leftmost(pt, p, x);
+
+    return lt ? sg_leftmost(pt, lt, sn_node(pt, lt)->sn_cld[1]) : PN_NIL;
+}
+
+/***********************************************************###**
+ * Node with the largest key smaller than key under iteration 
+ * root, or PN_NIL: sg_bound() with left and right swapped.
+ ***********************************************************###*/
+pidx_t
+sg_prev(ptrie_t *pt, void *root, void *key, size_t keysz)
+{
+    pidx_t   h;
+    pidx_t   p;
+    pidx_t   x;
+    pidx_t   rt = PN_NIL;  /* last node where we went right */
+    snode_t *sn;
+    uint32_t bit;
+    int      diffbit;
+    int      b;
+
+    if (pt->pt_size == 0 ||
+        pt->pt_root == PN_NIL) {
+        return PN_NIL;
+    }
+
+    if (NOT root) {
+        h = pt->pt_root;
+        x = sn_node(pt, h)->sn_cld[0];
+        root = PIDX2PTR(x == h ? (h | PN_LEAFBIT) : x);
+    }
+
+    h = PTR2PIDX(root);
+
+    if (PN_ISLEAF(h)) {
+        sn = sn_node(pt, PN_NUM(h));
+        return keycmp(key, keysz, sn->sn_key, sn->sn_keysz) > 0 ? PN_NUM(h) : PN_NIL;
+    }
+
+    sn = sn_node(pt, h);
+    x  = sg_search(pt, h, sn->sn_cld[getbit(key, keysz, sn->sn_bit)], key, keysz);
+    sn = sn_node(pt, x);
+
+    diffbit = keycmp(key, keysz, sn->sn_key, sn->sn_keysz);
+    bit = diffbit ? ABSVAL(diffbit) : UINT32_MAX;
+
+    if (SN_BIT(pt, h) > bit)
+        return diffbit > 0 ? sg_rightmost(pt, h, sn_node(pt, h)->sn_cld[1]) : PN_NIL;
+
+    for (;;) {
+        b = getbit(key, keysz, SN_BIT(pt, h));
+        if (b == 1)
+            rt = h;
+
+        p = h;
+        x = sn_node(pt, h)->sn_cld[b];
+        if (SN_UPLINK(pt, p, x) || SN_BIT(pt, x) > bit)
+            break;
+        h = x;
+    }
+
+    if (diffbit > 0)
+        return sg_rightmost(pt, p, x);
+
+    return rt ? sg_rightmost(pt, rt, sn_node(pt, rt)->sn_cld[0]) : PN_NIL;
+}
+
+/***********************************************************###**
+ * Since nodes have no parent links, the next key is found by
+ * searching for the current key from the root of the iteration
+ * and remembering the last node at which we went left. The next
+ * key is the smallest key under that node's right link.
+ ***********************************************************###*/
+int
+sg_iter_next(ptrie_t *pt, ptrie_iter_t *ptit, void **key, size_t *keysz, void **val)
+{
+    pidx_t   x;
+    pidx_t   h;
+    pidx_t   c;
+    pidx_t   lt;  /* last node where we went left */
+    snode_t *sn;
+    int      b;
+
+    x  = PTR2PIDX(ptit->pn);
+    sn = sn_node(pt, x);
+
+    if (key) *key = sn->sn_key;
+    if (keysz) *keysz = sn->sn_keysz;
+    if (val) *val = sn->sn_val;
+
+    h = PTR2PIDX(ptit->root);
+    if (PN_ISLEAF(h)) {
+        ptit->pn = NULL;
+        return 1;
+    }
+
+    lt = PN_NIL;
+
+    for (;;) {
+        b = getbit(sn->sn_key, sn->sn_keysz, SN_BIT(pt, h));
+        if (b == 0)
+            lt = h;
+
+        c = sn_node(pt, h)->sn_cld[b];
+        if (SN_UPLINK(pt, h, c))
+            break;
+        h = c;
+    }
+
+    if (lt == PN_NIL)
+        ptit->pn = NULL;
+    else
+        ptit->pn = PIDX2PTR(sg_leftmost(pt, lt, sn_node(pt, lt)->sn_cld[1]));
+
+    return 1;
+}
+
+void
+sg_iter_init_reverse(ptrie_t *pt, void *root, ptrie_iter_t *ptit)
+{
+    pidx_t r;
+
+    sg_iter_init(pt, root, ptit);
+    if (NOT ptit->pn)
+        return;
+
+    r = PTR2PIDX(ptit->root);
+
+    if (PN_ISLEAF(r))
+        ptit->pn = PIDX2PTR(PN_NUM(r));
+    else
+        ptit->pn = PIDX2PTR(sg_rightmost(pt, r, sn_node(pt, r)->sn_cld[1]));
+}
+
+/***********************************************************###**
+ * Step back by searching for the key before the current one, 
+ * much as sg_iter_next() searches for the one after it.
+ ***********************************************************###*/
+int
+sg_iter_prev(ptrie_t *pt, ptrie_iter_t *ptit, void **key, size_t *keysz, void **val)
+{
+    snode_t *sn;
+
+    sn = sn_node(pt, PTR2PIDX(ptit->pn));
+
+    if (key) *key = sn->sn_key;
+    if (keysz) *keysz = sn->sn_keysz;
+    if (val) *val = sn->sn_val;
+
+    ptit->pn = PIDX2PTR(sg_prev(pt, ptit->root, sn->sn_key, sn->sn_keysz));
+    return 1;
+}
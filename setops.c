@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2012, Todd Hayton <thayton@neekanee.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Set operations on two tries: ptrie_union(), ptrie_intersect()
+ * and ptrie_diff() change the first trie in place so that it 
+ * holds the union, intersection or difference of the keys of 
+ * both. The second trie isn't changed.
+ *
+ * Both tries are walked together from the root. The shape of a
+ * PATRICIA trie depends only on its keys, so the keys under a 
+ * node share all the bits before its difference bit, and any 
+ * key under it (we take the left-most) tells us what they are.
+ * Comparing that key against one from the other subtree gives 
+ * the first bit d at which the two subtrees can differ:
+ *
+ *  - if d comes before the difference bits of both, no key is
+ *    in both subtrees, and we're done: for a union the subtree
+ *    of the second trie is copied under a new node on bit d, 
+ *    for an intersection the subtree of the first is dropped;
+ *
+ *  - if both nodes branch on the same bit, we pair up their
+ *    children;
+ *
+ *  - otherwise the node with the larger bit lies entirely under
+ *    one child of the other, and only that child goes on.
+ *
+ * So we only go down as far as the tries overlap, and the rest
+ * is copied, dropped or kept as a whole.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "patricia.h"
+#include "patriciaP.h"
+
+#define PSET_UNION     0
+#define PSET_INTERSECT 1
+#define PSET_DIFF      2
+
+/* difference bit of a leaf: past the end of any key */
+#define PSET_LEAFBIT UINT32_MAX
+
+static int      set_check(ptrie_t *pt, ptrie_t *st);
+static pidx_t   set_merge(ptrie_t *pt, pidx_t x, ptrie_t *st, pidx_t y, int op);
+static pidx_t   set_join(ptrie_t *pt, pidx_t x, pidx_t cld0, pidx_t cld1);
+static pidx_t   set_node(ptrie_t *pt, uint32_t bit, pidx_t cld0, pidx_t cld1);
+static pidx_t   set_copy(ptrie_t *pt, ptrie_t *st, pidx_t y);
+static void     set_drop(ptrie_t *pt, pidx_t x);
+static uint32_t set_bit(ptrie_t *pt, pidx_t x);
+static pleaf_t *set_anyleaf(ptrie_t *pt, pidx_t x);
+
+/***********************************************************###**
+ * Add the keys of st that aren't in pt to pt. Where a key is in
+ * both, pt keeps its value. 
+ *
+ * Keys are copied if pt has PTRIE_F_OWNKEYS; otherwise pt points
+ * at the same keys as st, which must then outlive pt. 
+ *
+ * PTRIE_F_SEDGEWICK, PTRIE_F_CONCURRENT, PTRIE_F_PERSISTENT and
+ * route prefix tries aren't supported. Returns 0, or -1 with 
+ * errno set.
+ ***********************************************************###*/
+int
+ptrie_union(ptrie_t *pt, ptrie_t *st)
+{
+    pidx_t x;
+
+    if (set_check(pt, st) < 0)
+        return -1;
+
+    x = set_merge(pt, pt->pt_root, st, st->pt_root, PSET_UNION);
+    if (x != PN_NIL)
+        pn_setparent(pt, x, PN_NIL);
+    pt->pt_root = x;
+
+    return 0;
+}
+
+/***********************************************************###**
+ * Remove the keys of pt that aren't in st
+ ***********************************************************###*/
+int
+ptrie_intersect(ptrie_t *pt, ptrie_t *st)
+{
+    pidx_t x;
+
+    if (set_check(pt, st) < 0)
+        return -1;
+
+    x = set_merge(pt, pt->pt_root, st, st->pt_root, PSET_INTERSECT);
+    if (x != PN_NIL)
+        pn_setparent(pt, x, PN_NIL);
+    pt->pt_root = x;
+
+    return 0;
+}
+
+/***********************************************************###**
+ * Remove the keys of pt that are in st
+ ***********************************************************###*/
+int
+ptrie_diff(ptrie_t *pt, ptrie_t *st)
+{
+    pidx_t x;
+
+    if (set_check(pt, st) < 0)
+        return -1;
+
+    x = set_merge(pt, pt->pt_root, st, st->pt_root, PSET_DIFF);
+    if (x != PN_NIL)
+        pn_setparent(pt, x, PN_NIL);
+    pt->pt_root = x;
+
+    return 0;
+}
+
+static int
+set_check(ptrie_t *pt, ptrie_t *st)
+{
+    uint32_t flags = PTRIE_F_SEDGEWICK | PTRIE_F_CONCURRENT | 
+                     PTRIE_F_PERSISTENT | PTF_PREFIX;
+
+    if (pt == st || (pt->pt_flags & flags) || (st->pt_flags & flags)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Combine subtree x of pt with subtree y of st, returning the 
+ * subtree of pt that replaces x. Nodes of x that aren't in the 
+ * result are freed. The caller sets the parent of the result.
+ */
+static pidx_t
+set_merge(ptrie_t *pt, pidx_t x, ptrie_t *st, pidx_t y, int op)
+{
+    pnode_t *pn;
+    pnode_t *qn;
+    pleaf_t *pl;
+    pleaf_t *ql;
+    uint32_t xbit;
+    uint32_t ybit;
+    uint32_t d;
+    pidx_t   cld[2];
+    int      diffbit;
+    int      c;
+
+    if (y == PN_NIL) {
+        if (op == PSET_INTERSECT && x != PN_NIL) {
+            set_drop(pt, x);
+            return PN_NIL;
+        }
+        return x;
+    } else if (x == PN_NIL) {
+        return op == PSET_UNION ? set_copy(pt, st, y) : PN_NIL;
+    }
+
+    xbit = set_bit(pt, x);
+    ybit = set_bit(st, y);
+
+    pl = set_anyleaf(pt, x);
+    ql = set_anyleaf(st, y);
+    diffbit = keycmp(pl->pl_key, pl->pl_keysz, ql->pl_key, ql->pl_keysz);
+    d = diffbit ? ABSVAL(diffbit) : PSET_LEAFBIT;
+
+    if (d < xbit && d < ybit) {
+        /* no key in common */
+        switch (op) {
+        case PSET_UNION:
+            return diffbit < 0 ? set_node(pt, d, x, set_copy(pt, st, y)) :
+                                 set_node(pt, d, set_copy(pt, st, y), x);
+        case PSET_INTERSECT:
+            set_drop(pt, x);
+            return PN_NIL;
+        default:
+            return x;
+        }
+    }
+
+    if (xbit == ybit) {
+        if (PN_ISLEAF(x)) {
+            /* same key */
+            if (op == PSET_DIFF) {
+                set_drop(pt, x);
+                return PN_NIL;
+            }
+            return x;
+        }
+
+        pn = pn_node(pt, x);
+        qn = pn_node(st, y);
+        cld[0] = set_merge(pt, pn->pn_cld[0], st, qn->pn_cld[0], op);
+        cld[1] = set_merge(pt, pn->pn_cld[1], st, qn->pn_cld[1], op);
+
+        return set_join(pt, x, cld[0], cld[1]);
+    }
+
+    if (xbit < ybit) {
+        /* y is under one child of x */
+        pn = pn_node(pt, x);
+        c = getbit(ql->pl_key, ql->pl_keysz, xbit);
+
+        cld[c] = set_merge(pt, pn->pn_cld[c], st, y, op);
+        cld[OTHER_CLDIDX(c)] = pn->pn_cld[OTHER_CLDIDX(c)];
+        if (op == PSET_INTERSECT) {
+            set_drop(pt, cld[OTHER_CLDIDX(c)]);
+            cld[OTHER_CLDIDX(c)] = PN_NIL;
+        }
+
+        return set_join(pt, x, cld[0], cld[1]);
+    }
+
+    /* x is under one child of y */
+    qn = pn_node(st, y);
+    c = getbit(pl->pl_key, pl->pl_keysz, ybit);
+
+    if (op != PSET_UNION)
+        return set_merge(pt, x, st, qn->pn_cld[c], op);
+
+    cld[c] = set_merge(pt, x, st, qn->pn_cld[c], op);
+    cld[OTHER_CLDIDX(c)] = set_copy(pt, st, qn->pn_cld[OTHER_CLDIDX(c)]);
+
+    return set_node(pt, ybit, cld[0], cld[1]);
+}
+
+/*
+ * Give internal node x the children cld0 and cld1. If either is
+ * PN_NIL, x is no longer needed and the other takes its place.
+ */
+static pidx_t
+set_join(ptrie_t *pt, pidx_t x, pidx_t cld0, pidx_t cld1)
+{
+    pnode_t *pn;
+
+    if (cld0 == PN_NIL || cld1 == PN_NIL) {
+        pnpool_free(pt, &pt->pt_nodes, x);
+        return cld0 == PN_NIL ? cld1 : cld0;
+    }
+
+    pn = pn_node(pt, x);
+    pn->pn_cld[0] = cld0;
+    pn->pn_cld[1] = cld1;
+    pn_setparent(pt, cld0, x);
+    pn_setparent(pt, cld1, x);
+
+    if (pt->pt_flags & PTRIE_F_COUNTS)
+        pn_count_set(pt, x);
+
+    return x;
+}
+
+static pidx_t
+set_node(ptrie_t *pt, uint32_t bit, pidx_t cld0, pidx_t cld1)
+{
+    pidx_t   x = pnpool_alloc(pt, &pt->pt_nodes);
+    pnode_t *pn = pn_node(pt, x);
+
+    pn->pn_bit = bit;
+    pn->pn_cld[0] = cld0;
+    pn->pn_cld[1] = cld1;
+    pn_setparent(pt, cld0, x);
+    pn_setparent(pt, cld1, x);
+
+    if (pt->pt_flags & PTRIE_F_COUNTS)
+        pn_count_set(pt, x);
+
+    return x;
+}
+
+/*
+ * Copy subtree y of st into pt
+ */
+static pidx_t
+set_copy(ptrie_t *pt, ptrie_t *st, pidx_t y)
+{
+    pleaf_t *ql;
+    pnode_t *qn;
+    pidx_t   cld0;
+    pidx_t   cld1;
+
+    if (PN_ISLEAF(y)) {
+        ql = pn_leaf(st, y);
+        pt->pt_size++;
+        return newcld(pt, ql->pl_key, ql->pl_keysz, ql->pl_val);
+    }
+
+    qn = pn_node(st, y);
+    cld0 = set_copy(pt, st, qn->pn_cld[0]);
+    cld1 = set_copy(pt, st, qn->pn_cld[1]);
+
+    return set_node(pt, qn->pn_bit, cld0, cld1);
+}
+
+/*
+ * Free subtree x of pt
+ */
+static void
+set_drop(ptrie_t *pt, pidx_t x)
+{
+    pnode_t *pn;
+
+    if (PN_ISLEAF(x)) {
+        pleaf_release(pt, x);
+        pt->pt_size--;
+        return;
+    }
+
+    pn = pn_node(pt, x);
+    set_drop(pt, pn->pn_cld[0]);
+    set_drop(pt, pn->pn_cld[1]);
+    pnpool_free(pt, &pt->pt_nodes, x);
+}
+
+static uint32_t
+set_bit(ptrie_t *pt, pidx_t x)
+{
+    return PN_ISLEAF(x) ? PSET_LEAFBIT : pn_node(pt, x)->pn_bit;
+}
+
+/*
+ * A leaf of subtree x: its key has the bits that all keys under
+ * x share
+ */
+static pleaf_t *
+set_anyleaf(ptrie_t *pt, pidx_t x)
+{
+    return pn_leaf(pt, pn_leftmost(pt, x));
+}
@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2012, Todd Hayton <thayton@neekanee.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Sharded tries: the key space is split on 'nbits' bits of the
+ * key into 2^nbits independent tries, each with its own lock and
+ * its own node pools, so writers working on different shards 
+ * never touch the same lock, freelist or cache lines.
+ *
+ * The shard bits are the leading bits of the key by default. Keys
+ * that all start the same way (eg. ASCII strings, whose first bit
+ * is always 0) can skip over the bits they share with 'offset'.
+ *
+ * Within a shard, readers share a read lock and writers take the
+ * write lock. Iteration merges the shards back into key order,
+ * and takes no locks, so writers have to be stopped while an 
+ * iteration is in progress.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "patricia.h"
+#include "patriciaP.h"
+
+#define PS_CACHELINE 64
+
+typedef struct pshard {
+    pthread_rwlock_t sh_lock;
+    ptrie_t         *sh_ptrie;
+} __attribute__((aligned(PS_CACHELINE))) pshard_t;
+
+struct ptrie_sharded {
+    pshard_t  *ps_shards;
+    uint32_t   ps_nshards;
+    uint32_t   ps_offset;  /* bits skipped before the shard bits */
+    uint32_t   ps_nbits;   /* shard bits */
+
+    size_t     ps_keysz;
+    size_t   (*ps_keysz_func)(void *key);
+};
+
+static size_t   ps_keysize(ptrie_sharded_t *ps, void *key);
+static uint32_t ps_shard(ptrie_sharded_t *ps, void *key, size_t keysz);
+static int      ps_iter_fill(ptrie_sharded_t *ps, ptrie_sharded_iter_t *it, int s);
+static int      ps_heap_less(ptrie_sharded_iter_t *it, int a, int b);
+static void     ps_heap_push(ptrie_sharded_iter_t *it, int s);
+static void     ps_heap_down(ptrie_sharded_iter_t *it);
+
+/***********************************************************###**
+ * Create a trie split into 2^nbits shards on bits offset+1 to 
+ * offset+nbits of the key. Each shard is created with 
+ * ptrie_new2(flags).
+ *
+ * Returns NULL with errno set to EINVAL if nbits is more than
+ * PTRIE_SHARDS_MAXBITS or the flags are unsupported.
+ ***********************************************************###*/
+ptrie_sharded_t *
+ptrie_sharded_new(uint32_t flags, int offset, int nbits)
+{
+    ptrie_sharded_t *ps;
+    uint32_t         s;
+
+    if (offset < 0 || nbits < 0 || nbits > PTRIE_SHARDS_MAXBITS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ((ps = malloc(sizeof(*ps))) == NULL) {
+        fprintf(stderr, "ptrie_sharded_new - out of memory\n");
+        exit(1);
+    }
+
+    ps->ps_nshards = 1 << nbits;
+    ps->ps_offset = offset;
+    ps->ps_nbits = nbits;
+    ps->ps_keysz = 0;
+    ps->ps_keysz_func = (size_t (*)(void *))strlen;
+
+    if (posix_memalign((void **)&ps->ps_shards, PS_CACHELINE, 
+                       ps->ps_nshards * sizeof(pshard_t)) != 0) {
+        fprintf(stderr, "ptrie_sharded_new - out of memory\n");
+        exit(1);
+    }
+
+    for (s = 0; s < ps->ps_nshards; s++) {
+        if ((ps->ps_shards[s].sh_ptrie = ptrie_new2(flags)) == NULL)
+            break;
+        pthread_rwlock_init(&ps->ps_shards[s].sh_lock, NULL);
+    }
+
+    if (s < ps->ps_nshards) {
+        ps->ps_nshards = s;
+        ptrie_sharded_free(ps);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return ps;
+}
+
+/***********************************************************###**
+ * Free all shards. Keys and values aren't freed.
+ ***********************************************************###*/
+void
+ptrie_sharded_free(ptrie_sharded_t *ps)
+{
+    uint32_t s;
+
+    if (NOT ps)
+        return;
+
+    for (s = 0; s < ps->ps_nshards; s++) {
+        pthread_rwlock_destroy(&ps->ps_shards[s].sh_lock);
+        ptrie_free(ps->ps_shards[s].sh_ptrie);
+    }
+
+    free(ps->ps_shards);
+    free(ps);
+}
+
+/***********************************************************###**
+ * Set a parameter on every shard. Must be called before any keys
+ * are added.
+ ***********************************************************###*/
+void
+ptrie_sharded_set_parm(ptrie_sharded_t *ps, uint32_t parm, void *value)
+{
+    uint32_t s;
+
+    for (s = 0; s < ps->ps_nshards; s++)
+        ptrie_set_parm(ps->ps_shards[s].sh_ptrie, parm, value);
+
+    if (parm == PTRIEPARM_KEYSZ)
+        ps->ps_keysz = (size_t) value;
+    else if (parm == PTRIEPARM_KEYSZ_FUNC)
+        ps->ps_keysz_func = (size_t (*)(void *)) value;
+}
+
+void
+ptrie_sharded_add(ptrie_sharded_t *ps, void *key, void *val)
+{
+    pshard_t *sh;
+
+    sh = &ps->ps_shards[ps_shard(ps, key, ps_keysize(ps, key))];
+
+    pthread_rwlock_wrlock(&sh->sh_lock);
+    ptrie_add(sh->sh_ptrie, key, val);
+    pthread_rwlock_unlock(&sh->sh_lock);
+}
+
+void *
+ptrie_sharded_get(ptrie_sharded_t *ps, void *key)
+{
+    pshard_t *sh;
+    void     *val;
+
+    sh = &ps->ps_shards[ps_shard(ps, key, ps_keysize(ps, key))];
+
+    pthread_rwlock_rdlock(&sh->sh_lock);
+    val = ptrie_get(sh->sh_ptrie, key);
+    pthread_rwlock_unlock(&sh->sh_lock);
+
+    return val;
+}
+
+void
+ptrie_sharded_del(ptrie_sharded_t *ps, void *key)
+{
+    pshard_t *sh;
+
+    sh = &ps->ps_shards[ps_shard(ps, key, ps_keysize(ps, key))];
+
+    pthread_rwlock_wrlock(&sh->sh_lock);
+    ptrie_del(sh->sh_ptrie, key);
+    pthread_rwlock_unlock(&sh->sh_lock);
+}
+
+int
+ptrie_sharded_size(ptrie_sharded_t *ps)
+{
+    uint32_t s;
+    int      size = 0;
+
+    for (s = 0; s < ps->ps_nshards; s++) {
+        pthread_rwlock_rdlock(&ps->ps_shards[s].sh_lock);
+        size += ptrie_size(ps->ps_shards[s].sh_ptrie);
+        pthread_rwlock_unlock(&ps->ps_shards[s].sh_lock);
+    }
+
+    return size;
+}
+
+/***********************************************************###**
+ * Start iterating over the keys that match the first nbits of
+ * prefix, or over all keys if prefix is NULL.
+ *
+ * If the prefix covers the shard bits only one shard is visited,
+ * otherwise the matching subtree of every shard is, and the
+ * shards are merged on a heap ordered by their next key.
+ ***********************************************************###*/
+void
+ptrie_sharded_iter_init(ptrie_sharded_t *ps, void *prefix, size_t nbits, 
+                        ptrie_sharded_iter_t *it)
+{
+    ptrie_t *pt;
+    void    *root;
+    uint32_t s;
+    uint32_t first = 0;
+    uint32_t last = ps->ps_nshards;
+
+    it->nheap = 0;
+
+    if (prefix && nbits >= ps->ps_offset + ps->ps_nbits) {
+        first = ps_shard(ps, prefix, ps_keysize(ps, prefix));
+        last = first + 1;
+    }
+
+    for (s = first; s < last; s++) {
+        pt = ps->ps_shards[s].sh_ptrie;
+        if (ptrie_size(pt) == 0)
+            continue;
+
+        root = prefix ? ptrie_get_prefix(pt, prefix, nbits) : NULL;
+        if (prefix && NOT root)
+            continue;
+
+        ptrie_iter_init(pt, root, &it->iter[s]);
+        if (NOT ps_iter_fill(ps, it, s))
+            continue;
+
+        /* 
+         * ptrie_get_prefix() returns the closest key when no key 
+         * matches, so check that the subtree really matches 
+         */
+        if (prefix) {
+            int diffbit = keycmp(it->key[s], it->keysz[s], prefix, ps_keysize(ps, prefix));
+            if (diffbit && (size_t)abs(diffbit) <= nbits)
+                continue;
+        }
+
+        ps_heap_push(it, s);
+    }
+}
+
+int
+ptrie_sharded_iter_next(ptrie_sharded_t *ps, ptrie_sharded_iter_t *it, 
+                        void **key, void **val)
+{
+    int s;
+
+    if (it->nheap == 0)
+        return 0;
+
+    s = it->heap[0];
+
+    if (key) *key = it->key[s];
+    if (val) *val = it->val[s];
+
+    if (ps_iter_fill(ps, it, s)) {
+        ps_heap_down(it);
+    } else {
+        it->heap[0] = it->heap[--it->nheap];
+        ps_heap_down(it);
+    }
+
+    return 1;
+}
+
+static size_t
+ps_keysize(ptrie_sharded_t *ps, void *key)
+{
+    if (ps->ps_keysz)
+        return ps->ps_keysz;
+    return (*ps->ps_keysz_func)(key);
+}
+
+/*
+ * Shard that key belongs to: bits offset+1 to offset+nbits
+ */
+static uint32_t
+ps_shard(ptrie_sharded_t *ps, void *key, size_t keysz)
+{
+    uint32_t s = 0;
+    uint32_t b;
+
+    for (b = 1; b <= ps->ps_nbits; b++)
+        s = (s << 1) | getbit(key, keysz, ps->ps_offset + b);
+
+    return s;
+}
+
+/*
+ * Load the next key of shard s into the iterator. Returns 0 if
+ * the shard has no more keys.
+ */
+static int
+ps_iter_fill(ptrie_sharded_t *ps, ptrie_sharded_iter_t *it, int s)
+{
+    ptrie_t *pt = ps->ps_shards[s].sh_ptrie;
+
+    if (NOT ptrie_iter_next(pt, &it->iter[s], &it->key[s], &it->val[s]))
+        return 0;
+
+    it->keysz[s] = ps_keysize(ps, it->key[s]);
+    return 1;
+}
+
+static int
+ps_heap_less(ptrie_sharded_iter_t *it, int a, int b)
+{
+    return keycmp(it->key[a], it->keysz[a], it->key[b], it->keysz[b]) < 0;
+}
+
+static void
+ps_heap_push(ptrie_sharded_iter_t *it, int s)
+{
+    int i = it->nheap++;
+    int p;
+
+    for (; i > 0; i = p) {
+        p = (i - 1) / 2;
+        if (NOT ps_heap_less(it, s, it->heap[p]))
+            break;
+        it->heap[i] = it->heap[p];
+    }
+
+    it->heap[i] = s;
+}
+
+/*
+ * Move the shard at the top of the heap down to its place
+ */
+static void
+ps_heap_down(ptrie_sharded_iter_t *it)
+{
+    int s;
+    int i = 0;
+    int c;
+
+    if (it->nheap == 0)
+        return;
+
+    s = it->heap[0];
+
+    while ((c = 2 * i + 1) < it->nheap) {
+        if (c + 1 < it->nheap && ps_heap_less(it, it->heap[c + 1], it->heap[c]))
+            c++;
+        if (NOT ps_heap_less(it, it->heap[c], s))
+            break;
+        it->heap[i] = it->heap[c];
+        i = c;
+    }
+
+    it->heap[i] = s;
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2012, Todd Hayton <thayton@neekanee.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * ptrie_stats(): the shape of a trie and the memory it holds.
+ *
+ * The depth of a key is the number of bits its lookup tests, 
+ * i.e. the number of internal nodes between the root and its 
+ * leaf (Sedgewick tries: the number of downward links followed).
+ * The depth histogram and key sizes come from a walk over the
+ * whole trie, so the cost is proportional to its size.
+ *
+ * The operation counters are kept by the lookup, add and delete
+ * paths when the library is built with -DPTRIE_STATS; otherwise
+ * PT_COUNT() compiles to nothing and the counters read as zero.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "patricia.h"
+#include "patriciaP.h"
+
+typedef struct pstwalk {
+    ptrie_stats_t *sw_st;
+    uint64_t       sw_depths; /* sum of key depths */
+    uint64_t       sw_bytes;  /* sum of key sizes */
+} pstwalk_t;
+
+static void stats_key(pstwalk_t *sw, size_t keysz, int depth);
+static void stats_walk(ptrie_t *pt, pstwalk_t *sw, pidx_t x, int depth);
+static void stats_sgwalk(ptrie_t *pt, pstwalk_t *sw, pidx_t p, pidx_t x, int depth);
+
+/***********************************************************###**
+ * Fill in st. Must not run while the trie is being changed.
+ ***********************************************************###*/
+void
+ptrie_stats(ptrie_t *pt, ptrie_stats_t *st)
+{
+    pstwalk_t sw;
+    pidx_t    h;
+    size_t    nkeys;
+
+    memset(st, 0, sizeof(*st));
+    memset(&sw, 0, sizeof(sw));
+    sw.sw_st = st;
+
+    if (pt->pt_root != PN_NIL) {
+        if (pt->pt_flags & PTRIE_F_SEDGEWICK) {
+            h = pt->pt_root;
+            stats_sgwalk(pt, &sw, h, sn_node(pt, h)->sn_cld[0], 0);
+            st->nodes = pt->pt_size;
+        } else {
+            stats_walk(pt, &sw, pt->pt_root, 0);
+        }
+    }
+
+    nkeys = pt->pt_size;
+    if (nkeys) {
+        st->avgdepth = (double)sw.sw_depths / nkeys;
+        st->avgkeysz = (double)sw.sw_bytes / nkeys;
+    }
+
+    pnpool_stats(&pt->pt_nodes, &st->freelist, &st->bytes);
+    pnpool_stats(&pt->pt_leaves, &st->freelist, &st->bytes);
+    st->bytes += pkey_bytes(pt);
+
+    if (pt->pt_cache)
+        pcache_stats(pt, st);
+
+#ifdef PTRIE_STATS
+    st->counts = pt->pt_counts;
+#endif
+}
+
+static void
+stats_key(pstwalk_t *sw, size_t keysz, int depth)
+{
+    ptrie_stats_t *st = sw->sw_st;
+    int            i;
+
+    st->depth[depth < PTRIE_STATS_DEPTHS ? depth : PTRIE_STATS_DEPTHS - 1]++;
+    if (depth > st->maxdepth)
+        st->maxdepth = depth;
+
+    for (i = 0; i < PTRIE_STATS_KEYSZS - 1 && (keysz >> (i + 1)); i++)
+        ;
+    st->keysz[i]++;
+    if (keysz > st->maxkeysz)
+        st->maxkeysz = keysz;
+
+    sw->sw_depths += depth;
+    sw->sw_bytes += keysz;
+}
+
+static void
+stats_walk(ptrie_t *pt, pstwalk_t *sw, pidx_t x, int depth)
+{
+    pnode_t *pn;
+
+    if (PN_ISLEAF(x)) {
+        sw->sw_st->leaves++;
+        stats_key(sw, pn_leaf(pt, x)->pl_keysz, depth);
+        return;
+    }
+
+    pn = pn_node(pt, x);
+    sw->sw_st->nodes++;
+
+    stats_walk(pt, sw, pn->pn_cld[0], depth + 1);
+    stats_walk(pt, sw, pn->pn_cld[1], depth + 1);
+}
+
+/*
+ * Every key is reached by exactly one upward link, and the keys
+ * below x were found after testing the bits of the nodes on the
+ * way down to it.
+ */
+static void
+stats_sgwalk(ptrie_t *pt, pstwalk_t *sw, pidx_t p, pidx_t x, int depth)
+{
+    snode_t *sn = sn_node(pt, x);
+
+    if (sn->sn_bit <= sn_node(pt, p)->sn_bit) {
+        stats_key(sw, sn->sn_keysz, depth);
+        return;
+    }
+
+    stats_sgwalk(pt, sw, x, sn->sn_cld[0], depth + 1);
+    stats_sgwalk(pt, sw, x, sn->sn_cld[1], depth + 1);
+}
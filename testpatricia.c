@@ -32,6 +32,8 @@
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -44,6 +46,30 @@ static void test_3(void);
 static void test_4(void);
 static void test_5(void);
 static void test_6(void);
+static void test_7(void);
+static void test_8(void);
+static void test_9(void);
+static void test_10(void);
+static void test_11(void);
+static void test_12(void);
+static void test_13(void);
+static void test_14(void);
+static void test_15(void);
+static void test_16(void);
+static void test_17(void);
+static void test_18(void);
+static void test_19(void);
+static void test_20(void);
+static void test_21(void);
+static void test_22(void);
+static void test_23(void);
+static void test_24(void);
+static void test_25(void);
+static void test_26(void);
+static void test_27(void);
+static void test_28(void);
+static void test_29(void);
+static void test_23_count(void *key, void *val, void *arg);
 
 int main(int argc, char **argv)
 {
@@ -54,6 +80,29 @@ int main(int argc, char **argv)
     test_4();
     test_5();
     test_6();
+    test_7();
+    test_8();
+    test_9();
+    test_10();
+    test_11();
+    test_12();
+    test_13();
+    test_14();
+    test_15();
+    test_16();
+    test_17();
+    test_18();
+    test_19();
+    test_20();
+    test_21();
+    test_22();
+    test_23();
+    test_24();
+    test_25();
+    test_26();
+    test_27();
+    test_28();
+    test_29();
 
     exit(0);
 }
@@ -377,3 +426,1369 @@ test_6(void)
     }
 
 }
+
+void
+test_7(void)
+{
+    ptrie_t        *ptrie;
+    struct in_addr  addr;
+    char           *val;
+    struct route {
+        char *net;
+        int   nbits;
+        char *str;
+    } *rt, routes[] = {
+        { "0.0.0.0",     0,  "default" },
+        { "10.0.0.0",    8,  "10/8" },
+        { "10.1.0.0",    16, "10.1/16" },
+        { "10.1.2.0",    24, "10.1.2/24" },
+        { "10.0.0.0",    16, "10.0/16" },
+        { "192.168.0.0", 16, "192.168/16" },
+        { "192.168.2.1", 32, "192.168.2.1/32" },
+        { 0, 0, 0 }
+    };
+    char *lookups[] = {
+        "10.1.2.3", "10.1.3.3", "10.2.0.1", "10.0.0.1", "192.168.2.1",
+        "192.168.2.2", "172.16.0.1", 0
+    }, **lk;
+
+    fprintf(stderr, "\ntest_7\n");
+
+    ptrie = ptrie_new();
+    ptrie_set_parm(ptrie, PTRIEPARM_KEYSZ, (void *)sizeof(struct in_addr));
+
+    for (rt = routes; rt->net; rt++) {
+        addr.s_addr = inet_addr(rt->net);
+        ptrie_add_prefix(ptrie, &addr, rt->nbits, rt->str);
+    }
+
+    for (lk = lookups; *lk; lk++) {
+        addr.s_addr = inet_addr(*lk);
+        val = ptrie_lpm(ptrie, &addr);
+        fprintf(stderr, "ptrie_lpm(%s) => %s\n", *lk, val ? val : "(none)");
+    }
+
+    fprintf(stderr, "deleting 10.1/16 and default\n");
+
+    addr.s_addr = inet_addr("10.1.0.0");
+    ptrie_del_prefix(ptrie, &addr, 16);
+    addr.s_addr = inet_addr("0.0.0.0");
+    ptrie_del_prefix(ptrie, &addr, 0);
+
+    for (lk = lookups; *lk; lk++) {
+        addr.s_addr = inet_addr(*lk);
+        val = ptrie_lpm(ptrie, &addr);
+        fprintf(stderr, "ptrie_lpm(%s) => %s\n", *lk, val ? val : "(none)");
+    }
+
+    ptrie_free(ptrie);
+
+    /* prefixes don't mix with plain keys, or with Sedgewick tries */
+    ptrie = ptrie_new();
+    ptrie_set_parm(ptrie, PTRIEPARM_KEYSZ, (void *)sizeof(struct in_addr));
+    addr.s_addr = inet_addr("10.1.2.3");
+    ptrie_add(ptrie, &addr, "10.1.2.3");
+    errno = 0;
+    fprintf(stderr, "ptrie_add_prefix(plain trie) => %d", ptrie_add_prefix(ptrie, &addr, 16, "10.1/16"));
+    fprintf(stderr, " (%s)\n", errno == EINVAL ? "EINVAL" : "no error");
+    ptrie_free(ptrie);
+
+    ptrie = ptrie_new();
+    ptrie_set_parm(ptrie, PTRIEPARM_KEYSZ, (void *)sizeof(struct in_addr));
+    addr.s_addr = inet_addr("10.0.0.0");
+    ptrie_add_prefix(ptrie, &addr, 8, "10/8");
+    addr.s_addr = inet_addr("10.1.0.0");
+    ptrie_add(ptrie, &addr, "10.1.0.0");
+    addr.s_addr = inet_addr("10.0.0.0");
+    ptrie_del(ptrie, &addr);
+    addr.s_addr = inet_addr("10.1.2.3");
+    val = ptrie_lpm(ptrie, &addr);
+    fprintf(stderr, "ptrie_add/ptrie_del(prefix trie): size %d, ptrie_lpm(10.1.2.3) => %s\n",
+            ptrie_size(ptrie), val ? val : "(none)");
+    ptrie_free(ptrie);
+
+    ptrie = ptrie_new2(PTRIE_F_SEDGEWICK);
+    ptrie_set_parm(ptrie, PTRIEPARM_KEYSZ, (void *)sizeof(struct in_addr));
+    errno = 0;
+    fprintf(stderr, "ptrie_add_prefix(sedgewick) => %d", ptrie_add_prefix(ptrie, &addr, 16, "10.1/16"));
+    fprintf(stderr, " (%s)\n", errno == EINVAL ? "EINVAL" : "no error");
+    ptrie_free(ptrie);
+}
+
+void
+test_8(void)
+{
+    ptrie_t        *ptrie;
+    struct in_addr  addrs[4];
+    void           *keys[8];
+    void           *vals[8];
+    int             i;
+    int             n;
+    char           *strs[] = {
+        "0001", "0010", "0100", "0011", "1000", "0110", "1111", "0000"
+    };
+
+    fprintf(stderr, "\ntest_8\n");
+
+    ptrie = ptrie_new();
+    ptrie_add(ptrie, "0001", "one");
+    ptrie_add(ptrie, "0010", "two");
+    ptrie_add(ptrie, "0011", "three");
+    ptrie_add(ptrie, "0100", "four");
+    ptrie_add(ptrie, "0110", "six");
+
+    for (i = 0; i < 8; i++)
+        keys[i] = strs[i];
+
+    n = ptrie_get_batch(ptrie, keys, 8, vals);
+    fprintf(stderr, "ptrie_get_batch found %d\n", n);
+
+    for (i = 0; i < 8; i++)
+        fprintf(stderr, "%s => %s\n", strs[i], vals[i] ? (char *)vals[i] : "(none)");
+
+    ptrie = ptrie_new();
+    ptrie_set_parm(ptrie, PTRIEPARM_KEYSZ, (void *)sizeof(struct in_addr));
+
+    addrs[0].s_addr = inet_addr("10.0.0.0");
+    ptrie_add_prefix(ptrie, &addrs[0], 8, "10/8");
+    addrs[0].s_addr = inet_addr("10.1.0.0");
+    ptrie_add_prefix(ptrie, &addrs[0], 16, "10.1/16");
+
+    addrs[0].s_addr = inet_addr("10.1.1.1");
+    addrs[1].s_addr = inet_addr("10.2.1.1");
+    addrs[2].s_addr = inet_addr("11.1.1.1");
+    addrs[3].s_addr = inet_addr("10.1.255.255");
+
+    for (i = 0; i < 4; i++)
+        keys[i] = &addrs[i];
+
+    n = ptrie_lpm_batch(ptrie, keys, 4, vals);
+    fprintf(stderr, "ptrie_lpm_batch matched %d\n", n);
+
+    for (i = 0; i < 4; i++)
+        fprintf(stderr, "%s => %s\n", inet_ntoa(addrs[i]), vals[i] ? (char *)vals[i] : "(none)");
+}
+
+void
+test_9(void)
+{
+    ptrie_t *ptrie;
+    char    *key;
+    char    *val;
+    char    *pfx = "http://www.example.com/products/";
+    char    *urls[] = {
+        "http://www.example.com/products/widgets/blue-widget.html",
+        "http://www.example.com/products/widgets/red-widget.html",
+        "http://www.example.com/products/gadgets/index.html",
+        "http://www.example.com/about/company/history.html",
+        "http://www.example.com/products/widgets/blue-widget.htm",
+        0
+    }, **url;
+
+    fprintf(stderr, "\ntest_9\n");
+
+    ptrie = ptrie_new();
+
+    for (url = urls; *url; url++)
+        ptrie_add(ptrie, *url, *url);
+
+    foreach_ptrie_key(ptrie, 0, &key) {
+        fprintf(stderr, "%s\n", key);
+    }
+
+    fprintf(stderr, "urls with prefix \"%s\"\n", pfx);
+
+    foreach_ptrie_key_with_prefix(ptrie, 0, pfx, strlen(pfx)*8, &key) {
+        fprintf(stderr, "%s\n", key);
+    }
+
+    for (url = urls; *url; url++) {
+        val = ptrie_get(ptrie, *url);
+        fprintf(stderr, "ptrie_get(%s) => %s\n", *url, val == *url ? "ok" : "MISMATCH");
+    }
+}
+
+void
+test_10(void)
+{
+    ptrie_t *ptrie;
+    char    *key;
+    char    *val;
+
+    fprintf(stderr, "\ntest_10\n");
+
+    ptrie = ptrie_new2(PTRIE_F_SEDGEWICK);
+    ptrie_add(ptrie, "a", "1");
+    ptrie_add(ptrie, "aa", "2");
+    ptrie_add(ptrie, "ab", "3");
+    ptrie_add(ptrie, "aac", "4");
+    ptrie_add(ptrie, "aac1", "5");
+    ptrie_add(ptrie, "aac2", "6");
+    ptrie_add(ptrie, "aac3", "7");
+    ptrie_add(ptrie, "b", "8");
+    ptrie_add(ptrie, "c", "9");
+
+    foreach_ptrie_keyval(ptrie, 0, &key, &val) {
+        fprintf(stderr, "%s => %s\n", key, val);
+    }
+
+    fprintf(stderr, "strings with prefix \"aac\"\n");
+
+    foreach_ptrie_key_with_prefix(ptrie, 0, "aac", strlen("aac")*8, &key) {
+        fprintf(stderr, "%s\n", key);        
+    }
+
+    fprintf(stderr, "deleting aa, aac2 and c\n");
+    ptrie_del(ptrie, "aa");
+    ptrie_del(ptrie, "aac2");
+    ptrie_del(ptrie, "c");
+
+    foreach_ptrie_keyval(ptrie, 0, &key, &val) {
+        fprintf(stderr, "%s => %s\n", key, val);
+    }
+
+    val = ptrie_get(ptrie, "aac3");
+    fprintf(stderr, "ptrie_get(aac3) => %s\n", val);
+    val = ptrie_get(ptrie, "aac2");
+    fprintf(stderr, "ptrie_get(aac2) => %s\n", val ? val : "(none)");
+}
+
+static void
+test_11(void)
+{
+    ptrie_t *ptrie;
+    char     keys[5000][8];
+    char    *key;
+    char    *val;
+    size_t   nbytes;
+    int      round;
+    int      i;
+    int      n;
+
+    fprintf(stderr, "\ntest_11\n");
+
+    ptrie = ptrie_new();
+
+    for (i = 0; i < 5000; i++)
+        sprintf(keys[i], "k%05d", i);
+
+    /* rebuild the table a few times, reusing the same nodes */
+    for (round = 0; round < 3; round++) {
+        ptrie_reset(ptrie);
+        for (i = round; i < 5000; i += 2)
+            ptrie_add(ptrie, keys[i], keys[i]);
+
+        n = 0;
+        foreach_ptrie_keyval(ptrie, 0, &key, &val) {
+            if (key != val || strcmp(key, keys[round + 2 * n]) != 0)
+                break;
+            n++;
+        }
+        fprintf(stderr, "round %d: %d keys, %d in order\n", 
+                round, ptrie_size(ptrie), n);
+    }
+
+    /* nothing to give back while the nodes are in use */
+    nbytes = ptrie_shrink(ptrie);
+    fprintf(stderr, "shrink with keys: %s\n", nbytes ? "released" : "nothing");
+
+    for (i = 0; i < 5000; i++)
+        ptrie_del(ptrie, keys[i]);
+
+    nbytes = ptrie_shrink(ptrie);
+    fprintf(stderr, "shrink when empty: %s\n", nbytes ? "released" : "nothing");
+
+    ptrie_add(ptrie, "again", "1");
+    fprintf(stderr, "ptrie_get(again) => %s\n", (char *)ptrie_get(ptrie, "again"));
+
+    ptrie_free(ptrie);
+}
+
+static void
+test_12(void)
+{
+    ptrie_t *ptrie;
+    char    *keys[] = { "a", "aa", "aac", "aac1", "aac1", "aac2", "ab", "b", "c" };
+    char    *vals[] = { "1", "2", "4", "5", "dup", "6", "3", "8", "9" };
+    char    *unsorted[] = { "a", "c", "b" };
+    char    *key;
+    char    *val;
+    int      n = sizeof(keys) / sizeof(keys[0]);
+
+    fprintf(stderr, "\ntest_12\n");
+
+    ptrie = ptrie_new();
+    ptrie_build_sorted(ptrie, (void **)keys, (void **)vals, n);
+
+    foreach_ptrie_keyval(ptrie, 0, &key, &val) {
+        fprintf(stderr, "%s => %s\n", key, val);
+    }
+
+    val = ptrie_get(ptrie, "aac2");
+    fprintf(stderr, "ptrie_get(aac2) => %s\n", val);
+
+    ptrie_add(ptrie, "aab", "10");
+    ptrie_del(ptrie, "aac");
+    fprintf(stderr, "added aab, deleted aac\n");
+
+    foreach_ptrie_keyval(ptrie, 0, &key, &val) {
+        fprintf(stderr, "%s => %s\n", key, val);
+    }
+
+    ptrie_free(ptrie);
+
+    fprintf(stderr, "unsorted input\n");
+
+    ptrie = ptrie_new();
+    ptrie_build_sorted(ptrie, (void **)unsorted, (void **)unsorted, 3);
+
+    foreach_ptrie_keyval(ptrie, 0, &key, &val) {
+        fprintf(stderr, "%s => %s\n", key, val);
+    }
+
+    ptrie_free(ptrie);
+}
+
+static void
+test_13(void)
+{
+    ptrie_t        *ptrie;
+    ptrie_frozen_t *pf;
+    char           *key;
+    char           *val;
+
+    fprintf(stderr, "\ntest_13\n");
+
+    ptrie = ptrie_new();
+    ptrie_add(ptrie, "a", "1");
+    ptrie_add(ptrie, "aa", "2");
+    ptrie_add(ptrie, "ab", "3");
+    ptrie_add(ptrie, "aac", "4");
+    ptrie_add(ptrie, "aac1", "5");
+    ptrie_add(ptrie, "aac2", "6");
+    ptrie_add(ptrie, "aac3", "7");
+    ptrie_add(ptrie, "b", "8");
+    ptrie_add(ptrie, "c", "9");
+
+    pf = ptrie_freeze(ptrie);
+    ptrie_free(ptrie);
+
+    fprintf(stderr, "frozen %d keys\n", ptrie_frozen_size(pf));
+
+    foreach_ptrie_frozen_keyval(pf, 0, &key, &val) {
+        fprintf(stderr, "%s => %s\n", key, val);
+    }
+
+    fprintf(stderr, "strings with prefix \"aac\"\n");
+
+    foreach_ptrie_frozen_keyval_with_prefix(pf, 0, "aac", strlen("aac")*8, &key, &val) {
+        fprintf(stderr, "%s => %s\n", key, val);
+    }
+
+    val = ptrie_frozen_get(pf, "aac3");
+    fprintf(stderr, "ptrie_frozen_get(aac3) => %s\n", val);
+    val = ptrie_frozen_get(pf, "aac4");
+    fprintf(stderr, "ptrie_frozen_get(aac4) => %s\n", val ? val : "(none)");
+
+    ptrie_frozen_free(pf);
+}
+
+static size_t
+strsize(void *str)
+{
+    return strlen(str) + 1;
+}
+
+static void
+test_14(void)
+{
+    ptrie_t        *ptrie;
+    ptrie_frozen_t *pf;
+    char           *path = "testpatricia.ptrie";
+    char           *key;
+    char           *val;
+
+    fprintf(stderr, "\ntest_14\n");
+
+    ptrie = ptrie_new();
+    ptrie_set_parm(ptrie, PTRIEPARM_VALSZ_FUNC, (void *)strsize);
+    ptrie_add(ptrie, "www.example.com", "192.0.2.1");
+    ptrie_add(ptrie, "www.example.net", "192.0.2.2");
+    ptrie_add(ptrie, "mail.example.com", "192.0.2.25");
+    ptrie_add(ptrie, "ns1.example.com", "192.0.2.53");
+
+    if (ptrie_save(ptrie, path) < 0) {
+        fprintf(stderr, "ptrie_save - %s\n", strerror(errno));
+        exit(1);
+    }
+
+    ptrie_free(ptrie);
+
+    if ((pf = ptrie_map(path)) == NULL) {
+        fprintf(stderr, "ptrie_map - %s\n", strerror(errno));
+        exit(1);
+    }
+
+    foreach_ptrie_frozen_keyval(pf, 0, &key, &val) {
+        fprintf(stderr, "%s => %s\n", key, val);
+    }
+
+    val = ptrie_frozen_get(pf, "mail.example.com");
+    fprintf(stderr, "ptrie_frozen_get(mail.example.com) => %s\n", val);
+
+    ptrie_frozen_free(pf);
+    unlink(path);
+
+    pf = ptrie_map(path);
+    fprintf(stderr, "ptrie_map after unlink => %s\n", pf ? "mapped" : strerror(errno));
+}
+
+static ptrie_t *test_15_ptrie;
+static int      test_15_done;
+static char     test_15_keys[1000][8];
+
+/*
+ * Reader for test_15: every even key stays in the trie and must 
+ * always be found, odd keys come and go but must never be found
+ * with someone else's value
+ */
+static void *
+test_15_reader(void *arg)
+{
+    ptrie_reader_t *rd;
+    long            bad = 0;
+    char           *val;
+    int             i;
+
+    rd = ptrie_reader_new(test_15_ptrie);
+
+    while (!__atomic_load_n(&test_15_done, __ATOMIC_ACQUIRE)) {
+        ptrie_read_lock(rd);
+        for (i = 0; i < 1000; i++) {
+            val = ptrie_get(test_15_ptrie, test_15_keys[i]);
+            if ((i % 2 == 0 && val == NULL) || (val && val != test_15_keys[i]))
+                bad++;
+        }
+        ptrie_read_unlock(rd);
+    }
+
+    ptrie_reader_free(test_15_ptrie, rd);
+    return (void *)bad;
+}
+
+static void
+test_15(void)
+{
+    pthread_t tid[4];
+    void     *bad;
+    long      nbad = 0;
+    int       round;
+    int       i;
+
+    fprintf(stderr, "\ntest_15\n");
+
+    test_15_ptrie = ptrie_new2(PTRIE_F_CONCURRENT);
+
+    for (i = 0; i < 1000; i++) {
+        sprintf(test_15_keys[i], "k%03d", i);
+        if (i % 2 == 0)
+            ptrie_add(test_15_ptrie, test_15_keys[i], test_15_keys[i]);
+    }
+
+    for (i = 0; i < 4; i++)
+        pthread_create(&tid[i], NULL, test_15_reader, NULL);
+
+    for (round = 0; round < 200; round++) {
+        for (i = 1; i < 1000; i += 2)
+            ptrie_add(test_15_ptrie, test_15_keys[i], test_15_keys[i]);
+        for (i = 1; i < 1000; i += 2)
+            ptrie_del(test_15_ptrie, test_15_keys[i]);
+    }
+
+    __atomic_store_n(&test_15_done, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < 4; i++) {
+        pthread_join(tid[i], &bad);
+        nbad += (long)bad;
+    }
+
+    fprintf(stderr, "ptrie_size => %d\n", ptrie_size(test_15_ptrie));
+    fprintf(stderr, "bad lookups => %ld\n", nbad);
+
+    errno = 0;
+    fprintf(stderr, "ptrie_new2(PTRIE_F_CONCURRENT|PTRIE_F_SEDGEWICK) => %s\n",
+            ptrie_new2(PTRIE_F_CONCURRENT | PTRIE_F_SEDGEWICK) ? "trie" : strerror(errno));
+
+    ptrie_free(test_15_ptrie);
+}
+
+static void
+test_16(void)
+{
+    ptrie_sharded_t      *ps;
+    ptrie_sharded_iter_t  iter;
+    char                 *key;
+    char                 *val;
+
+    fprintf(stderr, "\ntest_16\n");
+
+    /* shard on the last two bits of the first character */
+    ps = ptrie_sharded_new(0, 6, 2);
+    ptrie_sharded_add(ps, "a", "1");
+    ptrie_sharded_add(ps, "aa", "2");
+    ptrie_sharded_add(ps, "ab", "3");
+    ptrie_sharded_add(ps, "aac", "4");
+    ptrie_sharded_add(ps, "b", "5");
+    ptrie_sharded_add(ps, "bc", "6");
+    ptrie_sharded_add(ps, "c", "7");
+    ptrie_sharded_add(ps, "d", "8");
+    ptrie_sharded_add(ps, "zed", "9");
+
+    fprintf(stderr, "ptrie_sharded_size => %d\n", ptrie_sharded_size(ps));
+
+    foreach_ptrie_sharded_keyval(ps, &iter, &key, &val) {
+        fprintf(stderr, "%s => %s\n", key, val);
+    }
+
+    fprintf(stderr, "strings with prefix \"aa\"\n");
+
+    foreach_ptrie_sharded_keyval_with_prefix(ps, &iter, "aa", 16, &key, &val) {
+        fprintf(stderr, "%s => %s\n", key, val);
+    }
+
+    /* first 6 bits of 'a' are shared by 'a' to 'c', which are in different shards */
+    fprintf(stderr, "strings with 6 bit prefix \"a\"\n");
+
+    foreach_ptrie_sharded_keyval_with_prefix(ps, &iter, "a", 6, &key, &val) {
+        fprintf(stderr, "%s => %s\n", key, val);
+    }
+
+    fprintf(stderr, "deleting aa and c\n");
+    ptrie_sharded_del(ps, "aa");
+    ptrie_sharded_del(ps, "c");
+
+    val = ptrie_sharded_get(ps, "aac");
+    fprintf(stderr, "ptrie_sharded_get(aac) => %s\n", val);
+    val = ptrie_sharded_get(ps, "c");
+    fprintf(stderr, "ptrie_sharded_get(c) => %s\n", val ? val : "(none)");
+    fprintf(stderr, "ptrie_sharded_size => %d\n", ptrie_sharded_size(ps));
+
+    ptrie_sharded_free(ps);
+}
+
+static void
+test_17(void)
+{
+    ptrie_t        *ptrie;
+    ptrie_lc_t     *lc;
+    struct in_addr  addr;
+    char           *val;
+    int             maxdepth;
+    int             i;
+    struct route {
+        char *net;
+        int   nbits;
+        char *str;
+    } *rt, routes[] = {
+        { "0.0.0.0",     0,  "default" },
+        { "10.0.0.0",    8,  "10/8" },
+        { "10.1.0.0",    16, "10.1/16" },
+        { "10.1.2.0",    24, "10.1.2/24" },
+        { "10.0.0.0",    16, "10.0/16" },
+        { "192.168.0.0", 16, "192.168/16" },
+        { "192.168.2.1", 32, "192.168.2.1/32" },
+        { 0, 0, 0 }
+    };
+    char *lookups[] = {
+        "10.1.2.3", "10.1.3.3", "10.2.0.1", "10.0.0.1", "192.168.2.1",
+        "192.168.2.2", "172.16.0.1", 0
+    }, **lk;
+    char nets[256][16];
+
+    fprintf(stderr, "\ntest_17\n");
+
+    ptrie = ptrie_new();
+    ptrie_set_parm(ptrie, PTRIEPARM_KEYSZ, (void *)sizeof(struct in_addr));
+
+    for (rt = routes; rt->net; rt++) {
+        addr.s_addr = inet_addr(rt->net);
+        ptrie_add_prefix(ptrie, &addr, rt->nbits, rt->str);
+    }
+
+    lc = ptrie_lc_build(ptrie, 0);
+
+    for (lk = lookups; *lk; lk++) {
+        addr.s_addr = inet_addr(*lk);
+        val = ptrie_lc_lpm(lc, &addr);
+        fprintf(stderr, "ptrie_lc_lpm(%s) => %s\n", *lk, val ? val : "(none)");
+    }
+
+    addr.s_addr = inet_addr("192.168.2.1");
+    val = ptrie_lc_get(lc, &addr);
+    fprintf(stderr, "ptrie_lc_get(192.168.2.1) => %s\n", val ? val : "(none)");
+    addr.s_addr = inet_addr("10.1.2.0");
+    val = ptrie_lc_get(lc, &addr);
+    fprintf(stderr, "ptrie_lc_get(10.1.2.0) => %s\n", val ? val : "(none)");
+
+    ptrie_lc_free(lc);
+
+    /* a /16 full of /24s is dense enough for a wide node */
+    for (i = 0; i < 256; i++) {
+        sprintf(nets[i], "172.16.%d.0", i);
+        addr.s_addr = inet_addr(nets[i]);
+        ptrie_add_prefix(ptrie, &addr, 24, nets[i]);
+    }
+
+    lc = ptrie_lc_build(ptrie, 0);
+    ptrie_lc_depth(lc, &maxdepth, NULL);
+    fprintf(stderr, "ptrie_lc_size => %d, max depth %d\n", ptrie_lc_size(lc), maxdepth);
+
+    addr.s_addr = inet_addr("172.16.77.1");
+    val = ptrie_lc_lpm(lc, &addr);
+    fprintf(stderr, "ptrie_lc_lpm(172.16.77.1) => %s\n", val ? val : "(none)");
+
+    ptrie_lc_free(lc);
+    ptrie_free(ptrie);
+}
+
+static void
+test_18(void)
+{
+    ptrie_t         *ptrie;
+    ptrie_poptrie_t *pp;
+    struct in_addr   addr;
+    char            *val;
+    struct route {
+        char *net;
+        int   nbits;
+        char *str;
+    } *rt, routes[] = {
+        { "0.0.0.0",     0,  "default" },
+        { "10.0.0.0",    8,  "10/8" },
+        { "10.1.0.0",    16, "10.1/16" },
+        { "10.1.2.0",    24, "10.1.2/24" },
+        { "10.0.0.0",    16, "10.0/16" },
+        { "10.1.2.128",  25, "10.1.2.128/25" },
+        { "192.168.0.0", 16, "192.168/16" },
+        { "192.168.2.1", 32, "192.168.2.1/32" },
+        { 0, 0, 0 }
+    };
+    char *lookups[] = {
+        "10.1.2.3", "10.1.2.200", "10.1.3.3", "10.2.0.1", "10.0.0.1", 
+        "192.168.2.1", "192.168.2.2", "172.16.0.1", 0
+    }, **lk;
+
+    fprintf(stderr, "\ntest_18\n");
+
+    ptrie = ptrie_new();
+    ptrie_set_parm(ptrie, PTRIEPARM_KEYSZ, (void *)sizeof(struct in_addr));
+
+    for (rt = routes; rt->net; rt++) {
+        addr.s_addr = inet_addr(rt->net);
+        ptrie_add_prefix(ptrie, &addr, rt->nbits, rt->str);
+    }
+
+    pp = ptrie_poptrie_build(ptrie);
+
+    for (lk = lookups; *lk; lk++) {
+        addr.s_addr = inet_addr(*lk);
+        val = ptrie_poptrie_lpm(pp, &addr);
+        fprintf(stderr, "ptrie_poptrie_lpm(%s) => %s\n", *lk, val ? val : "(none)");
+    }
+
+    ptrie_poptrie_free(pp);
+    ptrie_free(ptrie);
+
+    /* string keys have no fixed size */
+    ptrie = ptrie_new();
+    errno = 0;
+    pp = ptrie_poptrie_build(ptrie);
+    fprintf(stderr, "ptrie_poptrie_build(string keys) => %s\n", pp ? "poptrie" : strerror(errno));
+    ptrie_free(ptrie);
+}
+
+static void
+test_19(void)
+{
+    ptrie_t *ptrie;
+    char     buf[64];
+    char    *key;
+    char    *val;
+    char    *words[] = {
+        "b", "a", "aac", "ab", "a-key-too-long-to-fit-in-a-leaf", "aa", 0
+    }, **w;
+
+    fprintf(stderr, "\ntest_19\n");
+
+    ptrie = ptrie_new2(PTRIE_F_OWNKEYS);
+
+    /* the trie copies the key, so the buffer can be reused */
+    for (w = words; *w; w++) {
+        strcpy(buf, *w);
+        ptrie_add(ptrie, buf, *w);
+        memset(buf, 'x', sizeof(buf) - 1);
+    }
+
+    foreach_ptrie_keyval(ptrie, 0, &key, &val) {
+        fprintf(stderr, "%s => %s%s\n", key, val, key == val ? " (not copied)" : "");
+    }
+
+    ptrie_del(ptrie, "a-key-too-long-to-fit-in-a-leaf");
+    ptrie_del(ptrie, "aac");
+
+    val = ptrie_get(ptrie, "ab");
+    fprintf(stderr, "ptrie_get(ab) => %s\n", val ? val : "(none)");
+    val = ptrie_get(ptrie, "aac");
+    fprintf(stderr, "ptrie_get(aac) => %s\n", val ? val : "(none)");
+    fprintf(stderr, "ptrie_size => %d\n", ptrie_size(ptrie));
+
+    errno = 0;
+    fprintf(stderr, "ptrie_new2(PTRIE_F_OWNKEYS|PTRIE_F_SEDGEWICK) => %s\n",
+            ptrie_new2(PTRIE_F_OWNKEYS | PTRIE_F_SEDGEWICK) ? "trie" : strerror(errno));
+
+    ptrie_free(ptrie);
+}
+
+static void
+test_20(void)
+{
+    ptrie_t        *ptrie;
+    ptrie_t        *lc_ptrie;
+    ptrie_frozen_t *pf;
+    ptrie_lc_t     *lc;
+    ptrie_iter_t    iter;
+    uint8_t        *key;
+    size_t          keysz;
+    char           *val;
+    size_t          i;
+    uint32_t        flags[] = { 0, PTRIE_F_SEDGEWICK };
+    int             f;
+    struct {
+        char   *key;
+        size_t  keysz;
+    } keys[] = {
+        { "a\0b", 3 }, { "a\0c", 3 }, { "\0\1", 2 }, { "ab", 2 }, { "a\0b\0\1", 5 }, 
+        { "a", 1 }, { "a\0", 2 }, { "\0", 1 }, { "\0\0", 2 }, { "ab\0", 3 },
+    };
+
+    fprintf(stderr, "\ntest_20\n");
+
+    for (f = 0; f < 2; f++) {
+        fprintf(stderr, "%s:\n", flags[f] ? "sedgewick" : "default");
+
+        /* 
+         * binary keys with embedded nuls, so strlen can't size them;
+         * keys that only differ by trailing nuls are distinct 
+         */
+        ptrie = ptrie_new2(flags[f]);
+        for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+            ptrie_add_len(ptrie, keys[i].key, keys[i].keysz, (void *)(intptr_t)(i + 1));
+
+        foreach_ptrie_keyval_len(ptrie, &iter, &key, &keysz, &val) {
+            for (i = 0; i < keysz; i++)
+                fprintf(stderr, "%02x", key[i]);
+            fprintf(stderr, " => %d\n", (int)(intptr_t)val);
+        }
+
+        for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+            if ((intptr_t)ptrie_get_len(ptrie, keys[i].key, keys[i].keysz) != (intptr_t)(i + 1))
+                fprintf(stderr, "ptrie_get_len(keys[%d]) => wrong value\n", (int)i);
+        }
+
+        /* the frozen copy keeps the size of each key */
+        pf = ptrie_freeze(ptrie);
+        for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+            if ((intptr_t)ptrie_frozen_get_len(pf, keys[i].key, keys[i].keysz) != (intptr_t)(i + 1))
+                fprintf(stderr, "ptrie_frozen_get_len(keys[%d]) => wrong value\n", (int)i);
+        }
+        fprintf(stderr, "ptrie_frozen_size => %d\n", ptrie_frozen_size(pf));
+        ptrie_frozen_free(pf);
+
+        /* an LC-trie can't tell "a" from "a\0" */
+        errno = 0;
+        lc = ptrie_lc_build(ptrie, 0);
+        fprintf(stderr, "ptrie_lc_build => %s (%s)\n", lc ? "trie" : "NULL", 
+                errno == EINVAL ? "EINVAL" : "no error");
+        ptrie_lc_free(lc);
+
+        fprintf(stderr, "ptrie_get_len(a\\0c) => %d\n", (int)(intptr_t)ptrie_get_len(ptrie, "a\0c", 3));
+        fprintf(stderr, "ptrie_haskey_len(a\\0d) => %d\n", ptrie_haskey_len(ptrie, "a\0d", 3));
+        fprintf(stderr, "ptrie_haskey_len(\\0\\0\\0) => %d\n", ptrie_haskey_len(ptrie, "\0\0\0", 3));
+
+        ptrie_iter_seek_len(ptrie, &iter, "a\0\0", 3);
+        ptrie_iter_next_len(ptrie, &iter, (void **)&key, &keysz, (void **)&val);
+        fprintf(stderr, "seek a\\0\\0 => %d bytes => %d\n", (int)keysz, (int)(intptr_t)val);
+
+        ptrie_lower_bound_len(ptrie, "a\0", 2, (void **)&key, &keysz, (void **)&val);
+        fprintf(stderr, "lower_bound(a\\0) => %d bytes => %d, ", (int)keysz, (int)(intptr_t)val);
+        ptrie_upper_bound_len(ptrie, "a\0", 2, (void **)&key, &keysz, (void **)&val);
+        fprintf(stderr, "upper_bound(a\\0) => %d bytes => %d\n", (int)keysz, (int)(intptr_t)val);
+        ptrie_prev_len(ptrie, "a\0", 2, (void **)&key, &keysz, (void **)&val);
+        fprintf(stderr, "prev(a\\0) => %d bytes => %d, ", (int)keysz, (int)(intptr_t)val);
+        ptrie_next_len(ptrie, "a", 1, (void **)&key, &keysz, (void **)&val);
+        fprintf(stderr, "next(a) => %d bytes => %d\n", (int)keysz, (int)(intptr_t)val);
+
+        fprintf(stderr, "reverse:");
+        foreach_ptrie_keyval_len_reverse(ptrie, &iter, &key, &keysz, &val) {
+            fprintf(stderr, " %d/%d", (int)(intptr_t)val, (int)keysz);
+        }
+        fprintf(stderr, "\n");
+
+        fprintf(stderr, "prefix a\\0b:\n");
+        foreach_ptrie_keyval_with_prefix_len(ptrie, &iter, "a\0b", 3, 24, &key, &keysz, &val) {
+            fprintf(stderr, "  %d bytes => %d\n", (int)keysz, (int)(intptr_t)val);
+        }
+        fprintf(stderr, "prefix a, keys:");
+        foreach_ptrie_key_with_prefix_len(ptrie, &iter, "a", 1, 8, &key, &keysz) {
+            fprintf(stderr, " %d", (int)keysz);
+        }
+        fprintf(stderr, ", vals:");
+        foreach_ptrie_val_with_prefix_len(ptrie, &iter, "a", 1, 8, &val) {
+            fprintf(stderr, " %d", (int)(intptr_t)val);
+        }
+        fprintf(stderr, "\nkeys:");
+        foreach_ptrie_key_len(ptrie, &iter, &key, &keysz) {
+            fprintf(stderr, " %d", (int)keysz);
+        }
+        fprintf(stderr, "\n");
+
+        ptrie_del_len(ptrie, "a\0b", 3);
+        fprintf(stderr, "ptrie_haskey_len(a\\0b) => %d\n", ptrie_haskey_len(ptrie, "a\0b", 3));
+
+        /* without the keys that only differ by trailing nuls it can */
+        lc_ptrie = ptrie_new();
+        ptrie_add_len(lc_ptrie, "a\0b", 3, (void *)1);
+        ptrie_add_len(lc_ptrie, "a\0c", 3, (void *)2);
+        ptrie_add_len(lc_ptrie, "\0\1", 2, (void *)3);
+        lc = ptrie_lc_build(lc_ptrie, 0);
+        fprintf(stderr, "ptrie_lc_get_len(a\\0c) => %d, ptrie_lc_get_len(a) => %d\n",
+                (int)(intptr_t)ptrie_lc_get_len(lc, "a\0c", 3), (int)(intptr_t)ptrie_lc_get_len(lc, "a", 1));
+        ptrie_lc_free(lc);
+        ptrie_free(lc_ptrie);
+
+        ptrie_del_len(ptrie, "a", 1);
+        fprintf(stderr, "ptrie_haskey_len(a) => %d, ptrie_get_len(a\\0) => %d\n", 
+                ptrie_haskey_len(ptrie, "a", 1), (int)(intptr_t)ptrie_get_len(ptrie, "a\0", 2));
+        fprintf(stderr, "ptrie_size => %d\n", ptrie_size(ptrie));
+
+        ptrie_free(ptrie);
+    }
+}
+
+static void
+test_21(void)
+{
+    ptrie_t      *ptrie;
+    ptrie_iter_t  iter;
+    char         *key;
+    char         *val;
+    char         *words[] = {
+        "apple", "apricot", "banana", "blueberry", "cherry", "date", "fig", "grape", 0
+    }, **w;
+    char         *probes[] = { "a", "apricot", "b", "cz", "zebra", 0 }, **p;
+    uint32_t      flags[] = { 0, PTRIE_F_SEDGEWICK };
+    int           i;
+
+    fprintf(stderr, "\ntest_21\n");
+
+    for (i = 0; i < 2; i++) {
+        fprintf(stderr, "%s:\n", flags[i] ? "sedgewick" : "default");
+
+        ptrie = ptrie_new2(flags[i]);
+        for (w = words; *w; w++)
+            ptrie_add(ptrie, *w, *w);
+
+        for (p = probes; *p; p++) {
+            fprintf(stderr, "lower_bound(%s) => %s, ", *p, 
+                    ptrie_lower_bound(ptrie, *p, (void **)&key, NULL) ? key : "(none)");
+            fprintf(stderr, "upper_bound(%s) => %s\n", *p, 
+                    ptrie_upper_bound(ptrie, *p, NULL, (void **)&val) ? val : "(none)");
+        }
+
+        fprintf(stderr, "[b, d):");
+        foreach_ptrie_keyval_range(ptrie, &iter, "b", "d", &key, &val) {
+            fprintf(stderr, " %s", key);
+        }
+        fprintf(stderr, "\n");
+
+        /* pages of 3 keys, each starting just past the last one */
+        ptrie_iter_init(ptrie, 0, &iter);
+        while (ptrie_iter_next(ptrie, &iter, (void **)&key, NULL)) {
+            fprintf(stderr, "page: %s", key);
+            if (ptrie_iter_next(ptrie, &iter, (void **)&key, NULL))
+                fprintf(stderr, " %s", key);
+            if (ptrie_iter_next(ptrie, &iter, (void **)&key, NULL))
+                fprintf(stderr, " %s", key);
+            fprintf(stderr, "\n");
+
+            if (ptrie_upper_bound(ptrie, key, (void **)&key, NULL)) {
+                ptrie_iter_init(ptrie, 0, &iter);
+                ptrie_iter_seek(ptrie, &iter, key);
+            } else {
+                break;
+            }
+        }
+
+        ptrie_free(ptrie);
+    }
+}
+
+static void
+test_22(void)
+{
+    ptrie_t      *ptrie;
+    ptrie_iter_t  iter;
+    uint32_t      ts[] = { 1000, 1060, 1120, 1300, 1500 };
+    char         *vals[] = { "boot", "login", "update", "logout", "halt" };
+    uint32_t      probes[] = { 999, 1000, 1200, 1500, 2000 };
+    uint32_t      t;
+    uint32_t     *key;
+    char         *val;
+    uint32_t      flags[] = { 0, PTRIE_F_SEDGEWICK };
+    int           i;
+    int           j;
+
+    fprintf(stderr, "\ntest_22\n");
+
+    for (i = 0; i < 2; i++) {
+        fprintf(stderr, "%s:\n", flags[i] ? "sedgewick" : "default");
+
+        /* big-endian timestamps sort in time order */
+        ptrie = ptrie_new2(flags[i]);
+        ptrie_set_parm(ptrie, PTRIEPARM_KEYSZ, (void *)sizeof(uint32_t));
+        for (j = 0; j < 5; j++) {
+            ts[j] = htonl(ts[j]);
+            ptrie_add(ptrie, &ts[j], vals[j]);
+        }
+
+        ptrie_min(ptrie, (void **)&key, (void **)&val);
+        fprintf(stderr, "ptrie_min => %u %s\n", ntohl(*key), val);
+        ptrie_max(ptrie, (void **)&key, (void **)&val);
+        fprintf(stderr, "ptrie_max => %u %s\n", ntohl(*key), val);
+
+        for (j = 0; j < 5; j++) {
+            t = htonl(probes[j]);
+            fprintf(stderr, "before %u => %s, ", probes[j], 
+                    ptrie_prev(ptrie, &t, NULL, (void **)&val) ? val : "(none)");
+            fprintf(stderr, "after %u => %s\n", probes[j], 
+                    ptrie_next(ptrie, &t, NULL, (void **)&val) ? val : "(none)");
+        }
+
+        fprintf(stderr, "newest first:");
+        foreach_ptrie_keyval_reverse(ptrie, &iter, &key, &val) {
+            fprintf(stderr, " %u %s", ntohl(*key), val);
+        }
+        fprintf(stderr, "\n");
+
+        for (j = 0; j < 5; j++)
+            ts[j] = ntohl(ts[j]);
+
+        ptrie_free(ptrie);
+    }
+}
+
+static void
+test_23_count(void *key, void *val, void *arg)
+{
+    __atomic_fetch_add((int *)arg, (int)(intptr_t)val, __ATOMIC_RELAXED);
+}
+
+static void
+test_23(void)
+{
+    ptrie_t      *ptrie;
+    ptrie_iter_t  iters[4];
+    char         *key;
+    char         *words[] = { "a", "aa", "ab", "aac", "aac1", "aac2", "aac3", "b", "c", 0 };
+    uint32_t      flags[] = { 0, PTRIE_F_SEDGEWICK };
+    int           sum;
+    int           n;
+    int           i;
+    int           j;
+
+    fprintf(stderr, "\ntest_23\n");
+
+    for (i = 0; i < 2; i++) {
+        fprintf(stderr, "%s:\n", flags[i] ? "sedgewick" : "default");
+
+        ptrie = ptrie_new2(flags[i]);
+        for (j = 0; words[j]; j++)
+            ptrie_add(ptrie, words[j], (void *)(intptr_t)(j + 1));
+
+        n = ptrie_iter_split(ptrie, NULL, 4, iters);
+        for (j = 0; j < n; j++) {
+            fprintf(stderr, "part %d:", j);
+            while (ptrie_iter_next(ptrie, &iters[j], (void **)&key, NULL))
+                fprintf(stderr, " %s", key);
+            fprintf(stderr, "\n");
+        }
+
+        sum = 0;
+        ptrie_parallel_foreach(ptrie, NULL, 3, test_23_count, &sum);
+        fprintf(stderr, "ptrie_parallel_foreach sum => %d\n", sum);
+
+        ptrie_free(ptrie);
+    }
+}
+
+static void
+test_24(void)
+{
+    ptrie_t      *ptrie1;
+    ptrie_t      *ptrie2;
+    ptrie_iter_t  iter1;
+    ptrie_iter_t  iter2;
+    char        **keys;
+    void        **vals;
+    char         *key1, *key2;
+    void         *val1, *val2;
+    int           n = 20000;
+    int           same = 1;
+    int           i;
+
+    fprintf(stderr, "\ntest_24\n");
+
+    keys = malloc(n * sizeof(*keys));
+    vals = malloc(n * sizeof(*vals));
+
+    /* every key twice, scattered: the first value should win */
+    for (i = 0; i < n; i++) {
+        keys[i] = malloc(16);
+        sprintf(keys[i], "k%05d", (i * 7919) % (n / 2));
+        vals[i] = (void *)(intptr_t)(i + 1);
+    }
+
+    ptrie1 = ptrie_new();
+    for (i = 0; i < n; i++)
+        ptrie_add(ptrie1, keys[i], vals[i]);
+
+    ptrie2 = ptrie_new();
+    ptrie_build_parallel(ptrie2, (void **)keys, vals, n, 4);
+
+    fprintf(stderr, "ptrie_size => %d %d\n", ptrie_size(ptrie1), ptrie_size(ptrie2));
+
+    ptrie_iter_init(ptrie1, 0, &iter1);
+    ptrie_iter_init(ptrie2, 0, &iter2);
+    while (ptrie_iter_next(ptrie1, &iter1, (void **)&key1, &val1)) {
+        if (!ptrie_iter_next(ptrie2, &iter2, (void **)&key2, &val2) ||
+            strcmp(key1, key2) != 0 || val1 != val2) {
+            same = 0;
+        }
+    }
+    if (ptrie_iter_next(ptrie2, &iter2, (void **)&key2, &val2))
+        same = 0;
+    fprintf(stderr, "same keys and values => %s\n", same ? "yes" : "no");
+
+    ptrie_del(ptrie2, "k00042");
+    ptrie_add(ptrie2, "k99999", "new");
+    fprintf(stderr, "ptrie_get(k00042) => %s, ptrie_get(k99999) => %s\n",
+            ptrie_get(ptrie2, "k00042") ? "found" : "(none)", (char *)ptrie_get(ptrie2, "k99999"));
+
+    ptrie_free(ptrie1);
+    ptrie_free(ptrie2);
+    for (i = 0; i < n; i++)
+        free(keys[i]);
+    free(keys);
+    free(vals);
+}
+
+static void
+test_25(void)
+{
+    ptrie_t      *ptrie1;
+    ptrie_t      *ptrie2;
+    ptrie_iter_t  iter;
+    char         *keys1[] = { "apple", "banana", "cherry", "grape", "lemon", "mango", NULL };
+    char         *keys2[] = { "banana", "date", "grape", "kiwi", "mango", "melon", NULL };
+    char         *key;
+    char         *val;
+    int           i;
+    int           op;
+
+    fprintf(stderr, "\ntest_25\n");
+
+    for (op = 0; op < 3; op++) {
+        ptrie1 = ptrie_new();
+        ptrie2 = ptrie_new();
+
+        for (i = 0; keys1[i]; i++)
+            ptrie_add(ptrie1, keys1[i], "1");
+        for (i = 0; keys2[i]; i++)
+            ptrie_add(ptrie2, keys2[i], "2");
+
+        switch (op) {
+        case 0:
+            ptrie_union(ptrie1, ptrie2);
+            fprintf(stderr, "ptrie_union:");
+            break;
+        case 1:
+            ptrie_intersect(ptrie1, ptrie2);
+            fprintf(stderr, "ptrie_intersect:");
+            break;
+        default:
+            ptrie_diff(ptrie1, ptrie2);
+            fprintf(stderr, "ptrie_diff:");
+            break;
+        }
+
+        foreach_ptrie_keyval(ptrie1, &iter, &key, &val)
+            fprintf(stderr, " %s=%s", key, val);
+        fprintf(stderr, " (size %d)\n", ptrie_size(ptrie1));
+
+        fprintf(stderr, "ptrie_get(melon) => %s, ptrie_haskey(grape) => %d\n",
+                ptrie_get(ptrie1, "melon") ? (char *)ptrie_get(ptrie1, "melon") : "(none)",
+                ptrie_haskey(ptrie1, "grape"));
+
+        ptrie_free(ptrie1);
+        ptrie_free(ptrie2);
+    }
+
+    /* an empty trie on either side */
+    ptrie1 = ptrie_new();
+    ptrie2 = ptrie_new();
+    for (i = 0; keys2[i]; i++)
+        ptrie_add(ptrie2, keys2[i], "2");
+    ptrie_union(ptrie1, ptrie2);
+    fprintf(stderr, "union with empty => size %d\n", ptrie_size(ptrie1));
+    ptrie_diff(ptrie1, ptrie2);
+    fprintf(stderr, "diff with itself => size %d\n", ptrie_size(ptrie1));
+    ptrie_free(ptrie1);
+    ptrie_free(ptrie2);
+
+    ptrie1 = ptrie_new2(PTRIE_F_SEDGEWICK);
+    ptrie2 = ptrie_new();
+    fprintf(stderr, "ptrie_union(sedgewick) => %d\n", ptrie_union(ptrie1, ptrie2));
+    ptrie_free(ptrie1);
+    ptrie_free(ptrie2);
+}
+
+static void
+test_26(void)
+{
+    ptrie_t          *ptrie;
+    ptrie_snapshot_t *snap1;
+    ptrie_snapshot_t *snap2;
+    ptrie_iter_t      iter;
+    char             *keys[] = { "red", "green", "blue", "cyan", "magenta", "yellow", NULL };
+    char             *key;
+    char             *val;
+    int               i;
+
+    fprintf(stderr, "\ntest_26\n");
+
+    ptrie = ptrie_new2(PTRIE_F_PERSISTENT);
+    for (i = 0; keys[i]; i++)
+        ptrie_add(ptrie, keys[i], keys[i]);
+
+    snap1 = ptrie_snapshot(ptrie);
+
+    ptrie_del(ptrie, "green");
+    ptrie_del(ptrie, "cyan");
+    ptrie_add(ptrie, "black", "black");
+    ptrie_add(ptrie, "white", "white");
+
+    snap2 = ptrie_snapshot(ptrie);
+    ptrie_del(ptrie, "red");
+
+    fprintf(stderr, "snap1:");
+    foreach_ptrie_snapshot_keyval(snap1, &iter, &key, &val)
+        fprintf(stderr, " %s", key);
+    fprintf(stderr, " (size %d)\n", ptrie_snapshot_size(snap1));
+
+    fprintf(stderr, "snap2:");
+    foreach_ptrie_snapshot_keyval(snap2, &iter, &key, &val)
+        fprintf(stderr, " %s", key);
+    fprintf(stderr, " (size %d)\n", ptrie_snapshot_size(snap2));
+
+    fprintf(stderr, "ptrie:");
+    foreach_ptrie_keyval(ptrie, &iter, &key, &val)
+        fprintf(stderr, " %s", key);
+    fprintf(stderr, " (size %d)\n", ptrie_size(ptrie));
+
+    fprintf(stderr, "ptrie_snapshot_get(snap1, green) => %s, ptrie_get(green) => %s\n",
+            (char *)ptrie_snapshot_get(snap1, "green"), 
+            ptrie_get(ptrie, "green") ? (char *)ptrie_get(ptrie, "green") : "(none)");
+
+    ptrie_snapshot_free(snap2);
+
+    /* roll back to the first snapshot */
+    ptrie_snapshot_restore(ptrie, snap1);
+    ptrie_del(ptrie, "blue");
+    ptrie_snapshot_free(snap1);
+
+    fprintf(stderr, "restored:");
+    foreach_ptrie_keyval(ptrie, &iter, &key, &val)
+        fprintf(stderr, " %s", key);
+    fprintf(stderr, " (size %d)\n", ptrie_size(ptrie));
+
+    ptrie_free(ptrie);
+
+    ptrie = ptrie_new();
+    fprintf(stderr, "ptrie_snapshot(not persistent) => %s\n", ptrie_snapshot(ptrie) ? "snapshot" : "NULL");
+    ptrie_free(ptrie);
+}
+
+static void
+test_27(void)
+{
+    ptrie_t       *ptrie;
+    ptrie_stats_t  st;
+    char          *keys[] = { "red", "green", "blue", "cyan", "magenta", "yellow", 
+                              "black", "white", NULL };
+    int            i;
+    int            j;
+    int            mode;
+
+    fprintf(stderr, "\ntest_27\n");
+
+    for (mode = 0; mode < 2; mode++) {
+        ptrie = ptrie_new2(mode ? PTRIE_F_SEDGEWICK : 0);
+        for (i = 0; keys[i]; i++)
+            ptrie_add(ptrie, keys[i], keys[i]);
+
+        ptrie_add(ptrie, "red", "red");
+        ptrie_get(ptrie, "blue");
+        ptrie_get(ptrie, "purple");
+        ptrie_del(ptrie, "cyan");
+        ptrie_del(ptrie, "white");
+
+        ptrie_stats(ptrie, &st);
+
+        fprintf(stderr, "%s: nodes %zu, leaves %zu, freelist %zu, bytes > 0 %d\n",
+                mode ? "sedgewick" : "patricia", st.nodes, st.leaves, st.freelist, st.bytes > 0);
+        fprintf(stderr, "depth:");
+        for (j = 0; j < PTRIE_STATS_DEPTHS; j++) {
+            if (st.depth[j])
+                fprintf(stderr, " %d=%zu", j, st.depth[j]);
+        }
+        fprintf(stderr, " (avg %.2f, max %d)\n", st.avgdepth, st.maxdepth);
+
+        fprintf(stderr, "keysz:");
+        for (j = 0; j < PTRIE_STATS_KEYSZS; j++) {
+            if (st.keysz[j])
+                fprintf(stderr, " %d-%d=%zu", 1 << j, (2 << j) - 1, st.keysz[j]);
+        }
+        fprintf(stderr, " (avg %.2f, max %zu)\n", st.avgkeysz, st.maxkeysz);
+
+#ifdef PTRIE_STATS
+        fprintf(stderr, "counts: hits %llu, misses %llu, adds %llu, dups %llu, dels %llu\n",
+                (unsigned long long)st.counts.hits, (unsigned long long)st.counts.misses,
+                (unsigned long long)st.counts.adds, (unsigned long long)st.counts.dups,
+                (unsigned long long)st.counts.dels);
+#endif
+
+        ptrie_free(ptrie);
+    }
+
+    ptrie = ptrie_new();
+    ptrie_stats(ptrie, &st);
+    fprintf(stderr, "empty: nodes %zu, leaves %zu, maxdepth %d\n", st.nodes, st.leaves, st.maxdepth);
+    ptrie_free(ptrie);
+}
+
+static void
+test_28(void)
+{
+    ptrie_t       *ptrie;
+    ptrie_stats_t  st;
+    void          *pnode;
+    char          *keys[] = { "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", NULL };
+    int            i;
+
+    fprintf(stderr, "\ntest_28\n");
+
+    ptrie = ptrie_new();
+    ptrie_set_parm(ptrie, PTRIEPARM_CACHESZ, (void *)64);
+
+    for (i = 0; keys[i]; i++)
+        ptrie_add(ptrie, keys[i], keys[i]);
+
+    for (i = 0; i < 3; i++) {
+        ptrie_get(ptrie, "charlie");
+        ptrie_get(ptrie, "echo");
+    }
+    ptrie_get(ptrie, "golf");
+
+    ptrie_stats(ptrie, &st);
+    fprintf(stderr, "cachesz %zu, hits %llu, misses %llu\n", st.cachesz,
+            (unsigned long long)st.cache_hits, (unsigned long long)st.cache_misses);
+
+    /* deleted keys must not be found through the cache */
+    ptrie_del(ptrie, "charlie");
+    fprintf(stderr, "after ptrie_del: ptrie_get(charlie) => %s\n",
+            ptrie_get(ptrie, "charlie") ? (char *)ptrie_get(ptrie, "charlie") : "(none)");
+
+    ptrie_add2(ptrie, "charlie", "charlie again", &pnode);
+    fprintf(stderr, "re-added: ptrie_get(charlie) => %s\n", (char *)ptrie_get(ptrie, "charlie"));
+
+    ptrie_del_pnode(ptrie, pnode);
+    ptrie_add(ptrie, "hotel", "hotel");
+    fprintf(stderr, "after ptrie_del_pnode: ptrie_get(charlie) => %s, ptrie_get(hotel) => %s\n",
+            ptrie_get(ptrie, "charlie") ? (char *)ptrie_get(ptrie, "charlie") : "(none)",
+            (char *)ptrie_get(ptrie, "hotel"));
+
+    ptrie_reset(ptrie);
+    fprintf(stderr, "after ptrie_reset: ptrie_get(echo) => %s\n",
+            ptrie_get(ptrie, "echo") ? (char *)ptrie_get(ptrie, "echo") : "(none)");
+    ptrie_free(ptrie);
+
+    ptrie = ptrie_new2(PTRIE_F_SEDGEWICK);
+    errno = 0;
+    ptrie_set_parm(ptrie, PTRIEPARM_CACHESZ, (void *)64);
+    fprintf(stderr, "PTRIEPARM_CACHESZ on sedgewick trie => %s, ptrie_get_parm => %zu\n",
+            errno == EINVAL ? "EINVAL" : "ok", (size_t)ptrie_get_parm(ptrie, PTRIEPARM_CACHESZ));
+    ptrie_free(ptrie);
+
+    ptrie = ptrie_new2(PTRIE_F_PERSISTENT);
+    errno = 0;
+    ptrie_set_parm(ptrie, PTRIEPARM_CACHESZ, (void *)64);
+    fprintf(stderr, "PTRIEPARM_CACHESZ on persistent trie => %s, ptrie_get_parm => %zu\n",
+            errno == EINVAL ? "EINVAL" : "ok", (size_t)ptrie_get_parm(ptrie, PTRIEPARM_CACHESZ));
+    ptrie_free(ptrie);
+
+    ptrie = ptrie_new();
+    ptrie_set_parm(ptrie, PTRIEPARM_CACHESZ, (void *)100);
+    fprintf(stderr, "PTRIEPARM_CACHESZ 100 on plain trie => ptrie_get_parm => %zu\n",
+            (size_t)ptrie_get_parm(ptrie, PTRIEPARM_CACHESZ));
+    ptrie_free(ptrie);
+}
+
+static void
+test_29(void)
+{
+    ptrie_t *ptrie;
+    char    *keys[] = { "apple", "apricot", "avocado", "banana", "blueberry", "cherry", 
+                        "grape", "lemon", "lime", "mango", NULL };
+    char    *key;
+    int      i;
+
+    fprintf(stderr, "\ntest_29\n");
+
+    ptrie = ptrie_new2(PTRIE_F_COUNTS);
+    for (i = 0; keys[i]; i++)
+        ptrie_add(ptrie, keys[i], keys[i]);
+
+    ptrie_del(ptrie, "banana");
+    ptrie_add(ptrie, "blackberry", "blackberry");
+
+    fprintf(stderr, "ptrie_count_prefix(a, 8) => %d\n", ptrie_count_prefix(ptrie, "a", 8));
+    fprintf(stderr, "ptrie_count_prefix(ap, 16) => %d\n", ptrie_count_prefix(ptrie, "ap", 16));
+    fprintf(stderr, "ptrie_count_prefix(bl, 16) => %d\n", ptrie_count_prefix(ptrie, "bl", 16));
+    fprintf(stderr, "ptrie_count_prefix(x, 8) => %d\n", ptrie_count_prefix(ptrie, "x", 8));
+    fprintf(stderr, "ptrie_count_prefix(any, 0) => %d\n", ptrie_count_prefix(ptrie, "", 0));
+
+    fprintf(stderr, "ptrie_rank(apple) => %d, ptrie_rank(cherry) => %d, ptrie_rank(mango) => %d\n",
+            ptrie_rank(ptrie, "apple"), ptrie_rank(ptrie, "cherry"), ptrie_rank(ptrie, "mango"));
+    fprintf(stderr, "ptrie_rank(coconut) => %d, ptrie_rank(zucchini) => %d\n",
+            ptrie_rank(ptrie, "coconut"), ptrie_rank(ptrie, "zucchini"));
+
+    fprintf(stderr, "ptrie_select:");
+    for (i = 0; ptrie_select(ptrie, i, (void **)&key, NULL); i++)
+        fprintf(stderr, " %d=%s", i, key);
+    fprintf(stderr, "\n");
+
+    ptrie_free(ptrie);
+
+    ptrie = ptrie_new();
+    fprintf(stderr, "ptrie_rank(no counts) => %d\n", ptrie_rank(ptrie, "apple"));
+    ptrie_free(ptrie);
+}